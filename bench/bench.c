@@ -0,0 +1,417 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2020 Himanshu Rijal
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Benchmark runner. Builds the shell in-process and times individual commands through the
+// same parser and dispatcher batch mode uses, so the numbers include everything a user sees.
+//
+//   cc -O2 -pthread -o bench bench/bench.c
+//   bench [-i iterations] [-r seed] [-s open,ls,cd,stat,get,read] [-o results.json] image
+//
+// Every scenario picks its targets (directories, files, offsets) with a seeded generator from
+// the paths found by walking the image, so the same image, seed and build replay the same
+// commands. Command output goes to /dev/null; the JSON report goes to stdout or -o.
+// Syscall counts come from /proc/self/io (syscr/syscw: read-like and write-like calls).
+
+#define main ShellMain
+#include "../main.c"
+#undef main
+#include "../fat32.c"
+
+#include <limits.h>
+#include <sys/resource.h>
+
+#define BENCH_SCENARIOS "open,ls,cd,stat,get,read"
+#define BENCH_READ_BYTES 512 //Bytes printed by each read command
+
+//A file or directory found in the image
+struct BenchPath
+{
+    char *path;
+    uint32_t size;
+};
+
+struct BenchPaths
+{
+    struct BenchPath *files;
+    int file_count;
+    int file_capacity;
+    struct BenchPath *directories;
+    int directory_count;
+    int directory_capacity;
+    pthread_mutex_t lock;
+};
+
+//Process counters sampled around a scenario
+struct BenchCounters
+{
+    uint64_t read_syscalls;
+    uint64_t write_syscalls;
+    long minor_faults;
+    long major_faults;
+    long context_switches;
+};
+
+uint64_t bench_rng = 1;
+struct BenchCounters counter_overhead; //What sampling /proc/self/io itself adds, subtracted from every delta
+
+
+static uint64_t BenchRandom( void )
+{
+    bench_rng ^= bench_rng >> 12;
+    bench_rng ^= bench_rng << 25;
+    bench_rng ^= bench_rng >> 27;
+    return bench_rng * 2685821657736338717ULL;
+}
+
+
+static double Now( void )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+static void ReadCounters( struct BenchCounters *counters )
+{
+    char line[128];
+    struct rusage usage;
+    FILE *io = fopen( "/proc/self/io", "r" );
+
+    memset( counters, 0, sizeof(struct BenchCounters) );
+    while( io != NULL && fgets( line, sizeof(line), io ) != NULL )
+    {
+        unsigned long long value = 0;
+        if( sscanf( line, "syscr: %llu", &value ) == 1 )
+        {
+            counters->read_syscalls = value;
+        }
+        else if( sscanf( line, "syscw: %llu", &value ) == 1 )
+        {
+            counters->write_syscalls = value;
+        }
+    }
+    if( io != NULL )
+    {
+        fclose( io );
+    }
+
+    getrusage( RUSAGE_SELF, &usage );
+    counters->minor_faults = usage.ru_minflt;
+    counters->major_faults = usage.ru_majflt;
+    counters->context_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+
+static void AddPath( struct BenchPath **list, int *count, int *capacity, const char *path, uint32_t size )
+{
+    if( *count == *capacity )
+    {
+        *capacity = *capacity == 0 ? 1024 : *capacity * 2;
+        *list = realloc( *list, *capacity * sizeof(struct BenchPath) );
+        if( *list == NULL )
+        {
+            perror( "realloc" );
+            exit( 1 );
+        }
+    }
+    (*list)[*count].path = strdup( path );
+    (*list)[*count].size = size;
+    (*count)++;
+}
+
+
+static void * BenchVisit( struct Walker *walker, int thread, void *parent, const char *path,
+                            const struct DirectoryEntry *entry )
+{
+    struct BenchPaths *paths = walker->context;
+
+    (void)thread;
+    (void)parent;
+    pthread_mutex_lock( &paths->lock );
+    if( entry->DIR_Attr & ATTR_DIRECTORY )
+    {
+        AddPath( &paths->directories, &paths->directory_count, &paths->directory_capacity, path, 0 );
+    }
+    else
+    {
+        AddPath( &paths->files, &paths->file_count, &paths->file_capacity, path, entry->DIR_FileSize );
+    }
+    pthread_mutex_unlock( &paths->lock );
+    return NULL;
+}
+
+
+//Parse and dispatch one command the way batch mode does
+
+static void Run( struct CommandLine *command, const char *text )
+{
+    snprintf( command->line, sizeof(command->line), "%s", text );
+    ParseCommand( command );
+    RunCommand( command );
+}
+
+
+static int CompareDoubles( const void *a, const void *b )
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+//Time iterations commands of one scenario and append its JSON object to report
+
+static void RunScenario( FILE *report, const char *name, const char *open_command, struct BenchPaths *paths,
+                            int iterations, int first )
+{
+    struct CommandLine command;
+    struct BenchCounters before, after;
+    char text[MAX_COMMAND_SIZE];
+    double *latencies = malloc( iterations * sizeof(double) );
+    double total = 0;
+    uint64_t bytes = 0;
+    int i = 0;
+
+    if( latencies == NULL )
+    {
+        return;
+    }
+
+    //The open scenario starts from a closed image, every timed open is followed by an untimed close
+    if( strcmp( name, "open" ) == 0 )
+    {
+        Run( &command, "close" );
+    }
+
+    fflush( stdout );
+    ReadCounters( &before );
+
+    for( i = 0; i < iterations; i++ )
+    {
+        const struct BenchPath *file = paths->file_count > 0 ? &paths->files[BenchRandom() % paths->file_count] : NULL;
+        const struct BenchPath *directory = paths->directory_count > 0 ?
+                                                &paths->directories[BenchRandom() % paths->directory_count] : NULL;
+
+        if( strcmp( name, "open" ) == 0 )
+        {
+            snprintf( text, sizeof(text), "%s", open_command );
+        }
+        else if( strcmp( name, "ls" ) == 0 || strcmp( name, "cd" ) == 0 )
+        {
+            snprintf( text, sizeof(text), "%s %s", name, directory != NULL ? directory->path : "/" );
+        }
+        else if( file == NULL )
+        {
+            break;
+        }
+        else if( strcmp( name, "stat" ) == 0 )
+        {
+            snprintf( text, sizeof(text), "stat %s", file->path );
+        }
+        else if( strcmp( name, "get" ) == 0 )
+        {
+            snprintf( text, sizeof(text), "get %s", file->path );
+            bytes += file->size;
+        }
+        else
+        {
+            uint32_t length = file->size < BENCH_READ_BYTES ? file->size : BENCH_READ_BYTES;
+            uint32_t position = file->size > length ? BenchRandom() % ( file->size - length ) : 0;
+            snprintf( text, sizeof(text), "read %s %u %u", file->path, position, length );
+            bytes += length;
+        }
+
+        double start = Now();
+        Run( &command, text );
+        fflush( stdout );
+        latencies[i] = Now() - start;
+        total += latencies[i];
+
+        //Undo the side effect outside the timed region
+        if( strcmp( name, "open" ) == 0 )
+        {
+            Run( &command, "close" );
+        }
+        else if( strcmp( name, "get" ) == 0 )
+        {
+            unlink( strrchr( file->path, '/' ) + 1 );
+        }
+    }
+    iterations = i;
+
+    ReadCounters( &after );
+
+    if( strcmp( name, "open" ) == 0 )
+    {
+        Run( &command, open_command );
+    }
+
+    qsort( latencies, iterations, sizeof(double), CompareDoubles );
+    fprintf( report, "%s    {\"name\": \"%s\", \"ops\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+                     "\"bytes\": %llu, \"mb_per_sec\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, "
+                     "\"read_syscalls\": %llu, \"write_syscalls\": %llu, \"minor_faults\": %ld, \"major_faults\": %ld, "
+                     "\"context_switches\": %ld}",
+             first ? "" : ",\n", name, iterations, total, total > 0 ? iterations / total : 0.0,
+             (unsigned long long)bytes, total > 0 ? bytes / total / 1e6 : 0.0,
+             iterations > 0 ? latencies[iterations / 2] * 1e6 : 0.0,
+             iterations > 0 ? latencies[(int)( iterations * 0.99 )] * 1e6 : 0.0,
+             iterations > 0 ? latencies[iterations - 1] * 1e6 : 0.0,
+             (unsigned long long)( after.read_syscalls - before.read_syscalls - counter_overhead.read_syscalls ),
+             (unsigned long long)( after.write_syscalls - before.write_syscalls - counter_overhead.write_syscalls ),
+             after.minor_faults - before.minor_faults, after.major_faults - before.major_faults,
+             after.context_switches - before.context_switches );
+
+    free( latencies );
+}
+
+
+int main( int argc, char *argv[] )
+{
+    const char *scenarios = BENCH_SCENARIOS;
+    const char *output = NULL;
+    int iterations = 1000;
+    unsigned long long seed = 1;
+    int option = 0;
+    int i = 0;
+
+    while( ( option = getopt( argc, argv, "i:r:s:o:" ) ) != -1 )
+    {
+        switch( option )
+        {
+            case 'i': iterations = atoi( optarg ); break;
+            case 'r': seed = strtoull( optarg, NULL, 0 ); break;
+            case 's': scenarios = optarg; break;
+            case 'o': output = optarg; break;
+            default:
+                fprintf( stderr, "Usage: %s [-i iterations] [-r seed] [-s %s] [-o results.json] image\n",
+                            argv[0], BENCH_SCENARIOS );
+                return 1;
+        }
+    }
+    if( optind != argc - 1 || iterations <= 0 )
+    {
+        fprintf( stderr, "Usage: %s [-i iterations] [-r seed] [-s %s] [-o results.json] image\n", argv[0], BENCH_SCENARIOS );
+        return 1;
+    }
+
+    struct BenchCounters first_sample, second_sample;
+    ReadCounters( &first_sample );
+    ReadCounters( &second_sample );
+    counter_overhead.read_syscalls = second_sample.read_syscalls - first_sample.read_syscalls;
+    counter_overhead.write_syscalls = second_sample.write_syscalls - first_sample.write_syscalls;
+
+    const char *image = argv[optind];
+    char image_path[PATH_MAX];
+    if( realpath( image, image_path ) == NULL )
+    {
+        perror( image );
+        return 1;
+    }
+    bench_rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    //Report goes to a duplicate of stdout, stdout itself is pointed at /dev/null for command output
+    int report_fd = output != NULL ? open( output, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) : dup( STDOUT_FILENO );
+    int null_fd = open( "/dev/null", O_WRONLY );
+    FILE *report = report_fd != -1 ? fdopen( report_fd, "w" ) : NULL;
+    if( report == NULL || null_fd == -1 )
+    {
+        perror( output != NULL ? output : "stdout" );
+        return 1;
+    }
+    fflush( stdout );
+    dup2( null_fd, STDOUT_FILENO );
+    close( null_fd );
+    setvbuf( stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE );
+    shell.out = stdout;
+
+    //get writes into the working directory, give it a scratch one
+    char scratch[] = "/tmp/fat32bench.XXXXXX";
+    if( mkdtemp( scratch ) == NULL || chdir( scratch ) == -1 )
+    {
+        perror( "mkdtemp" );
+        return 1;
+    }
+
+    struct CommandLine command;
+    char open_command[MAX_COMMAND_SIZE];
+    if( snprintf( open_command, sizeof(open_command), "open %s", image_path ) >= (int)sizeof(open_command) )
+    {
+        fprintf( stderr, "%s: path too long for an open command\n", image_path );
+        return 1;
+    }
+    Run( &command, open_command );
+    if( shell.volume == NULL )
+    {
+        fprintf( stderr, "%s: not a usable FAT32 image\n", image );
+        return 1;
+    }
+
+    struct BenchPaths paths;
+    memset( &paths, 0, sizeof(paths) );
+    pthread_mutex_init( &paths.lock, NULL );
+    WalkTree( shell.volume, shell.volume->BPB_RootClus, "/", NULL, BenchVisit, &paths );
+
+    //Walk order depends on thread timing, sort so the seeded picks are reproducible
+    qsort( paths.files, paths.file_count, sizeof(struct BenchPath), ComparePaths );
+    qsort( paths.directories, paths.directory_count, sizeof(struct BenchPath), ComparePaths );
+
+    uint64_t file_bytes = 0;
+    for( i = 0; i < paths.file_count; i++ )
+    {
+        file_bytes += paths.files[i].size;
+    }
+
+    fprintf( report, "{\n  \"image\": \"%s\",\n  \"image_bytes\": %lld,\n  \"cluster_size\": %u,\n"
+                     "  \"files\": %d,\n  \"directories\": %d,\n  \"file_bytes\": %llu,\n"
+                     "  \"iterations\": %d,\n  \"seed\": %llu,\n  \"threads\": %d,\n  \"scenarios\": [\n",
+             image, (long long)shell.volume->image_size, shell.volume->cluster_size, paths.file_count, paths.directory_count,
+             (unsigned long long)file_bytes, iterations, seed, WalkThreadCount() );
+
+    char *list = strdup( scenarios );
+    char *cursor = list;
+    char *name = NULL;
+    int first = 1;
+    while( ( name = strsep( &cursor, "," ) ) != NULL )
+    {
+        if( strcmp( name, "open" ) == 0 || strcmp( name, "ls" ) == 0 || strcmp( name, "cd" ) == 0 ||
+                strcmp( name, "stat" ) == 0 || strcmp( name, "get" ) == 0 || strcmp( name, "read" ) == 0 )
+        {
+            //open maps the image and loads the whole FAT, a tenth of the iterations is plenty
+            RunScenario( report, name, open_command, &paths,
+                            strcmp( name, "open" ) == 0 ? ( iterations + 9 ) / 10 : iterations, first );
+            first = 0;
+        }
+        else if( name[0] != '\0' )
+        {
+            fprintf( stderr, "Unknown scenario %s\n", name );
+        }
+    }
+    free( list );
+
+    fprintf( report, "\n  ]\n}\n" );
+    fclose( report );
+
+    chdir( "/" );
+    rmdir( scratch );
+    return 0;
+}
@@ -0,0 +1,509 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2020 Himanshu Rijal
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Synthetic FAT32 image generator for the benchmarks.
+//
+//   cc -O2 -o mkimage bench/mkimage.c -lm
+//   mkimage -o bench.img -c 4096 -n 10000 -s 512 -S 1048576 -d 3 -w 8 -F 20 -r 1
+//
+// Files get log-uniformly distributed sizes between -s and -S and are spread round robin over
+// a directory tree of depth -d with -w sub-directories per directory. -F is the percentage of
+// cluster allocations that jump over a random gap instead of taking the next cluster, so 0
+// gives fully contiguous files. The same options and seed always produce the same image.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SECTOR_SIZE 512
+#define RESERVED_SECTORS 32
+#define NUM_FATS 2
+#define MIN_CLUSTERS 65525 //Fewer clusters than this is FAT16 by the specification
+#define MAX_GAP 16 //Largest run of clusters skipped by a fragmenting allocation
+#define PATTERN_SIZE ( 1024 * 1024 ) //File data is copied out of this block of random bytes
+
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+
+#define FAT_EOC 0x0FFFFFFF
+
+#define FAT_DATE ( ( ( 2020 - 1980 ) << 9 ) | ( 1 << 5 ) | 1 ) //Every entry is stamped 2020-01-01 12:00:00
+#define FAT_TIME ( 12 << 11 )
+
+struct __attribute__((__packed__)) DirectoryEntry
+{
+    char DIR_Name[11];
+    uint8_t DIR_Attr;
+    uint8_t DIR_NTRes;
+    uint8_t DIR_CrtTimeTenth;
+    uint16_t DIR_CrtTime;
+    uint16_t DIR_CrtDate;
+    uint16_t DIR_LstAccDate;
+    uint16_t DIR_FirstClusterHigh;
+    uint16_t DIR_WrtTime;
+    uint16_t DIR_WrtDate;
+    uint16_t DIR_FirstClusterLow;
+    uint32_t DIR_FileSize;
+};
+
+struct Node
+{
+    int parent; //Index of the parent directory, -1 for the root and for files
+    int is_directory;
+    uint64_t size; //File size, or bytes of directory entries
+    uint32_t first_cluster;
+    char name[11];
+    int *children; //Directories only
+    int child_count;
+    int child_capacity;
+};
+
+struct Node *nodes = NULL;
+int node_count = 0;
+int node_capacity = 0;
+
+uint32_t *fat = NULL; //fat[n] is the entry for cluster n
+uint32_t fat_capacity = 0;
+uint32_t next_cluster = 2; //Allocation cursor
+uint32_t allocated_clusters = 0; //Clusters handed out, next_cluster minus the gaps
+uint32_t cluster_size = 4096;
+int fragment_percent = 0;
+uint64_t rng_state = 1;
+
+
+//xorshift64*, good enough and identical everywhere
+
+uint64_t Random( void )
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+
+int AddNode( int parent, int is_directory, uint64_t size )
+{
+    if( node_count == node_capacity )
+    {
+        node_capacity = node_capacity == 0 ? 1024 : node_capacity * 2;
+        nodes = realloc( nodes, node_capacity * sizeof(struct Node) );
+        if( nodes == NULL )
+        {
+            perror( "realloc" );
+            exit( 1 );
+        }
+    }
+
+    struct Node *node = &nodes[node_count];
+    memset( node, 0, sizeof(struct Node) );
+    node->parent = parent;
+    node->is_directory = is_directory;
+    node->size = size;
+
+    if( parent >= 0 )
+    {
+        struct Node *directory = &nodes[parent];
+        if( directory->child_count == directory->child_capacity )
+        {
+            directory->child_capacity = directory->child_capacity == 0 ? 16 : directory->child_capacity * 2;
+            directory->children = realloc( directory->children, directory->child_capacity * sizeof(int) );
+            if( directory->children == NULL )
+            {
+                perror( "realloc" );
+                exit( 1 );
+            }
+        }
+        directory->children[directory->child_count++] = node_count;
+
+        //D0000001 style names for directories, F0000001.BIN for files, unique within the image
+        char name[12];
+        snprintf( name, sizeof(name), is_directory ? "D%07d   " : "F%07dBIN", node_count % 10000000 );
+        memcpy( node->name, name, 11 );
+    }
+    return node_count++;
+}
+
+
+//Allocate a chain of count clusters. Returns the first cluster, 0 for an empty chain.
+
+uint32_t AllocateChain( uint64_t count )
+{
+    uint32_t first = 0;
+    uint32_t previous = 0;
+    uint64_t i = 0;
+
+    for( i = 0; i < count; i++ )
+    {
+        if( i > 0 && (uint64_t)( Random() % 100 ) < (uint64_t)fragment_percent )
+        {
+            next_cluster += 1 + Random() % MAX_GAP;
+        }
+
+        while( next_cluster + 1 >= fat_capacity )
+        {
+            uint32_t capacity = fat_capacity == 0 ? 1 << 20 : fat_capacity * 2;
+            fat = realloc( fat, (size_t)capacity * sizeof(uint32_t) );
+            if( fat == NULL )
+            {
+                perror( "realloc" );
+                exit( 1 );
+            }
+            memset( &fat[fat_capacity], 0, (size_t)( capacity - fat_capacity ) * sizeof(uint32_t) );
+            fat_capacity = capacity;
+        }
+
+        uint32_t cluster = next_cluster++;
+        allocated_clusters++;
+        fat[cluster] = FAT_EOC;
+        if( previous != 0 )
+        {
+            fat[previous] = cluster;
+        }
+        else
+        {
+            first = cluster;
+        }
+        previous = cluster;
+    }
+    return first;
+}
+
+
+//Write length bytes at offset, failing hard on error
+
+void WriteAt( int fd, const void *buffer, size_t length, off_t offset )
+{
+    size_t done = 0;
+
+    while( done < length )
+    {
+        ssize_t n = pwrite( fd, (const char *)buffer + done, length - done, offset + done );
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            perror( "pwrite" );
+            exit( 1 );
+        }
+        done += n;
+    }
+}
+
+
+void FillEntry( struct DirectoryEntry *entry, const char name[11], uint8_t attr, uint32_t cluster, uint32_t size )
+{
+    memset( entry, 0, sizeof(struct DirectoryEntry) );
+    memcpy( entry->DIR_Name, name, 11 );
+    entry->DIR_Attr = attr;
+    entry->DIR_CrtTime = FAT_TIME;
+    entry->DIR_CrtDate = FAT_DATE;
+    entry->DIR_LstAccDate = FAT_DATE;
+    entry->DIR_WrtTime = FAT_TIME;
+    entry->DIR_WrtDate = FAT_DATE;
+    entry->DIR_FirstClusterHigh = cluster >> 16;
+    entry->DIR_FirstClusterLow = cluster & 0xFFFF;
+    entry->DIR_FileSize = size;
+}
+
+
+//Write the whole chain starting at first, pulling bytes from source (or the pattern when source is NULL)
+
+void WriteChain( int fd, off_t data_offset, uint32_t first, const char *source, uint64_t length, const char *pattern )
+{
+    uint32_t cluster = first;
+    uint64_t done = 0;
+
+    while( done < length && cluster >= 2 && cluster < FAT_EOC )
+    {
+        //Coalesce the physically contiguous run starting here into one write
+        uint32_t run = 1;
+        while( fat[cluster + run - 1] == cluster + run && (uint64_t)( run + 1 ) * cluster_size <= PATTERN_SIZE )
+        {
+            run++;
+        }
+
+        uint64_t bytes = (uint64_t)run * cluster_size;
+        if( bytes > length - done )
+        {
+            bytes = length - done;
+        }
+
+        const char *data = source != NULL ? source + done : pattern + ( ( done / cluster_size ) * 4099 ) % ( PATTERN_SIZE / 2 );
+        WriteAt( fd, data, bytes, data_offset + (off_t)( cluster - 2 ) * cluster_size );
+
+        done += bytes;
+        cluster = fat[cluster + run - 1];
+    }
+}
+
+
+void Usage( const char *program )
+{
+    fprintf( stderr, "Usage: %s -o image [-c cluster_bytes] [-n files] [-s min_size] [-S max_size]\n"
+                     "          [-d depth] [-w fanout] [-F fragment_percent] [-r seed]\n", program );
+    exit( 1 );
+}
+
+
+int main( int argc, char *argv[] )
+{
+    const char *output = NULL;
+    long file_count = 1000;
+    uint64_t min_size = 512;
+    uint64_t max_size = 65536;
+    int depth = 2;
+    int fanout = 4;
+    int option = 0;
+    int i = 0;
+
+    while( ( option = getopt( argc, argv, "o:c:n:s:S:d:w:F:r:" ) ) != -1 )
+    {
+        switch( option )
+        {
+            case 'o': output = optarg; break;
+            case 'c': cluster_size = strtoul( optarg, NULL, 0 ); break;
+            case 'n': file_count = atol( optarg ); break;
+            case 's': min_size = strtoull( optarg, NULL, 0 ); break;
+            case 'S': max_size = strtoull( optarg, NULL, 0 ); break;
+            case 'd': depth = atoi( optarg ); break;
+            case 'w': fanout = atoi( optarg ); break;
+            case 'F': fragment_percent = atoi( optarg ); break;
+            case 'r': rng_state = strtoull( optarg, NULL, 0 ) * 0x9E3779B97F4A7C15ULL + 1; break;
+            default: Usage( argv[0] );
+        }
+    }
+
+    if( output == NULL || cluster_size < SECTOR_SIZE || cluster_size > 65536 || ( cluster_size & ( cluster_size - 1 ) ) ||
+            file_count < 0 || min_size > max_size || max_size > 0xFFFFFFFFULL || depth < 0 || fanout < 1 ||
+            fragment_percent < 0 || fragment_percent > 100 )
+    {
+        Usage( argv[0] );
+    }
+
+    //Directory tree, breadth first so each level is contiguous in nodes[]
+
+    AddNode( -1, 1, 0 );
+    int level_start = 0;
+    int level_end = 1;
+    int level = 0;
+    for( level = 0; level < depth; level++ )
+    {
+        for( i = level_start; i < level_end; i++ )
+        {
+            int k = 0;
+            for( k = 0; k < fanout; k++ )
+            {
+                AddNode( i, 1, 0 );
+            }
+        }
+        level_start = level_end;
+        level_end = node_count;
+    }
+    int directory_count = node_count;
+
+    //Files, log-uniform sizes, round robin over the directories
+
+    uint64_t total_bytes = 0;
+    long f = 0;
+    for( f = 0; f < file_count; f++ )
+    {
+        double fraction = (double)( Random() >> 11 ) / (double)( 1ULL << 53 );
+        double low = min_size > 0 ? (double)min_size : 1.0;
+        uint64_t size = min_size == max_size ? min_size : (uint64_t)( low * exp( fraction * log( (double)max_size / low ) ) );
+        if( size < min_size ) size = min_size;
+        if( size > max_size ) size = max_size;
+
+        AddNode( (int)( f % directory_count ), 0, size );
+        total_bytes += size;
+    }
+
+    //Clusters: each directory's entries, then file data, in creation order
+
+    for( i = 0; i < directory_count; i++ )
+    {
+        uint64_t entries = nodes[i].child_count + 2; //. and .. (the root has the volume label instead, plus slack)
+        nodes[i].size = entries * sizeof(struct DirectoryEntry);
+        nodes[i].first_cluster = AllocateChain( ( nodes[i].size + cluster_size - 1 ) / cluster_size );
+    }
+    for( i = directory_count; i < node_count; i++ )
+    {
+        nodes[i].first_cluster = AllocateChain( ( nodes[i].size + cluster_size - 1 ) / cluster_size );
+    }
+
+    uint32_t used_clusters = allocated_clusters;
+    uint32_t cluster_count = ( next_cluster - 2 ) + ( next_cluster - 2 ) / 4 + 16; //Leave a quarter free for writes
+    if( cluster_count < MIN_CLUSTERS )
+    {
+        cluster_count = MIN_CLUSTERS;
+    }
+    if( (uint64_t)cluster_count + 2 >= 0x0FFFFFF0 )
+    {
+        fprintf( stderr, "Image needs too many clusters\n" );
+        return 1;
+    }
+
+    //Layout
+
+    uint32_t sectors_per_cluster = cluster_size / SECTOR_SIZE;
+    uint32_t fat_sectors = ( ( (uint64_t)cluster_count + 2 ) * 4 + SECTOR_SIZE - 1 ) / SECTOR_SIZE;
+    off_t fat_offset = (off_t)RESERVED_SECTORS * SECTOR_SIZE;
+    off_t data_offset = fat_offset + (off_t)NUM_FATS * fat_sectors * SECTOR_SIZE;
+    uint64_t total_sectors = RESERVED_SECTORS + (uint64_t)NUM_FATS * fat_sectors + (uint64_t)cluster_count * sectors_per_cluster;
+
+    int fd = open( output, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd == -1 || ftruncate( fd, total_sectors * SECTOR_SIZE ) == -1 )
+    {
+        perror( output );
+        return 1;
+    }
+
+    //Boot sector, FSInfo, and their backups at sector 6
+
+    unsigned char boot[SECTOR_SIZE];
+    memset( boot, 0, sizeof(boot) );
+    memcpy( &boot[0], "\xEB\x58\x90MKIMAGE ", 11 );
+    uint16_t bytes_per_sector = SECTOR_SIZE;
+    uint16_t reserved = RESERVED_SECTORS;
+    uint32_t total32 = (uint32_t)total_sectors;
+    uint32_t root_cluster = nodes[0].first_cluster;
+    uint16_t fsinfo_sector = 1;
+    uint16_t backup_sector = 6;
+    memcpy( &boot[11], &bytes_per_sector, 2 );
+    boot[13] = sectors_per_cluster;
+    memcpy( &boot[14], &reserved, 2 );
+    boot[16] = NUM_FATS;
+    boot[21] = 0xF8; //Media: fixed disk
+    memcpy( &boot[32], &total32, 4 );
+    memcpy( &boot[36], &fat_sectors, 4 );
+    memcpy( &boot[44], &root_cluster, 4 );
+    memcpy( &boot[48], &fsinfo_sector, 2 );
+    memcpy( &boot[50], &backup_sector, 2 );
+    boot[64] = 0x80; //Drive number
+    boot[66] = 0x29; //Extended boot signature
+    memcpy( &boot[71], "BENCH      FAT32   ", 19 );
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+
+    unsigned char fsinfo[SECTOR_SIZE];
+    uint32_t lead = 0x41615252, structure = 0x61417272, trail = 0xAA550000;
+    uint32_t free_count = cluster_count - used_clusters;
+    uint32_t next_free = next_cluster;
+    memset( fsinfo, 0, sizeof(fsinfo) );
+    memcpy( &fsinfo[0], &lead, 4 );
+    memcpy( &fsinfo[484], &structure, 4 );
+    memcpy( &fsinfo[488], &free_count, 4 );
+    memcpy( &fsinfo[492], &next_free, 4 );
+    memcpy( &fsinfo[508], &trail, 4 );
+
+    WriteAt( fd, boot, SECTOR_SIZE, 0 );
+    WriteAt( fd, fsinfo, SECTOR_SIZE, SECTOR_SIZE );
+    WriteAt( fd, boot, SECTOR_SIZE, 6 * SECTOR_SIZE );
+    WriteAt( fd, fsinfo, SECTOR_SIZE, 7 * SECTOR_SIZE );
+
+    //FATs: entries past the allocation cursor stay free (zero, already there from ftruncate)
+
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = FAT_EOC;
+    for( i = 0; i < NUM_FATS; i++ )
+    {
+        WriteAt( fd, fat, (size_t)next_cluster * sizeof(uint32_t), fat_offset + (off_t)i * fat_sectors * SECTOR_SIZE );
+    }
+
+    //Directories
+
+    for( i = 0; i < directory_count; i++ )
+    {
+        uint64_t bytes = ( ( nodes[i].size + cluster_size - 1 ) / cluster_size ) * cluster_size;
+        struct DirectoryEntry *entries = calloc( 1, bytes );
+        int n = 0;
+        int k = 0;
+
+        if( entries == NULL )
+        {
+            perror( "calloc" );
+            return 1;
+        }
+
+        if( i == 0 )
+        {
+            FillEntry( &entries[n++], "BENCH      ", ATTR_VOLUME_ID, 0, 0 );
+        }
+        else
+        {
+            uint32_t parent = nodes[i].parent == 0 ? 0 : nodes[nodes[i].parent].first_cluster; //.. of a root child is 0
+            FillEntry( &entries[n++], ".          ", ATTR_DIRECTORY, nodes[i].first_cluster, 0 );
+            FillEntry( &entries[n++], "..         ", ATTR_DIRECTORY, parent, 0 );
+        }
+        for( k = 0; k < nodes[i].child_count; k++ )
+        {
+            struct Node *child = &nodes[nodes[i].children[k]];
+            FillEntry( &entries[n++], child->name, child->is_directory ? ATTR_DIRECTORY : ATTR_ARCHIVE,
+                            child->first_cluster, child->is_directory ? 0 : (uint32_t)child->size );
+        }
+
+        WriteChain( fd, data_offset, nodes[i].first_cluster, (const char *)entries, bytes, NULL );
+        free( entries );
+    }
+
+    //File data
+
+    char *pattern = malloc( PATTERN_SIZE * 2 );
+    if( pattern == NULL )
+    {
+        perror( "malloc" );
+        return 1;
+    }
+    for( i = 0; i < PATTERN_SIZE * 2; i++ )
+    {
+        pattern[i] = (char)( Random() >> 56 );
+    }
+    for( i = directory_count; i < node_count; i++ )
+    {
+        WriteChain( fd, data_offset, nodes[i].first_cluster, NULL, nodes[i].size, pattern );
+    }
+    free( pattern );
+
+    if( close( fd ) == -1 )
+    {
+        perror( output );
+        return 1;
+    }
+
+    printf( "{\"image\": \"%s\", \"cluster_size\": %u, \"clusters\": %u, \"used_clusters\": %u, "
+            "\"directories\": %d, \"files\": %ld, \"file_bytes\": %llu, \"image_bytes\": %llu}\n",
+            output, cluster_size, cluster_count, used_clusters, directory_count, file_count,
+            (unsigned long long)total_bytes, (unsigned long long)( total_sectors * SECTOR_SIZE ) );
+    return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Reproducible benchmark suite: builds the generator and runner, generates a fixed matrix of
+# images and writes one JSON result per image into $OUT (default bench/results).
+#
+#   bench/run.sh [iterations]
+#
+# Images are regenerated only when missing; delete $IMAGES to start over.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+OUT=${OUT:-$ROOT/bench/results}
+IMAGES=${IMAGES:-$ROOT/bench/images}
+ITERATIONS=${1:-2000}
+CC=${CC:-cc}
+
+mkdir -p "$OUT" "$IMAGES"
+$CC -O2 -o "$IMAGES/mkimage" "$ROOT/bench/mkimage.c" -lm
+$CC -O2 -pthread -o "$IMAGES/bench" "$ROOT/bench/bench.c"
+
+# name: mkimage options
+while read -r name options
+do
+    case "$name" in ''|'#'*) continue ;; esac
+    if [ ! -f "$IMAGES/$name.img" ]
+    then
+        "$IMAGES/mkimage" -o "$IMAGES/$name.img" $options > "$IMAGES/$name.json"
+    fi
+    "$IMAGES/bench" -i "$ITERATIONS" -r 1 -o "$OUT/$name.json" "$IMAGES/$name.img"
+    echo "$OUT/$name.json"
+done <<MATRIX
+# Many small files, small clusters, flat and deep trees
+small-flat   -c 512   -n 20000 -s 64   -S 8192    -d 1 -w 4  -F 0  -r 1
+small-deep   -c 4096  -n 20000 -s 64   -S 8192    -d 4 -w 6  -F 0  -r 1
+# Mixed sizes, contiguous and fragmented
+mixed        -c 4096  -n 5000  -s 512  -S 1048576 -d 2 -w 8  -F 0  -r 1
+mixed-frag   -c 4096  -n 5000  -s 512  -S 1048576 -d 2 -w 8  -F 20 -r 1
+# Few large files, large clusters
+large        -c 32768 -n 32    -s 8388608 -S 33554432 -d 1 -w 2 -F 5 -r 1
+MATRIX
@@ -0,0 +1,3677 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016, 2017 Trevor Bakker
+// Copyright (c) 2020 Himanshu Rijal
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "fat32.h"
+
+#define MAX_CLUSTER_INDEXES 32 //Files whose cluster index is kept between commands
+#define CLUSTER_INDEX_LIMIT ( 16 * 1024 * 1024 ) //Total cached index entries (4 bytes each) before unused indexes are evicted
+
+#define FAT_SCAN_THREAD_ENTRIES ( 4 * 1024 * 1024 ) //FAT entries per df scan thread, smaller FATs are scanned by one
+
+#define BLOCK_CACHE_BYPASS ( 256 * 1024 ) //Reads this large stream past the block cache instead of flooding it
+
+//A loaded directory in the directory cache, linked in least-recently-used order
+struct CachedDirectory
+{
+    struct Directory directory; //Must stay first, callers only see the Directory
+    int users; //Pins against eviction (the current directory, a lookup in progress)
+    int stale; //Dropped from the cache, freed when the last user releases it
+    struct CachedDirectory *prev;
+    struct CachedDirectory *next;
+};
+
+//A resolved absolute path in the path cache
+struct CachedPath
+{
+    char *path; //Normalized absolute path, e.g. /SUB/DEEP/B.BIN
+    uint32_t hash;
+    struct DirectoryEntry entry; //Entry the path resolves to
+    struct CachedPath *hash_next; //Next entry in the same bucket
+    struct CachedPath *prev; //Least-recently-used order
+    struct CachedPath *next;
+};
+
+//One slot of the block cache
+struct CachedBlock
+{
+    uint64_t key; //Block number on the cache's grid
+    char *data; //block_size bytes, allocated when the slot is first used
+    int valid;
+    int referenced; //CLOCK bit, set on every hit
+    struct CachedBlock *hash_next;
+};
+
+_Atomic uint64_t stat_counters[STAT_COUNTERS]; //Instrumentation counters, relaxed atomics
+struct Histogram stat_read_latency; //ImageRead calls
+struct Histogram stat_output_latency; //Output calls made while extracting
+
+
+//Add value to an instrumentation counter. Relaxed: counters are only ever summed and printed.
+
+void StatAdd( int counter, uint64_t value )
+{
+    atomic_fetch_add_explicit( &stat_counters[counter], value, memory_order_relaxed );
+}
+
+
+//Monotonic time in nanoseconds, the start point for HistogramRecord
+
+uint64_t StatClock( void )
+{
+    struct timespec now;
+    
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+//Record the time elapsed since start (a StatClock value)
+
+void HistogramRecord( struct Histogram *histogram, uint64_t start )
+{
+    uint64_t elapsed = StatClock() - start;
+    int bucket = 63 - __builtin_clzll( elapsed | 1 );
+    uint64_t max = atomic_load_explicit( &histogram->max_ns, memory_order_relaxed );
+    
+    if( bucket >= STAT_BUCKETS )
+    {
+        bucket = STAT_BUCKETS - 1;
+    }
+    atomic_fetch_add_explicit( &histogram->buckets[bucket], 1, memory_order_relaxed );
+    atomic_fetch_add_explicit( &histogram->count, 1, memory_order_relaxed );
+    atomic_fetch_add_explicit( &histogram->total_ns, elapsed, memory_order_relaxed );
+    while( elapsed > max && !atomic_compare_exchange_weak_explicit( &histogram->max_ns, &max, elapsed,
+                                                                    memory_order_relaxed, memory_order_relaxed ) );
+}
+
+
+//Open the file system image read-only, mapping it into memory when possible. Falls back to positional
+//reads when the image cannot be mapped (or use_mmap is 0). Returns 0 on success, -1 if the image cannot be opened.
+
+int ImageOpen( struct Volume *volume, const char *path, int use_mmap )
+{
+    struct stat image_stat;
+    
+    if( ( volume->image_path = strdup( path ) ) == NULL )
+    {
+        return -1;
+    }
+    volume->image_fd = open( path, O_RDONLY );
+    volume->image_writable = 0;
+    if( volume->image_fd == -1 )
+    {
+        return -1;
+    }
+    
+    if( fstat( volume->image_fd, &image_stat ) == -1 )
+    {
+        close( volume->image_fd );
+        volume->image_fd = -1;
+        return -1;
+    }
+    volume->image_size = image_stat.st_size;
+    volume->image_mtime = image_stat.st_mtim;
+    
+    volume->image_map = NULL;
+    if( use_mmap && volume->image_size > 0 )
+    {
+        void *map = mmap( NULL, volume->image_size, PROT_READ, MAP_SHARED, volume->image_fd, 0 );
+        if( map != MAP_FAILED )
+        {
+            volume->image_map = map;
+        }
+    }
+    
+    ImageAdvise( volume, IMAGE_ADVICE_NORMAL );
+    return 0;
+}
+
+
+//Release the mapping and descriptor of the current image. Returns -1 if no image is open.
+
+int ImageClose( struct Volume *volume )
+{
+    if( volume->image_fd == -1 )
+    {
+        return -1;
+    }
+    
+    if( volume->image_map != NULL )
+    {
+        munmap( volume->image_map, volume->image_size );
+        volume->image_map = NULL;
+    }
+    
+    close( volume->image_fd );
+    volume->image_fd = -1;
+    volume->image_writable = 0;
+    volume->image_size = 0;
+    return 0;
+}
+
+
+//Reopen the image read-write in place of its read-only descriptor, for the first command that changes it.
+//Writes go through pwrite, which the shared mapping sees. Returns 0 on success, -1 if the image may not
+//be written or has been replaced on the host since it was opened.
+
+int ImageMakeWritable( struct Volume *volume )
+{
+    struct stat opened, reopened;
+    
+    if( volume->image_writable )
+    {
+        return 0;
+    }
+    
+    int fd = open( volume->image_path, O_RDWR );
+    if( fd == -1 )
+    {
+        return -1;
+    }
+    if( fstat( volume->image_fd, &opened ) == -1 || fstat( fd, &reopened ) == -1 ||
+            opened.st_dev != reopened.st_dev || opened.st_ino != reopened.st_ino ||
+            dup2( fd, volume->image_fd ) == -1 )
+    {
+        close( fd );
+        return -1;
+    }
+    close( fd );
+    volume->image_writable = 1;
+    return 0;
+}
+
+
+//Copy length bytes at offset in the image into buffer, bypassing the block cache.
+//Served straight from the mapping when available, otherwise with pread (no shared seek position).
+//Returns 0 on success, -1 if the range is outside the image or the read fails.
+
+static int ImageReadDirect( struct Volume *volume, void *buffer, size_t length, off_t offset )
+{
+    if( offset < 0 || offset + (off_t)length > volume->image_size )
+    {
+        return -1;
+    }
+    
+    uint64_t start = StatClock();
+    
+    StatAdd( STAT_IMAGE_READS, 1 );
+    StatAdd( STAT_IMAGE_READ_BYTES, length );
+    if( volume->image_map != NULL )
+    {
+        memcpy( buffer, volume->image_map + offset, length );
+        HistogramRecord( &stat_read_latency, start );
+        return 0;
+    }
+    
+    size_t done = 0;
+    while( done < length )
+    {
+        ssize_t n = pread( volume->image_fd, (char *)buffer + done, length - done, offset + done );
+        StatAdd( STAT_PREAD_CALLS, 1 );
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            return -1;
+        }
+        done += n;
+    }
+    HistogramRecord( &stat_read_latency, start );
+    return 0;
+}
+
+
+//Drop every cached block and size the cache for block_size blocks, aligned so that aligned_offset
+//starts a block, holding up to bytes of data. bytes 0 (or no block size) disables the cache.
+//Returns 0 on success, -1 on allocation failure (the cache is left disabled).
+
+int BlockCacheConfigure( struct Volume *volume, size_t block_size, off_t aligned_offset, size_t bytes )
+{
+    struct BlockCache *cache = &volume->block_cache;
+    size_t i = 0;
+    int status = 0;
+    
+    pthread_mutex_lock( &cache->lock );
+    for( i = 0; i < cache->used; i++ )
+    {
+        free( cache->slots[i].data );
+    }
+    free( cache->slots );
+    free( cache->buckets );
+    cache->slots = NULL;
+    cache->buckets = NULL;
+    cache->capacity = 0;
+    cache->used = 0;
+    cache->hand = 0;
+    cache->block_size = block_size;
+    
+    if( block_size > 0 && bytes / block_size > 0 )
+    {
+        cache->capacity = bytes / block_size;
+        cache->shift = ( block_size - aligned_offset % block_size ) % block_size;
+        cache->bucket_count = 16;
+        while( cache->bucket_count < cache->capacity * 2 )
+        {
+            cache->bucket_count *= 2;
+        }
+        cache->slots = calloc( cache->capacity, sizeof(struct CachedBlock) );
+        cache->buckets = calloc( cache->bucket_count, sizeof(struct CachedBlock *) );
+        if( cache->slots == NULL || cache->buckets == NULL )
+        {
+            free( cache->slots );
+            free( cache->buckets );
+            cache->slots = NULL;
+            cache->buckets = NULL;
+            cache->capacity = 0;
+            status = -1;
+        }
+    }
+    pthread_mutex_unlock( &cache->lock );
+    return status;
+}
+
+
+static struct CachedBlock ** BlockCacheBucket( struct BlockCache *cache, uint64_t key )
+{
+    return &cache->buckets[( key * 0x9E3779B97F4A7C15ULL >> 32 ) & ( cache->bucket_count - 1 )];
+}
+
+
+static struct CachedBlock * BlockCacheFind( struct BlockCache *cache, uint64_t key )
+{
+    struct CachedBlock *block = NULL;
+    
+    for( block = *BlockCacheBucket( cache, key ); block != NULL; block = block->hash_next )
+    {
+        if( block->key == key )
+        {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+
+static void BlockCacheUnlink( struct BlockCache *cache, struct CachedBlock *block )
+{
+    struct CachedBlock **link = BlockCacheBucket( cache, block->key );
+    
+    while( *link != block )
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = block->hash_next;
+    block->valid = 0;
+}
+
+
+//Pick the slot for a new block: an unused one while there are any, then the first slot
+//the CLOCK hand finds without its referenced bit (clearing bits as it passes)
+
+static struct CachedBlock * BlockCacheVictim( struct BlockCache *cache )
+{
+    if( cache->used < cache->capacity )
+    {
+        struct CachedBlock *block = &cache->slots[cache->used];
+        
+        if( ( block->data = malloc( cache->block_size ) ) == NULL )
+        {
+            return NULL;
+        }
+        cache->used++;
+        return block;
+    }
+    
+    while( 1 )
+    {
+        struct CachedBlock *block = &cache->slots[cache->hand];
+        
+        cache->hand = ( cache->hand + 1 ) % cache->capacity;
+        if( block->referenced )
+        {
+            block->referenced = 0;
+            continue;
+        }
+        if( block->valid )
+        {
+            BlockCacheUnlink( cache, block );
+            StatAdd( STAT_BLOCK_EVICTIONS, 1 );
+        }
+        return block;
+    }
+}
+
+
+//Forget cached blocks overlapping a range of the image, for callers that change the image
+
+void BlockCacheInvalidate( struct Volume *volume, off_t offset, size_t length )
+{
+    struct BlockCache *cache = &volume->block_cache;
+    
+    pthread_mutex_lock( &cache->lock );
+    if( cache->capacity > 0 && length > 0 )
+    {
+        uint64_t key = ( offset + cache->shift ) / cache->block_size;
+        uint64_t last = ( offset + length - 1 + cache->shift ) / cache->block_size;
+        
+        for( ; key <= last; key++ )
+        {
+            struct CachedBlock *block = BlockCacheFind( cache, key );
+            if( block != NULL )
+            {
+                BlockCacheUnlink( cache, block );
+                block->referenced = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock( &cache->lock );
+}
+
+
+//Copy length bytes at offset in the image into buffer.
+//Small reads are assembled from cached blocks, loading missing blocks outside the cache lock;
+//reads of BLOCK_CACHE_BYPASS bytes or more (file data streams, the FAT) go straight to the image.
+//Returns 0 on success, -1 if the range is outside the image or the read fails.
+
+int ImageRead( struct Volume *volume, void *buffer, size_t length, off_t offset )
+{
+    struct BlockCache *cache = &volume->block_cache;
+    char *out = buffer;
+    char *fill = NULL;
+    
+    if( offset < 0 || offset + (off_t)length > volume->image_size )
+    {
+        return -1;
+    }
+    if( length >= BLOCK_CACHE_BYPASS || cache->capacity == 0 )
+    {
+        return ImageReadDirect( volume, buffer, length, offset );
+    }
+    
+    while( length > 0 )
+    {
+        uint64_t key = ( offset + cache->shift ) / cache->block_size;
+        size_t skip = ( offset + cache->shift ) % cache->block_size;
+        size_t take = cache->block_size - skip < length ? cache->block_size - skip : length;
+        struct CachedBlock *block = NULL;
+        
+        pthread_mutex_lock( &cache->lock );
+        if( cache->capacity > 0 && ( block = BlockCacheFind( cache, key ) ) != NULL )
+        {
+            memcpy( out, block->data + skip, take );
+            block->referenced = 1;
+            pthread_mutex_unlock( &cache->lock );
+            StatAdd( STAT_BLOCK_HITS, 1 );
+        }
+        else
+        {
+            pthread_mutex_unlock( &cache->lock );
+            StatAdd( STAT_BLOCK_MISSES, 1 );
+            
+            //Load the whole block, clipped to the image, outside the lock
+            off_t block_start = (off_t)( key * cache->block_size ) - (off_t)cache->shift;
+            off_t read_start = block_start < 0 ? 0 : block_start;
+            off_t read_end = block_start + (off_t)cache->block_size < volume->image_size ? block_start + (off_t)cache->block_size : volume->image_size;
+            
+            if( fill == NULL && ( fill = malloc( cache->block_size ) ) == NULL )
+            {
+                return ImageReadDirect( volume, out, length, offset ); //No memory for the cache, still serve the read
+            }
+            memset( fill, 0, cache->block_size );
+            if( ImageReadDirect( volume, fill + ( read_start - block_start ), read_end - read_start, read_start ) == -1 )
+            {
+                free( fill );
+                return -1;
+            }
+            memcpy( out, fill + skip, take );
+            
+            //Another thread may have loaded the same block meanwhile
+            pthread_mutex_lock( &cache->lock );
+            if( cache->capacity > 0 && BlockCacheFind( cache, key ) == NULL && ( block = BlockCacheVictim( cache ) ) != NULL )
+            {
+                memcpy( block->data, fill, cache->block_size );
+                block->key = key;
+                block->valid = 1;
+                block->referenced = 0;
+                block->hash_next = *BlockCacheBucket( cache, key );
+                *BlockCacheBucket( cache, key ) = block;
+            }
+            pthread_mutex_unlock( &cache->lock );
+        }
+        
+        out += take;
+        offset += take;
+        length -= take;
+    }
+    
+    free( fill );
+    return 0;
+}
+
+//Write length bytes from buffer at offset in the image, dropping the cached blocks it covers.
+//Never grows the image. Returns 0 on success, -1 if the range is outside the image or the write fails.
+
+int ImageWrite( struct Volume *volume, const void *buffer, size_t length, off_t offset )
+{
+    const char *in = buffer;
+    size_t done = 0;
+    
+    if( !volume->image_writable || offset < 0 || offset + (off_t)length > volume->image_size )
+    {
+        return -1;
+    }
+    
+    IndexRemove( volume ); //The image no longer matches its sidecar index
+    BlockCacheInvalidate( volume, offset, length );
+    StatAdd( STAT_IMAGE_WRITE_BYTES, length );
+    while( done < length )
+    {
+        ssize_t written = pwrite( volume->image_fd, in + done, length - done, offset + done );
+        StatAdd( STAT_IMAGE_WRITES, 1 );
+        
+        if( written == -1 && errno == EINTR )
+        {
+            continue;
+        }
+        if( written <= 0 )
+        {
+            return -1;
+        }
+        done += written;
+    }
+    return 0;
+}
+
+
+//Return a pointer to length bytes at offset inside the mapping, or NULL when the
+//image is not mapped or the range is out of bounds. Callers fall back to ImageRead.
+
+const void * ImagePointer( struct Volume *volume, off_t offset, size_t length )
+{
+    if( volume->image_map == NULL || offset < 0 || offset + (off_t)length > volume->image_size )
+    {
+        return NULL;
+    }
+    return volume->image_map + offset;
+}
+
+
+//Tell the kernel how the image is about to be accessed so it can size its readahead
+
+void ImageAdvise( struct Volume *volume, int advice )
+{
+    if( volume->image_fd == -1 )
+    {
+        return;
+    }
+    
+    if( volume->image_map != NULL )
+    {
+        int madv = advice == IMAGE_ADVICE_SEQUENTIAL ? MADV_SEQUENTIAL :
+                        advice == IMAGE_ADVICE_RANDOM ? MADV_RANDOM : MADV_NORMAL;
+        madvise( volume->image_map, volume->image_size, madv );
+    }
+    else
+    {
+        int fadv = advice == IMAGE_ADVICE_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL :
+                        advice == IMAGE_ADVICE_RANDOM ? POSIX_FADV_RANDOM : POSIX_FADV_NORMAL;
+        posix_fadvise( volume->image_fd, 0, 0, fadv );
+    }
+}
+
+
+//Load the first FAT into memory so chain walks never touch the image. put keeps it up to date.
+//Returns 0 on success, -1 if the FAT cannot be read.
+
+int FATLoad( struct Volume *volume )
+{
+    size_t fat_bytes = (size_t)volume->BPB_FATSz32 * volume->BPB_BytsPerSec;
+    off_t fat_offset = (off_t)volume->BPB_RsvdSecCnt * volume->BPB_BytsPerSec;
+    
+    FATFree(volume);
+    
+    if( fat_bytes == 0 || ( volume->fat_table = malloc( fat_bytes ) ) == NULL )
+    {
+        return -1;
+    }
+    
+    if( ImageRead( volume, volume->fat_table, fat_bytes, fat_offset ) == -1 )
+    {
+        FATFree(volume);
+        return -1;
+    }
+    
+    volume->fat_entries = fat_bytes / 4;
+    return 0;
+}
+
+
+//Release the cached FAT
+
+void FATFree( struct Volume *volume )
+{
+    free( volume->fat_table );
+    volume->fat_table = NULL;
+    volume->fat_entries = 0;
+    
+    free( volume->free_space.runs );
+    memset( &volume->free_space, 0, sizeof(struct FreeSpace) );
+}
+
+
+//CRC32C (Castagnoli, reflected polynomial 0x82F63B78) lookup tables for slicing by 8
+static uint32_t crc32c_table[8][256];
+static int crc32c_use_sse42 = 0;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT; //Tables are built and the CPU checked by the first caller
+
+static void Crc32cInit( void )
+{
+    uint32_t i = 0;
+    int k = 0;
+    
+    for( i = 0; i < 256; i++ )
+    {
+        uint32_t crc = i;
+        
+        for( k = 0; k < 8; k++ )
+        {
+            crc = crc & 1 ? ( crc >> 1 ) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for( i = 0; i < 256; i++ )
+    {
+        for( k = 1; k < 8; k++ )
+        {
+            crc32c_table[k][i] = ( crc32c_table[k - 1][i] >> 8 ) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
+        }
+    }
+    
+#ifdef X86_SIMD
+    __builtin_cpu_init();
+    crc32c_use_sse42 = __builtin_cpu_supports( "sse4.2" );
+#endif
+}
+
+//Eight bytes per step through eight tables
+
+static uint32_t Crc32cScalar( uint32_t crc, const unsigned char *data, size_t length )
+{
+    while( length >= 8 )
+    {
+        uint64_t word;
+        
+        memcpy( &word, data, 8 );
+        word ^= crc; //Little endian: the running CRC lines up with the first four bytes
+        crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][( word >> 8 ) & 0xFF] ^
+              crc32c_table[5][( word >> 16 ) & 0xFF] ^ crc32c_table[4][( word >> 24 ) & 0xFF] ^
+              crc32c_table[3][( word >> 32 ) & 0xFF] ^ crc32c_table[2][( word >> 40 ) & 0xFF] ^
+              crc32c_table[1][( word >> 48 ) & 0xFF] ^ crc32c_table[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while( length > 0 )
+    {
+        crc = ( crc >> 8 ) ^ crc32c_table[0][( crc ^ *data++ ) & 0xFF];
+        length--;
+    }
+    return crc;
+}
+
+#ifdef X86_SIMD
+
+//The SSE4.2 crc32 instruction computes exactly CRC32C, 8 bytes at a time
+
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cSSE42( uint32_t crc, const unsigned char *data, size_t length )
+{
+#if defined(__x86_64__)
+    uint64_t wide = crc;
+    
+    while( length >= 8 )
+    {
+        uint64_t word;
+        
+        memcpy( &word, data, 8 );
+        wide = _mm_crc32_u64( wide, word );
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)wide;
+#endif
+    while( length >= 4 )
+    {
+        uint32_t word;
+        
+        memcpy( &word, data, 4 );
+        crc = _mm_crc32_u32( crc, word );
+        data += 4;
+        length -= 4;
+    }
+    while( length > 0 )
+    {
+        crc = _mm_crc32_u8( crc, *data++ );
+        length--;
+    }
+    return crc;
+}
+
+#endif
+
+
+//Continue a CRC32C over length more bytes. Start from 0; the pre and post inversion is handled here,
+//so Crc32c( Crc32c( 0, a ), b ) is the CRC of a followed by b.
+
+uint32_t Crc32c( uint32_t crc, const void *data, size_t length )
+{
+    pthread_once( &crc32c_once, Crc32cInit );
+#ifdef X86_SIMD
+    if( crc32c_use_sse42 )
+    {
+        return ~Crc32cSSE42( ~crc, data, length );
+    }
+#endif
+    return ~Crc32cScalar( ~crc, data, length );
+}
+
+
+//Whether count records of size bytes at offset lie inside the sidecar index
+
+static int IndexRange( const struct IndexHeader *header, uint64_t offset, uint64_t count, size_t size )
+{
+    return offset % 8 == 0 && offset <= header->size && count <= ( header->size - offset ) / size;
+}
+
+
+//Check a mapped sidecar index against the open image and make sure every table and record
+//it points to lies inside it. Returns 1 if the index can be used.
+
+static int IndexValid( struct Volume *volume, const struct IndexHeader *header, size_t size )
+{
+    const struct IndexDirectory *directories = NULL;
+    const struct IndexFile *files = NULL;
+    uint32_t i = 0;
+    
+    if( memcmp( header->magic, INDEX_MAGIC, sizeof(header->magic) ) != 0 || header->version != INDEX_VERSION ||
+            header->size != size || header->cluster_size != volume->cluster_size ||
+            header->image_size != (uint64_t)volume->image_size ||
+            header->mtime_sec != volume->image_mtime.tv_sec || header->mtime_nsec != volume->image_mtime.tv_nsec )
+    {
+        return 0;
+    }
+    
+    if( !IndexRange( header, header->directories, header->directory_count, sizeof(struct IndexDirectory) ) ||
+            !IndexRange( header, header->files, header->file_count, sizeof(struct IndexFile) ) ||
+            !IndexRange( header, header->free_runs, header->free_count, sizeof(struct Extent) ) )
+    {
+        return 0;
+    }
+    
+    directories = (const struct IndexDirectory *)( (const char *)header + header->directories );
+    for( i = 0; i < header->directory_count; i++ )
+    {
+        if( !IndexRange( header, directories[i].entries, directories[i].count, sizeof(struct DirectoryEntry) ) ||
+                ( i > 0 && directories[i - 1].cluster >= directories[i].cluster ) )
+        {
+            return 0;
+        }
+    }
+    files = (const struct IndexFile *)( (const char *)header + header->files );
+    for( i = 0; i < header->file_count; i++ )
+    {
+        if( !IndexRange( header, files[i].extents, files[i].extent_count, sizeof(struct Extent) ) ||
+                ( i > 0 && files[i - 1].first_cluster >= files[i].first_cluster ) )
+        {
+            return 0;
+        }
+    }
+    
+    //Last, it is the only check that reads more than the index itself
+    return header->fat_crc == Crc32c( 0, volume->fat_table, (size_t)volume->fat_entries * 4 );
+}
+
+
+//Map the sidecar index of a volume if there is one and it still matches the image. A stale or
+//damaged index is deleted. Returns 0 when the index is in use, -1 otherwise.
+
+int IndexOpen( struct Volume *volume )
+{
+    struct stat index_stat;
+    void *map = MAP_FAILED;
+    int fd = -1;
+    
+    IndexClose( volume );
+    if( volume->index_path == NULL || volume->fat_table == NULL ||
+            ( fd = open( volume->index_path, O_RDONLY ) ) == -1 )
+    {
+        return -1;
+    }
+    
+    if( fstat( fd, &index_stat ) == 0 && index_stat.st_size >= (off_t)sizeof(struct IndexHeader) )
+    {
+        map = mmap( NULL, index_stat.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    }
+    close( fd );
+    
+    if( map != MAP_FAILED && IndexValid( volume, map, index_stat.st_size ) )
+    {
+        volume->index = map;
+        return 0;
+    }
+    
+    if( map != MAP_FAILED )
+    {
+        munmap( map, index_stat.st_size );
+    }
+    unlink( volume->index_path );
+    return -1;
+}
+
+
+//Stop using the sidecar index of a volume, the file is left alone
+
+void IndexClose( struct Volume *volume )
+{
+    if( volume->index != NULL )
+    {
+        munmap( (void *)volume->index, volume->index->size );
+        volume->index = NULL;
+    }
+}
+
+
+//Stop using the sidecar index of a volume and delete it
+
+void IndexRemove( struct Volume *volume )
+{
+    IndexClose( volume );
+    if( volume->index_path != NULL )
+    {
+        unlink( volume->index_path );
+    }
+}
+
+
+//Directory and file records both start with their 32 bit key cluster
+
+static int CompareIndexKeys( const void *key, const void *record )
+{
+    uint32_t a = *(const uint32_t *)key;
+    uint32_t b = *(const uint32_t *)record;
+    
+    return a < b ? -1 : a > b;
+}
+
+
+//Fill a directory (whose cluster is set) from the sidecar index instead of its cluster chain.
+//Returns 0 if it was served from the index, -1 if it has to be read from the image.
+
+static int IndexDirectoryEntries( struct Volume *volume, struct Directory *directory )
+{
+    const struct IndexHeader *header = volume->index;
+    const struct IndexDirectory *indexed = NULL;
+    
+    if( header == NULL ||
+            ( indexed = bsearch( &directory->cluster, (const char *)header + header->directories, header->directory_count,
+                                    sizeof(struct IndexDirectory), CompareIndexKeys ) ) == NULL )
+    {
+        return -1;
+    }
+    
+    if( ( directory->entries = malloc( ( (size_t)indexed->count + 1 ) * sizeof(struct DirectoryEntry) ) ) == NULL )
+    {
+        return -1;
+    }
+    memcpy( directory->entries, (const char *)header + indexed->entries, (size_t)indexed->count * sizeof(struct DirectoryEntry) );
+    directory->count = indexed->count;
+    return 0;
+}
+
+
+//Copy the extents of the chain starting at first_cluster out of the sidecar index into a new array.
+//Returns the number of extents, or -1 if the chain has to be followed through the FAT.
+
+static int IndexFileExtents( struct Volume *volume, uint32_t first_cluster, struct Extent **extents )
+{
+    const struct IndexHeader *header = volume->index;
+    const struct IndexFile *indexed = NULL;
+    
+    if( header == NULL ||
+            ( indexed = bsearch( &first_cluster, (const char *)header + header->files, header->file_count,
+                                    sizeof(struct IndexFile), CompareIndexKeys ) ) == NULL )
+    {
+        return -1;
+    }
+    
+    if( ( *extents = malloc( ( (size_t)indexed->extent_count + 1 ) * sizeof(struct Extent) ) ) == NULL )
+    {
+        return -1;
+    }
+    memcpy( *extents, (const char *)header + indexed->extents, (size_t)indexed->extent_count * sizeof(struct Extent) );
+    return indexed->extent_count;
+}
+
+
+//Fill a new cluster index (whose first cluster is set) from the extents in the sidecar index.
+//Returns 0 if it was served from the index, -1 if the chain has to be followed through the FAT.
+
+static int IndexFileClusters( struct Volume *volume, struct ClusterIndex *index )
+{
+    struct Extent *extents = NULL;
+    int count = IndexFileExtents( volume, index->first_cluster, &extents );
+    uint64_t total = 0;
+    int i = 0;
+    
+    for( i = 0; i < count; i++ )
+    {
+        total += extents[i].length;
+    }
+    if( count == -1 || total > volume->fat_entries ||
+            ( index->clusters = malloc( ( total + 1 ) * sizeof(uint32_t) ) ) == NULL )
+    {
+        free( extents );
+        return -1;
+    }
+    
+    for( i = 0; i < count; i++ )
+    {
+        uint32_t cluster = 0;
+        
+        for( cluster = 0; cluster < extents[i].length; cluster++ )
+        {
+            index->clusters[index->count++] = extents[i].start_cluster + cluster;
+        }
+    }
+    free( extents );
+    return 0;
+}
+
+
+//Find the starting address of a block of data given the sector number corresponding to that data block
+
+off_t LBAToOffset( struct Volume *volume, uint32_t sector )
+{
+    return ( ( (off_t)sector - 2 ) * volume->cluster_size ) + ( (off_t)volume->BPB_BytsPerSec *  volume->BPB_RsvdSecCnt )
+                + ( (off_t)volume->BPB_NumFATs * volume->BPB_FATSz32 * volume->BPB_BytsPerSec );
+}
+
+
+//Given a logical block address, lookup into the cached first FAT and return the logical address of the next block in file.
+//Out of range clusters are reported as end of chain. Chain walkers count their lookups into STAT_FAT_LOOKUPS in bulk.
+
+uint32_t NextLB( struct Volume *volume, uint32_t sector )
+{
+    if( sector >= volume->fat_entries )
+    {
+        return FAT_EOC;
+    }
+    return volume->fat_table[sector] & FAT_ENTRY_MASK;
+}
+
+
+//Return 1 if cluster terminates a chain: an end-of-chain marker, a bad cluster,
+//a free/reserved entry, or a cluster number beyond the FAT
+
+int IsEndOfChain( struct Volume *volume, uint32_t cluster )
+{
+    return cluster < 2 || cluster >= FAT_BAD_CLUSTER || cluster >= volume->fat_entries;
+}
+
+
+//Combine the high and low words of a directory entry's first cluster number
+
+uint32_t FirstCluster( const struct DirectoryEntry *entry )
+{
+    return ( (uint32_t)entry->DIR_FirstClusterHigh << 16 ) | entry->DIR_FirstClusterLow;
+}
+
+
+//Number of data clusters on the volume, from the sector counts. Never more than the FAT can describe.
+
+uint32_t ClusterCount( struct Volume *volume )
+{
+    uint64_t total_sectors = volume->BPB_TotSec16 != 0 ? volume->BPB_TotSec16 : volume->BPB_TotSec32;
+    uint64_t system_sectors = (uint64_t)volume->BPB_RsvdSecCnt + (uint64_t)volume->BPB_NumFATs * volume->BPB_FATSz32;
+    uint64_t limit = volume->fat_entries > 2 ? volume->fat_entries - 2 : 0;
+    
+    if( volume->BPB_SecPerClus == 0 || total_sectors <= system_sectors )
+    {
+        return limit; //No usable sector count, trust the FAT size
+    }
+    
+    uint64_t clusters = ( total_sectors - system_sectors ) / volume->BPB_SecPerClus;
+    return clusters < limit ? clusters : limit;
+}
+
+
+static void CountClustersScalar( const uint32_t *entries, size_t count, struct ClusterUsage *usage )
+{
+    size_t i = 0;
+    
+    for( i = 0; i < count; i++ )
+    {
+        uint32_t value = entries[i] & FAT_ENTRY_MASK;
+        
+        if( value == 0 ) usage->free++;
+        else if( value == FAT_BAD_CLUSTER ) usage->bad++;
+        else if( value == 1 || ( value >= 0x0FFFFFF0 && value < FAT_BAD_CLUSTER ) ) usage->reserved++;
+        else usage->used++;
+    }
+}
+
+
+#ifdef X86_SIMD
+
+//Masked entries are below 2^28, so signed 32 bit compares are exact. Each compare yields -1 per
+//matching lane, subtracted into per-lane counters that are summed once at the end.
+
+static void CountClustersSSE2( const uint32_t *entries, size_t count, struct ClusterUsage *usage )
+{
+    const __m128i mask = _mm_set1_epi32( FAT_ENTRY_MASK );
+    const __m128i bad = _mm_set1_epi32( FAT_BAD_CLUSTER );
+    const __m128i one = _mm_set1_epi32( 1 );
+    const __m128i reserved_low = _mm_set1_epi32( 0x0FFFFFF0 - 1 );
+    __m128i free_count = _mm_setzero_si128(), bad_count = _mm_setzero_si128(), reserved_count = _mm_setzero_si128();
+    uint32_t lanes[3][4];
+    size_t i = 0;
+    int k = 0;
+    
+    for( i = 0; i + 4 <= count; i += 4 )
+    {
+        __m128i value = _mm_and_si128( _mm_loadu_si128( (const __m128i *)&entries[i] ), mask );
+        __m128i is_reserved = _mm_or_si128( _mm_cmpeq_epi32( value, one ),
+                                            _mm_and_si128( _mm_cmpgt_epi32( value, reserved_low ), _mm_cmplt_epi32( value, bad ) ) );
+        
+        free_count = _mm_sub_epi32( free_count, _mm_cmpeq_epi32( value, _mm_setzero_si128() ) );
+        bad_count = _mm_sub_epi32( bad_count, _mm_cmpeq_epi32( value, bad ) );
+        reserved_count = _mm_sub_epi32( reserved_count, is_reserved );
+    }
+    
+    _mm_storeu_si128( (__m128i *)lanes[0], free_count );
+    _mm_storeu_si128( (__m128i *)lanes[1], bad_count );
+    _mm_storeu_si128( (__m128i *)lanes[2], reserved_count );
+    for( k = 0; k < 4; k++ )
+    {
+        usage->free += lanes[0][k];
+        usage->bad += lanes[1][k];
+        usage->reserved += lanes[2][k];
+    }
+    usage->used += i - ( lanes[0][0] + lanes[0][1] + lanes[0][2] + lanes[0][3] ) - ( lanes[1][0] + lanes[1][1] + lanes[1][2] + lanes[1][3] )
+                     - ( lanes[2][0] + lanes[2][1] + lanes[2][2] + lanes[2][3] );
+    CountClustersScalar( &entries[i], count - i, usage );
+}
+
+
+__attribute__((target("avx2")))
+static void CountClustersAVX2( const uint32_t *entries, size_t count, struct ClusterUsage *usage )
+{
+    const __m256i mask = _mm256_set1_epi32( FAT_ENTRY_MASK );
+    const __m256i bad = _mm256_set1_epi32( FAT_BAD_CLUSTER );
+    const __m256i one = _mm256_set1_epi32( 1 );
+    const __m256i reserved_low = _mm256_set1_epi32( 0x0FFFFFF0 - 1 );
+    __m256i free_count = _mm256_setzero_si256(), bad_count = _mm256_setzero_si256(), reserved_count = _mm256_setzero_si256();
+    uint32_t lanes[3][8];
+    uint64_t counted = 0;
+    size_t i = 0;
+    int k = 0;
+    
+    for( i = 0; i + 8 <= count; i += 8 )
+    {
+        __m256i value = _mm256_and_si256( _mm256_loadu_si256( (const __m256i *)&entries[i] ), mask );
+        __m256i is_reserved = _mm256_or_si256( _mm256_cmpeq_epi32( value, one ),
+                                               _mm256_and_si256( _mm256_cmpgt_epi32( value, reserved_low ), _mm256_cmpgt_epi32( bad, value ) ) );
+        
+        free_count = _mm256_sub_epi32( free_count, _mm256_cmpeq_epi32( value, _mm256_setzero_si256() ) );
+        bad_count = _mm256_sub_epi32( bad_count, _mm256_cmpeq_epi32( value, bad ) );
+        reserved_count = _mm256_sub_epi32( reserved_count, is_reserved );
+    }
+    
+    _mm256_storeu_si256( (__m256i *)lanes[0], free_count );
+    _mm256_storeu_si256( (__m256i *)lanes[1], bad_count );
+    _mm256_storeu_si256( (__m256i *)lanes[2], reserved_count );
+    for( k = 0; k < 8; k++ )
+    {
+        usage->free += lanes[0][k];
+        usage->bad += lanes[1][k];
+        usage->reserved += lanes[2][k];
+        counted += (uint64_t)lanes[0][k] + lanes[1][k] + lanes[2][k];
+    }
+    usage->used += i - counted;
+    CountClustersScalar( &entries[i], count - i, usage );
+}
+
+#endif
+
+
+//One slice of a FAT scan
+struct FATScan
+{
+    const uint32_t *entries;
+    size_t count;
+    struct ClusterUsage usage;
+};
+
+static void * FATScanWorker( void *arg )
+{
+    struct FATScan *scan = arg;
+    
+#ifdef X86_SIMD
+    if( __builtin_cpu_supports( "avx2" ) )
+    {
+        CountClustersAVX2( scan->entries, scan->count, &scan->usage );
+    }
+    else
+    {
+        CountClustersSSE2( scan->entries, scan->count, &scan->usage );
+    }
+#else
+    CountClustersScalar( scan->entries, scan->count, &scan->usage );
+#endif
+    return NULL;
+}
+
+
+//Classify the FAT entry of every data cluster. Large FATs are split into slices scanned in parallel.
+
+void FATCountClusters( struct Volume *volume, struct ClusterUsage *usage )
+{
+    struct FATScan scans[MAX_WALK_THREADS];
+    pthread_t threads[MAX_WALK_THREADS];
+    size_t count = ClusterCount(volume);
+    int slices = (int)( count / FAT_SCAN_THREAD_ENTRIES ) + 1;
+    int started = 0;
+    int i = 0;
+    
+    memset( usage, 0, sizeof(struct ClusterUsage) );
+    if( volume->fat_table == NULL || count == 0 )
+    {
+        return;
+    }
+    if( volume->index != NULL ) //Counted when the sidecar index was built
+    {
+        *usage = volume->index->usage;
+        return;
+    }
+    
+    if( slices > WalkThreadCount() )
+    {
+        slices = WalkThreadCount();
+    }
+    
+    for( i = 0; i < slices; i++ )
+    {
+        size_t first = count * i / slices;
+        size_t last = count * ( i + 1 ) / slices;
+        
+        memset( &scans[i], 0, sizeof(struct FATScan) );
+        scans[i].entries = &volume->fat_table[2 + first]; //Entries 0 and 1 are not clusters
+        scans[i].count = last - first;
+    }
+    
+    //Slice 0 is scanned by the calling thread, and every slice whose thread could not be started
+    for( i = 1; i < slices; i++ )
+    {
+        if( pthread_create( &threads[i], NULL, FATScanWorker, &scans[i] ) != 0 )
+        {
+            break;
+        }
+        started = i;
+    }
+    FATScanWorker( &scans[0] );
+    for( i = started + 1; i < slices; i++ )
+    {
+        FATScanWorker( &scans[i] );
+    }
+    
+    for( i = 0; i < slices; i++ )
+    {
+        if( i >= 1 && i <= started )
+        {
+            pthread_join( threads[i], NULL );
+        }
+        usage->free += scans[i].usage.free;
+        usage->used += scans[i].usage.used;
+        usage->bad += scans[i].usage.bad;
+        usage->reserved += scans[i].usage.reserved;
+    }
+}
+
+
+//Collect the runs of free clusters from the cached FAT into free_space.
+//Returns 0 on success, -1 on allocation failure (free_space is left unbuilt).
+
+int FreeSpaceBuild( struct Volume *volume )
+{
+    uint32_t last = ClusterCount(volume) + 2; //One past the last data cluster
+    uint32_t cluster = 2;
+    
+    volume->free_space.count = 0;
+    volume->free_space.total = 0;
+    volume->free_space.valid = 0;
+    
+    if( volume->index != NULL ) //Recorded in the sidecar index
+    {
+        const struct Extent *runs = (const struct Extent *)( (const char *)volume->index + volume->index->free_runs );
+        uint32_t count = volume->index->free_count;
+        uint32_t i = 0;
+        
+        if( count > volume->free_space.capacity )
+        {
+            struct Extent *grown = realloc( volume->free_space.runs, (size_t)count * sizeof(struct Extent) );
+            if( grown == NULL )
+            {
+                return -1;
+            }
+            volume->free_space.runs = grown;
+            volume->free_space.capacity = count;
+        }
+        for( i = 0; i < count; i++ )
+        {
+            volume->free_space.runs[i] = runs[i];
+            volume->free_space.total += runs[i].length;
+        }
+        volume->free_space.count = count;
+        volume->free_space.valid = 1;
+        return 0;
+    }
+    
+    while( cluster < last )
+    {
+        if( ( volume->fat_table[cluster] & FAT_ENTRY_MASK ) != 0 )
+        {
+            cluster++;
+            continue;
+        }
+        
+        uint32_t start = cluster;
+        while( cluster < last && ( volume->fat_table[cluster] & FAT_ENTRY_MASK ) == 0 )
+        {
+            cluster++;
+        }
+        
+        if( volume->free_space.count == volume->free_space.capacity )
+        {
+            uint32_t capacity = volume->free_space.capacity > 0 ? volume->free_space.capacity * 2 : 256;
+            struct Extent *grown = realloc( volume->free_space.runs, (size_t)capacity * sizeof(struct Extent) );
+            if( grown == NULL )
+            {
+                return -1;
+            }
+            volume->free_space.runs = grown;
+            volume->free_space.capacity = capacity;
+        }
+        volume->free_space.runs[volume->free_space.count].start_cluster = start;
+        volume->free_space.runs[volume->free_space.count].length = cluster - start;
+        volume->free_space.count++;
+        volume->free_space.total += cluster - start;
+    }
+    
+    volume->free_space.valid = 1;
+    return 0;
+}
+
+
+//Take clusters free clusters out of free_space in as few runs as possible: the smallest free run
+//that holds everything that is still needed, or else the largest run, repeatedly. The FAT itself is
+//not touched. On success *extents holds a malloc'd array the caller frees and the number of extents
+//is returned. Returns -1 if there is not enough free space or on allocation failure.
+
+int FreeSpaceAllocate( struct Volume *volume, uint32_t clusters, struct Extent **extents )
+{
+    int count = 0;
+    
+    *extents = NULL;
+    if( ( !volume->free_space.valid && FreeSpaceBuild(volume) == -1 ) || clusters > volume->free_space.total )
+    {
+        return -1;
+    }
+    
+    while( clusters > 0 )
+    {
+        uint32_t best = volume->free_space.count; //Smallest run holding all of clusters
+        uint32_t largest = 0;
+        uint32_t i = 0;
+        
+        for( i = 0; i < volume->free_space.count; i++ )
+        {
+            uint32_t length = volume->free_space.runs[i].length;
+            
+            if( length >= clusters && ( best == volume->free_space.count || length < volume->free_space.runs[best].length ) )
+            {
+                best = i;
+            }
+            if( length > volume->free_space.runs[largest].length )
+            {
+                largest = i;
+            }
+        }
+        
+        struct Extent *run = &volume->free_space.runs[best != volume->free_space.count ? best : largest];
+        uint32_t take = run->length < clusters ? run->length : clusters;
+        struct Extent *grown = realloc( *extents, (size_t)( count + 1 ) * sizeof(struct Extent) );
+        
+        if( grown == NULL )
+        {
+            free( *extents );
+            *extents = NULL;
+            volume->free_space.valid = 0; //Rebuilt from the unchanged FAT on the next allocation
+            return -1;
+        }
+        *extents = grown;
+        (*extents)[count].start_cluster = run->start_cluster;
+        (*extents)[count].length = take;
+        count++;
+        
+        run->start_cluster += take;
+        run->length -= take;
+        volume->free_space.total -= take;
+        clusters -= take;
+        if( run->length == 0 )
+        {
+            uint32_t position = run - volume->free_space.runs;
+            memmove( run, run + 1, (size_t)( volume->free_space.count - position - 1 ) * sizeof(struct Extent) );
+            volume->free_space.count--;
+        }
+    }
+    
+    return count;
+}
+
+
+//Take one run of exactly clusters free clusters out of free_space: the start of the smallest free run
+//that is large enough. Returns 0 on success, -1 if no single run is large enough.
+
+int FreeSpaceTake( struct Volume *volume, uint32_t clusters, struct Extent *extent )
+{
+    uint32_t best = 0;
+    uint32_t i = 0;
+    
+    if( ( !volume->free_space.valid && FreeSpaceBuild(volume) == -1 ) || clusters == 0 )
+    {
+        return -1;
+    }
+    
+    best = volume->free_space.count;
+    for( i = 0; i < volume->free_space.count; i++ )
+    {
+        if( volume->free_space.runs[i].length >= clusters &&
+                ( best == volume->free_space.count || volume->free_space.runs[i].length < volume->free_space.runs[best].length ) )
+        {
+            best = i;
+        }
+    }
+    if( best == volume->free_space.count )
+    {
+        return -1;
+    }
+    
+    struct Extent *run = &volume->free_space.runs[best];
+    extent->start_cluster = run->start_cluster;
+    extent->length = clusters;
+    run->start_cluster += clusters;
+    run->length -= clusters;
+    volume->free_space.total -= clusters;
+    if( run->length == 0 )
+    {
+        memmove( run, run + 1, (size_t)( volume->free_space.count - best - 1 ) * sizeof(struct Extent) );
+        volume->free_space.count--;
+    }
+    return 0;
+}
+
+
+//Give runs of clusters back to free_space, merging them with their free neighbours.
+//The FAT itself is not touched.
+
+void FreeSpaceRelease( struct Volume *volume, const struct Extent *extents, int count )
+{
+    int i = 0;
+    
+    if( !volume->free_space.valid )
+    {
+        return; //Rebuilt from the FAT on the next allocation anyway
+    }
+    
+    for( i = 0; i < count; i++ )
+    {
+        uint32_t start = extents[i].start_cluster;
+        uint32_t end = start + extents[i].length;
+        uint32_t low = 0;
+        uint32_t high = volume->free_space.count;
+        
+        while( low < high ) //First run starting after the released one
+        {
+            uint32_t middle = ( low + high ) / 2;
+            
+            if( volume->free_space.runs[middle].start_cluster < start )
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        
+        struct Extent *before = low > 0 ? &volume->free_space.runs[low - 1] : NULL;
+        struct Extent *after = low < volume->free_space.count ? &volume->free_space.runs[low] : NULL;
+        
+        volume->free_space.total += extents[i].length;
+        if( before != NULL && before->start_cluster + before->length == start )
+        {
+            before->length += extents[i].length;
+            if( after != NULL && after->start_cluster == end )
+            {
+                before->length += after->length;
+                memmove( after, after + 1, (size_t)( volume->free_space.count - low - 1 ) * sizeof(struct Extent) );
+                volume->free_space.count--;
+            }
+        }
+        else if( after != NULL && after->start_cluster == end )
+        {
+            after->start_cluster = start;
+            after->length += extents[i].length;
+        }
+        else
+        {
+            if( volume->free_space.count == volume->free_space.capacity )
+            {
+                uint32_t capacity = volume->free_space.capacity > 0 ? volume->free_space.capacity * 2 : 256;
+                struct Extent *grown = realloc( volume->free_space.runs, (size_t)capacity * sizeof(struct Extent) );
+                if( grown == NULL )
+                {
+                    volume->free_space.valid = 0;
+                    return;
+                }
+                volume->free_space.runs = grown;
+                volume->free_space.capacity = capacity;
+            }
+            memmove( &volume->free_space.runs[low + 1], &volume->free_space.runs[low], (size_t)( volume->free_space.count - low ) * sizeof(struct Extent) );
+            volume->free_space.runs[low] = extents[i];
+            volume->free_space.count++;
+        }
+    }
+}
+
+
+//Set the cluster number held by a cached FAT entry, keeping its reserved high 4 bits
+
+void FATSetEntry( struct Volume *volume, uint32_t cluster, uint32_t value )
+{
+    volume->fat_table[cluster] = ( volume->fat_table[cluster] & ~FAT_ENTRY_MASK ) | ( value & FAT_ENTRY_MASK );
+}
+
+
+//Write ranges of the cached FAT (each a start entry and an entry count) to every FAT copy on the image.
+//Returns 0 on success, -1 if a write fails.
+
+int FATFlush( struct Volume *volume, const struct Extent *ranges, int count )
+{
+    off_t fat_offset = (off_t)volume->BPB_RsvdSecCnt * volume->BPB_BytsPerSec;
+    off_t fat_bytes = (off_t)volume->BPB_FATSz32 * volume->BPB_BytsPerSec;
+    int copy = 0;
+    int i = 0;
+    
+    for( copy = 0; copy < volume->BPB_NumFATs; copy++ )
+    {
+        for( i = 0; i < count; i++ )
+        {
+            if( ImageWrite( volume, &volume->fat_table[ranges[i].start_cluster], (size_t)ranges[i].length * 4,
+                    fat_offset + copy * fat_bytes + (off_t)ranges[i].start_cluster * 4 ) == -1 )
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+//Walk the chain starting at first_cluster and coalesce physically contiguous clusters into extents.
+//On success *extents holds a malloc'd array the caller frees and the number of extents is returned.
+//A chain longer than the FAT (i.e. a cycle) is cut off. Returns -1 on allocation failure.
+
+int BuildExtents( struct Volume *volume, uint32_t first_cluster, struct Extent **extents )
+{
+    int count = 0;
+    int capacity = 0;
+    uint32_t hops = 0;
+    uint32_t cluster = first_cluster;
+    
+    *extents = NULL;
+    if( ( count = IndexFileExtents( volume, first_cluster, extents ) ) != -1 )
+    {
+        return count;
+    }
+    count = 0;
+    
+    while( !IsEndOfChain(volume,cluster) && hops < volume->fat_entries )
+    {
+        if( count > 0 && (*extents)[count - 1].start_cluster + (*extents)[count - 1].length == cluster )
+        {
+            (*extents)[count - 1].length++;
+        }
+        else
+        {
+            if( count == capacity )
+            {
+                capacity = capacity == 0 ? 8 : capacity * 2;
+                struct Extent *grown = realloc( *extents, capacity * sizeof(struct Extent) );
+                if( grown == NULL )
+                {
+                    free( *extents );
+                    *extents = NULL;
+                    return -1;
+                }
+                *extents = grown;
+            }
+            (*extents)[count].start_cluster = cluster;
+            (*extents)[count].length = 1;
+            count++;
+        }
+        
+        cluster = NextLB( volume, cluster );
+        hops++;
+    }
+    
+    StatAdd( STAT_FAT_LOOKUPS, hops );
+    return count;
+}
+
+
+//Copy length bytes at offset in the image to out_fd without staging them in user space.
+//*method starts at COPY_METHOD_RANGE and is downgraded when the kernel refuses a method
+//(cross-filesystem copy_file_range, sendfile to an unsupported target) so later calls skip it.
+//Returns 0 on success, -1 on failure.
+
+int CopyImageRange( struct Volume *volume, int out_fd, off_t offset, uint64_t length, int *method )
+{
+    char *bounce = NULL; //Only allocated when the buffered path has to pread
+    
+    while( length > 0 )
+    {
+        size_t chunk = length < EXTENT_CHUNK_SIZE ? length : EXTENT_CHUNK_SIZE;
+        uint64_t start = StatClock();
+        ssize_t n = -1;
+        
+        if( *method == COPY_METHOD_RANGE )
+        {
+            loff_t in_offset = offset;
+            n = copy_file_range( volume->image_fd, &in_offset, out_fd, NULL, chunk, 0 );
+            //0 is a short copy (the image ends early, or the kernel declines); let the next
+            //method decide rather than spinning here
+            if( n == 0 || ( n < 0 && errno != EINTR ) )
+            {
+                *method = COPY_METHOD_SENDFILE;
+                continue;
+            }
+        }
+        else if( *method == COPY_METHOD_SENDFILE )
+        {
+            off_t in_offset = offset;
+            n = sendfile( out_fd, volume->image_fd, &in_offset, chunk );
+            if( n == 0 || ( n < 0 && errno != EINTR ) )
+            {
+                *method = COPY_METHOD_BUFFERED;
+                continue;
+            }
+        }
+        else
+        {
+            const void *data = ImagePointer( volume, offset, chunk );
+            
+            if( data == NULL )
+            {
+                if( bounce == NULL && ( bounce = malloc( EXTENT_CHUNK_SIZE ) ) == NULL )
+                {
+                    return -1;
+                }
+                if( ImageRead( volume, bounce, chunk, offset ) == -1 )
+                {
+                    free( bounce );
+                    return -1;
+                }
+                data = bounce;
+            }
+            
+            n = write( out_fd, data, chunk );
+            if( n == 0 || ( n < 0 && errno != EINTR ) )
+            {
+                free( bounce );
+                return -1;
+            }
+        }
+        
+        if( n > 0 )
+        {
+            HistogramRecord( &stat_output_latency, start );
+            StatAdd( STAT_OUTPUT_WRITES, 1 );
+            StatAdd( STAT_OUTPUT_BYTES, n );
+            offset += n;
+            length -= n;
+        }
+    }
+    
+    free( bounce );
+    return 0;
+}
+
+
+//Copy the contents of a file to out_fd at its current position, trimming the last cluster to
+//DIR_FileSize. Whole-cluster ranges from the streaming reader go through the zero-copy path; once
+//the kernel refuses both copy_file_range and sendfile on a pread-backed image, the rest of the file
+//is streamed through the reader's double buffers instead. *method is as for CopyImageRange, so a
+//caller writing many files to one descriptor only probes the kernel once. The data never passes
+//through a stdio buffer, so binary files come out byte for byte. Returns 0 on success, -1 on failure.
+
+int StreamFile( struct Volume *volume, const struct DirectoryEntry *entry, int out_fd, int *method )
+{
+    struct FileReader reader;
+    int status = 0;
+    ssize_t n = 0;
+    
+    if( ReaderOpen( volume, &reader, entry ) == -1 )
+    {
+        return -1;
+    }
+    
+    while( status == 0 && ( *method != COPY_METHOD_BUFFERED || volume->image_map != NULL ) )
+    {
+        off_t offset;
+        
+        if( ( n = ReaderNextRange( &reader, &offset ) ) <= 0 )
+        {
+            break;
+        }
+        status = CopyImageRange( volume, out_fd, offset, n, method );
+    }
+    
+    if( status == 0 && n >= 0 && reader.position < reader.end ) //Buffered fallback without a mapping
+    {
+        const char *data;
+        
+        ReaderSeek( &reader, reader.position, reader.end - reader.position );
+        while( ( n = ReaderNext( &reader, &data ) ) > 0 )
+        {
+            uint64_t start = StatClock();
+            
+            if( write( out_fd, data, n ) != n )
+            {
+                status = -1;
+                break;
+            }
+            HistogramRecord( &stat_output_latency, start );
+            StatAdd( STAT_OUTPUT_WRITES, 1 );
+            StatAdd( STAT_OUTPUT_BYTES, n );
+        }
+    }
+    
+    if( n < 0 || reader.position < entry->DIR_FileSize ) //Chain ended before DIR_FileSize bytes were found
+    {
+        status = -1;
+    }
+    
+    ReaderClose( &reader );
+    return status;
+}
+
+
+//Copy the contents of a file into path on the host. Returns 0 on success, -1 on failure.
+
+int ExtractFile( struct Volume *volume, const struct DirectoryEntry *entry, const char *path )
+{
+    int method = COPY_METHOD_RANGE;
+    int out_fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    
+    if( out_fd == -1 )
+    {
+        return -1;
+    }
+    
+    int status = StreamFile( volume, entry, out_fd, &method );
+    
+    if( close( out_fd ) != 0 )
+    {
+        status = -1;
+    }
+    return status;
+}
+
+
+//Build, or find in the cache, the cluster index of the chain starting at first_cluster and pin it.
+//A chain longer than the FAT (i.e. a cycle) is cut off. Returns NULL on allocation failure.
+
+struct ClusterIndex * ClusterIndexAcquire( struct Volume *volume, uint32_t first_cluster )
+{
+    struct ClusterIndex *index = NULL;
+    struct ClusterIndex **link = NULL;
+    
+    pthread_mutex_lock( &volume->cluster_index_lock );
+    for( link = &volume->cluster_index_cache; *link != NULL; link = &(*link)->next )
+    {
+        if( (*link)->first_cluster == first_cluster )
+        {
+            index = *link;
+            *link = index->next; //Move to the front
+            index->next = volume->cluster_index_cache;
+            volume->cluster_index_cache = index;
+            index->users++;
+            pthread_mutex_unlock( &volume->cluster_index_lock );
+            StatAdd( STAT_INDEX_HITS, 1 );
+            return index;
+        }
+    }
+    pthread_mutex_unlock( &volume->cluster_index_lock );
+    StatAdd( STAT_INDEX_MISSES, 1 );
+    
+    //Not cached, build it outside the lock
+    
+    uint32_t capacity = 0;
+    uint32_t cluster = first_cluster;
+    
+    if( ( index = calloc( 1, sizeof(struct ClusterIndex) ) ) == NULL )
+    {
+        return NULL;
+    }
+    index->first_cluster = first_cluster;
+    
+    if( IndexFileClusters( volume, index ) == -1 ) //Not in the sidecar index, follow the chain
+    {
+        while( !IsEndOfChain(volume,cluster) && index->count < volume->fat_entries )
+        {
+            if( index->count == capacity )
+            {
+                capacity = capacity == 0 ? 64 : capacity * 2;
+                uint32_t *grown = realloc( index->clusters, (size_t)capacity * sizeof(uint32_t) );
+                if( grown == NULL )
+                {
+                    free( index->clusters );
+                    free( index );
+                    return NULL;
+                }
+                index->clusters = grown;
+            }
+            index->clusters[index->count++] = cluster;
+            cluster = NextLB( volume, cluster );
+        }
+        StatAdd( STAT_FAT_LOOKUPS, index->count );
+    }
+    index->users = 1;
+    
+    //Insert at the front, then trim unused entries from the tail while over the limits
+    
+    pthread_mutex_lock( &volume->cluster_index_lock );
+    index->next = volume->cluster_index_cache;
+    volume->cluster_index_cache = index;
+    
+    int entries = 0;
+    uint64_t total = 0;
+    link = &volume->cluster_index_cache;
+    while( *link != NULL )
+    {
+        struct ClusterIndex *entry = *link;
+        
+        entries++;
+        total += entry->count;
+        if( entry != index && entry->users == 0 &&
+                ( entries > MAX_CLUSTER_INDEXES || total > CLUSTER_INDEX_LIMIT ) )
+        {
+            *link = entry->next;
+            entries--;
+            total -= entry->count;
+            free( entry->clusters );
+            free( entry );
+        }
+        else
+        {
+            link = &entry->next;
+        }
+    }
+    pthread_mutex_unlock( &volume->cluster_index_lock );
+    
+    return index;
+}
+
+
+//Unpin an index returned by ClusterIndexAcquire
+
+void ClusterIndexRelease( struct Volume *volume, struct ClusterIndex *index )
+{
+    if( index == NULL )
+    {
+        return;
+    }
+    
+    pthread_mutex_lock( &volume->cluster_index_lock );
+    index->users--;
+    int release = index->stale && index->users == 0;
+    pthread_mutex_unlock( &volume->cluster_index_lock );
+    
+    if( release )
+    {
+        free( index->clusters );
+        free( index );
+    }
+}
+
+
+//Drop every cached index, e.g. when the current directory changes. Pinned indexes are freed on release.
+
+void ClusterIndexFlush( struct Volume *volume )
+{
+    pthread_mutex_lock( &volume->cluster_index_lock );
+    while( volume->cluster_index_cache != NULL )
+    {
+        struct ClusterIndex *index = volume->cluster_index_cache;
+        
+        volume->cluster_index_cache = index->next;
+        if( index->users > 0 )
+        {
+            index->stale = 1;
+        }
+        else
+        {
+            free( index->clusters );
+            free( index );
+        }
+    }
+    pthread_mutex_unlock( &volume->cluster_index_lock );
+}
+
+
+//Read length bytes starting at logical byte start of an indexed file into buffer. The starting
+//cluster is found directly from the index and physically contiguous clusters are coalesced into
+//one read. Returns 0 on success, -1 if the range runs past the end of the chain.
+
+int ReadClusters( struct Volume *volume, const struct ClusterIndex *index, uint64_t start, size_t length, char *buffer )
+{
+    while( length > 0 )
+    {
+        uint64_t logical = start / volume->cluster_size;
+        uint64_t skip = start % volume->cluster_size;
+        
+        if( logical >= index->count )
+        {
+            return -1;
+        }
+        
+        uint64_t run = 1; //Contiguous clusters starting at logical
+        while( run * volume->cluster_size - skip < length && logical + run < index->count &&
+                index->clusters[logical + run] == index->clusters[logical] + run )
+        {
+            run++;
+        }
+        
+        uint64_t chunk = run * volume->cluster_size - skip < length ? run * volume->cluster_size - skip : length;
+        
+        if( ImageRead( volume, buffer, chunk, LBAToOffset( volume, index->clusters[logical] ) + skip ) == -1 )
+        {
+            return -1;
+        }
+        buffer += chunk;
+        start += chunk;
+        length -= chunk;
+    }
+    
+    return 0;
+}
+
+
+//Prepare a streaming reader over the file described by entry, positioned at its first byte.
+//Returns 0 on success, -1 if the cluster index cannot be built.
+
+int ReaderOpen( struct Volume *volume, struct FileReader *reader, const struct DirectoryEntry *entry )
+{
+    memset( reader, 0, sizeof(struct FileReader) );
+    
+    if( volume->cluster_size == 0 )
+    {
+        return -1;
+    }
+    
+    reader->volume = volume;
+    reader->index = ClusterIndexAcquire( volume, FirstCluster( entry ) );
+    if( reader->index == NULL )
+    {
+        return -1;
+    }
+    
+    //Round the readahead window up to whole clusters
+    reader->window = ( ( volume->readahead_window + volume->cluster_size - 1 ) / volume->cluster_size ) * volume->cluster_size;
+    reader->file_size = entry->DIR_FileSize;
+    reader->end = reader->file_size;
+    reader->handed = -1;
+    pthread_mutex_init( &reader->lock, NULL );
+    pthread_cond_init( &reader->cond, NULL );
+    return 0;
+}
+
+
+//Fill buffer b from its requested range. Called with the reader lock held; drops it during the read.
+
+static void ReaderFill( struct FileReader *reader, int b )
+{
+    reader->state[b] = BUFFER_BUSY;
+    pthread_mutex_unlock( &reader->lock );
+    
+    int status = 0;
+    if( reader->buffer[b] == NULL && ( reader->buffer[b] = malloc( reader->window ) ) == NULL )
+    {
+        status = -1;
+    }
+    else
+    {
+        status = ReadClusters( reader->volume, reader->index, reader->fill_position[b], reader->fill_length[b], reader->buffer[b] );
+    }
+    
+    pthread_mutex_lock( &reader->lock );
+    reader->state[b] = status == 0 ? BUFFER_READY : BUFFER_ERROR;
+    pthread_cond_broadcast( &reader->cond );
+}
+
+
+//Readahead thread: fill queued buffers in file order until told to stop
+
+static void * ReaderWorker( void *arg )
+{
+    struct FileReader *reader = arg;
+    
+    pthread_mutex_lock( &reader->lock );
+    while( !reader->stop )
+    {
+        int b = -1;
+        
+        if( reader->state[0] == BUFFER_QUEUED )
+        {
+            b = 0;
+        }
+        if( reader->state[1] == BUFFER_QUEUED && ( b == -1 || reader->fill_position[1] < reader->fill_position[0] ) )
+        {
+            b = 1;
+        }
+        
+        if( b == -1 )
+        {
+            pthread_cond_wait( &reader->cond, &reader->lock );
+        }
+        else
+        {
+            ReaderFill( reader, b );
+        }
+    }
+    pthread_mutex_unlock( &reader->lock );
+    return NULL;
+}
+
+
+//Queue the next window of the file into buffer b if anything is left. Called with the lock held.
+//The first fill after a seek is only aligned up to the next window boundary.
+
+static void ReaderQueue( struct FileReader *reader, int b )
+{
+    if( reader->next_fetch >= reader->end )
+    {
+        reader->state[b] = BUFFER_EMPTY;
+        return;
+    }
+    
+    uint64_t length = reader->window - ( reader->next_fetch % reader->window );
+    if( length > reader->end - reader->next_fetch )
+    {
+        length = reader->end - reader->next_fetch;
+    }
+    
+    reader->fill_position[b] = reader->next_fetch;
+    reader->fill_length[b] = length;
+    reader->state[b] = BUFFER_QUEUED;
+    reader->next_fetch += length;
+    
+    //The thread only pays off once there is a second buffer to fetch in the background
+    if( !reader->thread_started && reader->state[b ^ 1] == BUFFER_QUEUED )
+    {
+        reader->thread_started = pthread_create( &reader->thread, NULL, ReaderWorker, reader ) == 0;
+    }
+    pthread_cond_broadcast( &reader->cond );
+}
+
+
+//Reposition the reader at logical byte position and start fetching at most length bytes
+//from there (clipped to the file size). Any fills in flight are discarded.
+
+int ReaderSeek( struct FileReader *reader, uint64_t position, uint64_t length )
+{
+    pthread_mutex_lock( &reader->lock );
+    
+    while( reader->state[0] == BUFFER_BUSY || reader->state[1] == BUFFER_BUSY )
+    {
+        pthread_cond_wait( &reader->cond, &reader->lock );
+    }
+    
+    reader->position = position;
+    reader->next_fetch = position;
+    reader->end = position + length < reader->file_size ? position + length : reader->file_size;
+    reader->current = 0;
+    reader->handed = -1;
+    reader->state[0] = BUFFER_EMPTY;
+    reader->state[1] = BUFFER_EMPTY;
+    
+    ReaderQueue( reader, 0 );
+    ReaderQueue( reader, 1 );
+    
+    pthread_mutex_unlock( &reader->lock );
+    return 0;
+}
+
+
+//Hand out the next chunk of the file. *data stays valid until the following call.
+//Returns the chunk length, 0 at the end of the range, -1 on a read error.
+
+ssize_t ReaderNext( struct FileReader *reader, const char **data )
+{
+    pthread_mutex_lock( &reader->lock );
+    
+    if( reader->handed != -1 ) //Caller is done with the previous chunk, recycle its buffer
+    {
+        ReaderQueue( reader, reader->handed );
+        reader->handed = -1;
+    }
+    
+    int b = reader->current;
+    
+    if( reader->state[b] == BUFFER_QUEUED && !reader->thread_started )
+    {
+        ReaderFill( reader, b ); //No readahead thread, fetch in place
+    }
+    while( reader->state[b] == BUFFER_QUEUED || reader->state[b] == BUFFER_BUSY )
+    {
+        pthread_cond_wait( &reader->cond, &reader->lock );
+    }
+    
+    ssize_t n = 0;
+    if( reader->state[b] == BUFFER_ERROR )
+    {
+        n = -1;
+    }
+    else if( reader->state[b] == BUFFER_READY )
+    {
+        *data = reader->buffer[b];
+        n = reader->fill_length[b];
+        reader->position += n;
+        reader->handed = b;
+        reader->current = b ^ 1;
+    }
+    
+    pthread_mutex_unlock( &reader->lock );
+    return n;
+}
+
+
+//Hand out the image byte range holding the next chunk of the file instead of copying it,
+//for callers that move data with the kernel. Ranges never cross a discontiguity or the readahead
+//window. Must not be mixed with ReaderNext without a ReaderSeek in between.
+//Returns the range length, 0 at the end of the file.
+
+ssize_t ReaderNextRange( struct FileReader *reader, off_t *offset )
+{
+    struct Volume *volume = reader->volume;
+    const struct ClusterIndex *index = reader->index;
+    uint64_t logical = reader->position / volume->cluster_size;
+    uint64_t skip = reader->position % volume->cluster_size;
+    uint64_t limit = reader->end - reader->position < reader->window ?
+                            reader->end - reader->position : reader->window;
+    
+    if( reader->position >= reader->end || logical >= index->count )
+    {
+        return 0;
+    }
+    
+    uint64_t run = 1; //Contiguous clusters starting at logical
+    while( run * volume->cluster_size - skip < limit && logical + run < index->count &&
+            index->clusters[logical + run] == index->clusters[logical] + run )
+    {
+        run++;
+    }
+    
+    uint64_t length = run * volume->cluster_size - skip < limit ? run * volume->cluster_size - skip : limit;
+    
+    *offset = LBAToOffset( volume, index->clusters[logical] ) + skip;
+    reader->position += length;
+    return length;
+}
+
+
+//Stop the readahead thread, release the reader's buffers and unpin its cluster index
+
+void ReaderClose( struct FileReader *reader )
+{
+    if( reader->thread_started )
+    {
+        pthread_mutex_lock( &reader->lock );
+        reader->stop = 1;
+        pthread_cond_broadcast( &reader->cond );
+        pthread_mutex_unlock( &reader->lock );
+        pthread_join( reader->thread, NULL );
+    }
+    
+    pthread_mutex_destroy( &reader->lock );
+    pthread_cond_destroy( &reader->cond );
+    free( reader->buffer[0] );
+    free( reader->buffer[1] );
+    ClusterIndexRelease( reader->volume, reader->index );
+}
+
+
+//FNV-1a hash of a packed 11 byte name
+
+static uint32_t HashName( const char name[11] )
+{
+    uint32_t hash = 2166136261u;
+    int i = 0;
+    
+    for( i = 0; i < 11; i++ )
+    {
+        hash = ( hash ^ (unsigned char)name[i] ) * 16777619u;
+    }
+    return hash;
+}
+
+
+//Load every entry of the directory starting at cluster by following its cluster chain, stopping at
+//the end-of-directory marker, and build the name hash index. Physically contiguous clusters are
+//read in one go. Returns 0 on success, -1 on failure (directory is left empty).
+
+int LoadDirectory( struct Volume *volume, uint32_t cluster, struct Directory *directory )
+{
+    uint32_t per_cluster = volume->cluster_size / sizeof(struct DirectoryEntry); //Entries in one cluster
+    uint32_t capacity = 0;
+    uint32_t hops = 0;
+    int done = 0;
+    uint32_t i = 0;
+    
+    memset( directory, 0, sizeof(struct Directory) );
+    directory->cluster = cluster;
+    if( IndexDirectoryEntries( volume, directory ) == 0 ) //Served from the sidecar index, no chain to follow
+    {
+        done = 1;
+    }
+    
+    while( !done && !IsEndOfChain(volume,cluster) && hops < volume->fat_entries )
+    {
+        uint32_t run = 1; //Contiguous clusters starting at cluster
+        uint32_t next = NextLB( volume, cluster );
+        
+        while( next == cluster + run && hops + run < volume->fat_entries )
+        {
+            run++;
+            next = NextLB( volume, next );
+        }
+        
+        if( directory->count + run * per_cluster > capacity )
+        {
+            capacity = ( directory->count + run * per_cluster ) * 2;
+            struct DirectoryEntry *grown = realloc( directory->entries, (size_t)capacity * sizeof(struct DirectoryEntry) );
+            if( grown == NULL )
+            {
+                FreeDirectory( directory );
+                return -1;
+            }
+            directory->entries = grown;
+        }
+        
+        if( ImageRead( volume, &directory->entries[directory->count], (size_t)run * volume->cluster_size, LBAToOffset( volume, cluster ) ) == -1 )
+        {
+            FreeDirectory( directory );
+            return -1;
+        }
+        
+        for( i = directory->count; i < directory->count + run * per_cluster; i++ )
+        {
+            if( directory->entries[i].DIR_Name[0] == '\0' ) //No entries follow this one
+            {
+                done = 1;
+                break;
+            }
+        }
+        directory->count = i;
+        
+        cluster = next;
+        hops += run;
+    }
+    StatAdd( STAT_FAT_LOOKUPS, hops );
+    
+    //Index every live short name entry
+    
+    directory->bucket_count = 16;
+    while( directory->bucket_count < directory->count * 2 )
+    {
+        directory->bucket_count *= 2;
+    }
+    if( ( directory->buckets = calloc( directory->bucket_count, sizeof(uint32_t) ) ) == NULL )
+    {
+        FreeDirectory( directory );
+        return -1;
+    }
+    
+    for( i = 0; i < directory->count; i++ )
+    {
+        const struct DirectoryEntry *entry = &directory->entries[i];
+        
+        if( entry->DIR_Name[0] == '\xE5' || ( entry->DIR_Attr & ATTR_LONG_NAME ) == ATTR_LONG_NAME ||
+                ( entry->DIR_Attr & ATTR_VOLUME_ID ) )
+        {
+            continue;
+        }
+        
+        uint32_t bucket = HashName( entry->DIR_Name ) & ( directory->bucket_count - 1 );
+        while( directory->buckets[bucket] != 0 )
+        {
+            bucket = ( bucket + 1 ) & ( directory->bucket_count - 1 );
+        }
+        directory->buckets[bucket] = i + 1;
+    }
+    
+    return 0;
+}
+
+
+//Release the entries and index of a directory
+
+void FreeDirectory( struct Directory *directory )
+{
+    free( directory->entries );
+    free( directory->buckets );
+    memset( directory, 0, sizeof(struct Directory) );
+}
+
+
+//Convert an input file name or sub-directory name into the padded, upper case 11 byte format
+//used in directory entries. "." and ".." map to the dot entries.
+
+void PackName( const char *input, char packed[11] )
+{
+    int i = 0;
+    const char *dot = strchr( input, '.' );
+    
+    memset( packed, ' ', 11 );
+    
+    if( strcmp( input, "." ) == 0 || strcmp( input, ".." ) == 0 )
+    {
+        memcpy( packed, input, strlen( input ) );
+        return;
+    }
+    
+    size_t base_length = dot != NULL ? (size_t)( dot - input ) : strlen( input );
+    memcpy( packed, input, base_length < 8 ? base_length : 8 );
+    
+    if( dot != NULL )
+    {
+        size_t extension_length = strlen( dot + 1 );
+        memcpy( packed + 8, dot + 1, extension_length < 3 ? extension_length : 3 );
+    }
+    
+    for( i = 0; i < 11; i++ )
+    {
+        packed[i] = toupper( (unsigned char)packed[i] );
+    }
+}
+
+
+//Find a packed name in a directory's hash index. Returns the entry position or DIR_NOT_FOUND.
+
+int DirectoryLookup( const struct Directory *directory, const char packed[11] )
+{
+    if( directory->bucket_count == 0 )
+    {
+        return DIR_NOT_FOUND;
+    }
+    
+    uint32_t bucket = HashName( packed ) & ( directory->bucket_count - 1 );
+    while( directory->buckets[bucket] != 0 )
+    {
+        uint32_t position = directory->buckets[bucket] - 1;
+        
+        if( memcmp( directory->entries[position].DIR_Name, packed, 11 ) == 0 )
+        {
+            return position;
+        }
+        bucket = ( bucket + 1 ) & ( directory->bucket_count - 1 );
+    }
+    
+    return DIR_NOT_FOUND;
+}
+
+
+//Convert a packed 11 byte name back into the NAME.EXT form the user types
+
+void UnpackName( const char packed[11], char *name )
+{
+    int length = 8;
+    int i = 0;
+    
+    while( length > 0 && packed[length - 1] == ' ' )
+    {
+        length--;
+    }
+    memcpy( name, packed, length );
+    
+    int extension_length = 3;
+    while( extension_length > 0 && packed[8 + extension_length - 1] == ' ' )
+    {
+        extension_length--;
+    }
+    if( extension_length > 0 )
+    {
+        name[length++] = '.';
+        for( i = 0; i < extension_length; i++ )
+        {
+            name[length++] = packed[8 + i];
+        }
+    }
+    name[length] = '\0';
+}
+
+
+//Return 1 if a packed name can be used as one component of a host path: none of its bytes are
+//NUL, control characters or path separators, and it doesn't unpack to nothing, "." or "..".
+//Names are taken from the image as is, so anything written to the host goes through this first.
+
+int HostSafeName( const char packed[11] )
+{
+    char name[13];
+    int i = 0;
+    
+    for( i = 0; i < 11; i++ )
+    {
+        unsigned char c = packed[i];
+        
+        if( c < ' ' || c == 0x7F || c == '/' || c == '\\' )
+        {
+            return 0;
+        }
+    }
+    UnpackName( packed, name );
+    return name[0] != '\0' && strcmp( name, "." ) != 0 && strcmp( name, ".." ) != 0;
+}
+
+
+//Find or load the directory starting at cluster in the directory cache and pin it.
+//Returns NULL if the directory cannot be loaded.
+
+struct Directory * DirectoryAcquire( struct Volume *volume, uint32_t cluster )
+{
+    struct CachedDirectory *cached = NULL;
+    
+    pthread_mutex_lock( &volume->dentry_lock );
+    for( cached = volume->directory_cache_head; cached != NULL; cached = cached->next )
+    {
+        if( cached->directory.cluster == cluster )
+        {
+            break;
+        }
+    }
+    
+    if( cached != NULL ) //Hit, move to the front
+    {
+        if( cached != volume->directory_cache_head )
+        {
+            cached->prev->next = cached->next;
+            if( cached->next != NULL )
+            {
+                cached->next->prev = cached->prev;
+            }
+            else
+            {
+                volume->directory_cache_tail = cached->prev;
+            }
+            cached->prev = NULL;
+            cached->next = volume->directory_cache_head;
+            volume->directory_cache_head->prev = cached;
+            volume->directory_cache_head = cached;
+        }
+        cached->users++;
+        pthread_mutex_unlock( &volume->dentry_lock );
+        StatAdd( STAT_DIRECTORY_HITS, 1 );
+        return &cached->directory;
+    }
+    pthread_mutex_unlock( &volume->dentry_lock );
+    StatAdd( STAT_DIRECTORY_MISSES, 1 );
+    
+    //Miss, load outside the lock
+    
+    if( ( cached = calloc( 1, sizeof(struct CachedDirectory) ) ) == NULL )
+    {
+        return NULL;
+    }
+    if( LoadDirectory( volume, cluster, &cached->directory ) == -1 )
+    {
+        free( cached );
+        return NULL;
+    }
+    cached->users = 1;
+    
+    pthread_mutex_lock( &volume->dentry_lock );
+    cached->next = volume->directory_cache_head;
+    if( volume->directory_cache_head != NULL )
+    {
+        volume->directory_cache_head->prev = cached;
+    }
+    volume->directory_cache_head = cached;
+    if( volume->directory_cache_tail == NULL )
+    {
+        volume->directory_cache_tail = cached;
+    }
+    volume->directory_cache_count++;
+    volume->directory_cache_entries += cached->directory.count;
+    
+    //Evict unused directories from the cold end while over either limit
+    
+    struct CachedDirectory *victim = volume->directory_cache_tail;
+    while( victim != NULL && ( volume->directory_cache_count > DIRECTORY_CACHE_SIZE ||
+                                    volume->directory_cache_entries > DIRECTORY_CACHE_ENTRIES ) )
+    {
+        struct CachedDirectory *previous = victim->prev;
+        
+        if( victim->users == 0 )
+        {
+            if( previous != NULL )
+            {
+                previous->next = victim->next;
+            }
+            else
+            {
+                volume->directory_cache_head = victim->next;
+            }
+            if( victim->next != NULL )
+            {
+                victim->next->prev = previous;
+            }
+            else
+            {
+                volume->directory_cache_tail = previous;
+            }
+            volume->directory_cache_count--;
+            volume->directory_cache_entries -= victim->directory.count;
+            FreeDirectory( &victim->directory );
+            free( victim );
+        }
+        victim = previous;
+    }
+    pthread_mutex_unlock( &volume->dentry_lock );
+    
+    return &cached->directory;
+}
+
+
+//Unpin a directory returned by DirectoryAcquire
+
+void DirectoryRelease( struct Volume *volume, struct Directory *directory )
+{
+    struct CachedDirectory *cached = (struct CachedDirectory *)directory;
+    
+    if( cached == NULL )
+    {
+        return;
+    }
+    
+    pthread_mutex_lock( &volume->dentry_lock );
+    cached->users--;
+    int release = cached->stale && cached->users == 0;
+    pthread_mutex_unlock( &volume->dentry_lock );
+    
+    if( release )
+    {
+        FreeDirectory( &cached->directory );
+        free( cached );
+    }
+}
+
+
+//Drop every cached directory and path. Pinned directories are freed on release.
+
+void DentryCacheFlush( struct Volume *volume )
+{
+    int i = 0;
+    
+    pthread_mutex_lock( &volume->dentry_lock );
+    while( volume->directory_cache_head != NULL )
+    {
+        struct CachedDirectory *cached = volume->directory_cache_head;
+        
+        volume->directory_cache_head = cached->next;
+        if( cached->users > 0 )
+        {
+            cached->stale = 1;
+        }
+        else
+        {
+            FreeDirectory( &cached->directory );
+            free( cached );
+        }
+    }
+    volume->directory_cache_tail = NULL;
+    volume->directory_cache_count = 0;
+    volume->directory_cache_entries = 0;
+    
+    while( volume->path_cache_head != NULL )
+    {
+        struct CachedPath *cached = volume->path_cache_head;
+        
+        volume->path_cache_head = cached->next;
+        free( cached->path );
+        free( cached );
+    }
+    volume->path_cache_tail = NULL;
+    volume->path_cache_count = 0;
+    for( i = 0; i < PATH_CACHE_BUCKETS; i++ )
+    {
+        volume->path_cache_buckets[i] = NULL;
+    }
+    pthread_mutex_unlock( &volume->dentry_lock );
+}
+
+
+//FNV-1a hash of a normalized path
+
+uint32_t HashPath( const char *path )
+{
+    uint32_t hash = 2166136261u;
+    
+    while( *path != '\0' )
+    {
+        hash = ( hash ^ (unsigned char)*path++ ) * 16777619u;
+    }
+    return hash;
+}
+
+
+//Look up a normalized path in the path cache. Returns 0 and fills entry on a hit, -1 on a miss.
+
+static int PathCacheLookup( struct Volume *volume, const char *path, struct DirectoryEntry *entry )
+{
+    uint32_t hash = HashPath( path );
+    struct CachedPath *cached = NULL;
+    
+    pthread_mutex_lock( &volume->dentry_lock );
+    for( cached = volume->path_cache_buckets[hash & ( PATH_CACHE_BUCKETS - 1 )]; cached != NULL; cached = cached->hash_next )
+    {
+        if( cached->hash == hash && strcmp( cached->path, path ) == 0 )
+        {
+            break;
+        }
+    }
+    
+    if( cached != NULL )
+    {
+        *entry = cached->entry;
+        if( cached != volume->path_cache_head ) //Move to the front
+        {
+            cached->prev->next = cached->next;
+            if( cached->next != NULL )
+            {
+                cached->next->prev = cached->prev;
+            }
+            else
+            {
+                volume->path_cache_tail = cached->prev;
+            }
+            cached->prev = NULL;
+            cached->next = volume->path_cache_head;
+            volume->path_cache_head->prev = cached;
+            volume->path_cache_head = cached;
+        }
+    }
+    pthread_mutex_unlock( &volume->dentry_lock );
+    
+    StatAdd( cached != NULL ? STAT_PATH_HITS : STAT_PATH_MISSES, 1 );
+    return cached != NULL ? 0 : -1;
+}
+
+
+//Remember what a normalized path resolves to, evicting the least recently used path when full
+
+static void PathCacheInsert( struct Volume *volume, const char *path, const struct DirectoryEntry *entry )
+{
+    struct CachedPath *cached = calloc( 1, sizeof(struct CachedPath) );
+    
+    if( cached == NULL || ( cached->path = strdup( path ) ) == NULL )
+    {
+        free( cached );
+        return;
+    }
+    cached->hash = HashPath( path );
+    cached->entry = *entry;
+    
+    pthread_mutex_lock( &volume->dentry_lock );
+    
+    struct CachedPath **bucket = &volume->path_cache_buckets[cached->hash & ( PATH_CACHE_BUCKETS - 1 )];
+    struct CachedPath *existing = NULL;
+    for( existing = *bucket; existing != NULL; existing = existing->hash_next )
+    {
+        if( existing->hash == cached->hash && strcmp( existing->path, path ) == 0 )
+        {
+            break;
+        }
+    }
+    if( existing != NULL ) //Another thread got there first
+    {
+        pthread_mutex_unlock( &volume->dentry_lock );
+        free( cached->path );
+        free( cached );
+        return;
+    }
+    
+    cached->hash_next = *bucket;
+    *bucket = cached;
+    cached->next = volume->path_cache_head;
+    if( volume->path_cache_head != NULL )
+    {
+        volume->path_cache_head->prev = cached;
+    }
+    volume->path_cache_head = cached;
+    if( volume->path_cache_tail == NULL )
+    {
+        volume->path_cache_tail = cached;
+    }
+    volume->path_cache_count++;
+    
+    if( volume->path_cache_count > PATH_CACHE_SIZE )
+    {
+        struct CachedPath *victim = volume->path_cache_tail;
+        struct CachedPath **link = &volume->path_cache_buckets[victim->hash & ( PATH_CACHE_BUCKETS - 1 )];
+        
+        while( *link != victim )
+        {
+            link = &(*link)->hash_next;
+        }
+        *link = victim->hash_next;
+        
+        volume->path_cache_tail = victim->prev;
+        volume->path_cache_tail->next = NULL;
+        volume->path_cache_count--;
+        free( victim->path );
+        free( victim );
+    }
+    
+    pthread_mutex_unlock( &volume->dentry_lock );
+}
+
+
+//Turn an absolute or relative (to cwd) path into a normalized absolute path:
+//"." and ".." components are applied and every name is rewritten in packed-then-unpacked
+//NAME.EXT form so different spellings share one cache key. Returns 0 on success, -1 if too long.
+
+int NormalizePath( const char *cwd, const char *path, char *normalized )
+{
+    size_t length = 0;
+    const char *component = path;
+    
+    if( path[0] == '/' )
+    {
+        normalized[0] = '\0';
+    }
+    else
+    {
+        strcpy( normalized, strcmp( cwd, "/" ) == 0 ? "" : cwd );
+    }
+    length = strlen( normalized );
+    
+    while( *component != '\0' )
+    {
+        const char *end = strchr( component, '/' );
+        size_t component_length = end != NULL ? (size_t)( end - component ) : strlen( component );
+        
+        if( component_length == 0 || ( component_length == 1 && component[0] == '.' ) )
+        {
+            //Empty or current directory component, nothing to do
+        }
+        else if( component_length == 2 && component[0] == '.' && component[1] == '.' )
+        {
+            while( length > 0 && normalized[length - 1] != '/' )
+            {
+                length--;
+            }
+            if( length > 0 )
+            {
+                length--; //Drop the separator too
+            }
+            normalized[length] = '\0';
+        }
+        else
+        {
+            char raw[MAX_NAME_LENGTH + 1];
+            char packed[11];
+            char name[13];
+            
+            if( component_length >= sizeof(raw) )
+            {
+                return -1;
+            }
+            memcpy( raw, component, component_length );
+            raw[component_length] = '\0';
+            PackName( raw, packed );
+            UnpackName( packed, name );
+            
+            if( length + 1 + strlen( name ) + 1 > MAX_PATH_LENGTH )
+            {
+                return -1;
+            }
+            normalized[length++] = '/';
+            strcpy( &normalized[length], name );
+            length += strlen( name );
+        }
+        
+        component += component_length;
+        if( *component == '/' )
+        {
+            component++;
+        }
+    }
+    
+    if( length == 0 )
+    {
+        strcpy( normalized, "/" );
+    }
+    return 0;
+}
+
+
+//Resolve a path, relative to cwd unless absolute, to its directory entry. The deepest cached ancestor is found in the path cache and
+//the remaining components are looked up through the directory cache, caching every prefix on the way.
+//The root directory resolves to a synthesized directory entry. Returns 0 on success, -1 if not found.
+
+int ResolvePath( struct Volume *volume, const char *cwd, const char *path, struct DirectoryEntry *entry )
+{
+    char normalized[MAX_PATH_LENGTH];
+    size_t resolved = 0; //Length of the prefix of normalized already resolved
+    
+    if( NormalizePath( cwd, path, normalized ) == -1 )
+    {
+        return -1;
+    }
+    
+    memset( entry, 0, sizeof(struct DirectoryEntry) );
+    memset( entry->DIR_Name, ' ', 11 );
+    entry->DIR_Attr = ATTR_DIRECTORY;
+    entry->DIR_FirstClusterHigh = volume->BPB_RootClus >> 16;
+    entry->DIR_FirstClusterLow = volume->BPB_RootClus & 0xFFFF;
+    
+    if( strcmp( normalized, "/" ) == 0 )
+    {
+        return 0;
+    }
+    if( PathCacheLookup( volume, normalized, entry ) == 0 )
+    {
+        return 0;
+    }
+    
+    //Find the deepest ancestor already in the path cache
+    
+    resolved = strlen( normalized );
+    while( resolved > 0 )
+    {
+        while( resolved > 0 && normalized[resolved] != '/' )
+        {
+            resolved--;
+        }
+        if( resolved == 0 )
+        {
+            break;
+        }
+        
+        normalized[resolved] = '\0';
+        int hit = PathCacheLookup( volume, normalized, entry ) == 0;
+        normalized[resolved] = '/';
+        if( hit )
+        {
+            break;
+        }
+        resolved--;
+    }
+    
+    //Walk the remaining components one directory at a time
+    
+    while( normalized[resolved] == '/' )
+    {
+        char *name = &normalized[resolved + 1];
+        char *end = strchr( name, '/' );
+        char packed[11];
+        
+        if( !( entry->DIR_Attr & ATTR_DIRECTORY ) ) //A file in the middle of the path
+        {
+            return -1;
+        }
+        
+        struct Directory *directory = DirectoryAcquire( volume, DirectoryCluster( volume, entry ) );
+        if( directory == NULL )
+        {
+            return -1;
+        }
+        
+        if( end != NULL )
+        {
+            *end = '\0';
+        }
+        PackName( name, packed );
+        int position = DirectoryLookup( directory, packed );
+        if( position != DIR_NOT_FOUND )
+        {
+            *entry = directory->entries[position];
+        }
+        DirectoryRelease( volume, directory );
+        
+        if( position == DIR_NOT_FOUND )
+        {
+            return -1;
+        }
+        
+        PathCacheInsert( volume, normalized, entry );
+        
+        if( end == NULL )
+        {
+            break;
+        }
+        *end = '/';
+        resolved = end - normalized;
+    }
+    
+    return 0;
+}
+
+
+//First cluster of the directory an entry refers to; ".." entries use 0 for the root directory
+
+uint32_t DirectoryCluster( struct Volume *volume, const struct DirectoryEntry *entry )
+{
+    uint32_t cluster = FirstCluster( entry );
+    
+    return cluster == 0 ? volume->BPB_RootClus : cluster;
+}
+
+
+//Number of tree walker threads: one per online CPU, at most MAX_WALK_THREADS
+
+int WalkThreadCount( void )
+{
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    
+    if( cpus < 1 )
+    {
+        return 1;
+    }
+    return cpus > MAX_WALK_THREADS ? MAX_WALK_THREADS : (int)cpus;
+}
+
+
+//Queue a directory on a worker's deque. Returns 0 on success, -1 on allocation failure.
+
+static int WalkPush( struct Walker *walker, int thread, const struct WalkItem *item )
+{
+    struct WalkDeque *deque = &walker->deques[thread];
+    
+    pthread_mutex_lock( &walker->lock );
+    walker->pending++;
+    pthread_mutex_unlock( &walker->lock );
+    
+    pthread_mutex_lock( &deque->lock );
+    if( deque->head > 0 && deque->tail == deque->capacity ) //Reuse the space in front of the head
+    {
+        memmove( deque->items, &deque->items[deque->head], ( deque->tail - deque->head ) * sizeof(struct WalkItem) );
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    if( deque->tail == deque->capacity )
+    {
+        int capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+        struct WalkItem *grown = realloc( deque->items, capacity * sizeof(struct WalkItem) );
+        if( grown == NULL )
+        {
+            pthread_mutex_unlock( &deque->lock );
+            pthread_mutex_lock( &walker->lock );
+            walker->pending--;
+            pthread_mutex_unlock( &walker->lock );
+            return -1;
+        }
+        deque->items = grown;
+        deque->capacity = capacity;
+    }
+    deque->items[deque->tail++] = *item;
+    pthread_mutex_unlock( &deque->lock );
+    
+    pthread_mutex_lock( &walker->lock );
+    if( walker->idle > 0 )
+    {
+        pthread_cond_signal( &walker->work );
+    }
+    pthread_mutex_unlock( &walker->lock );
+    return 0;
+}
+
+
+//Take work for thread: newest item from its own deque, otherwise the oldest item of another
+//worker's deque. Returns 1 if an item was taken.
+
+static int WalkTake( struct Walker *walker, int thread, struct WalkItem *item )
+{
+    int i = 0;
+    
+    for( i = 0; i < walker->thread_count; i++ )
+    {
+        int victim = ( thread + i ) % walker->thread_count;
+        struct WalkDeque *deque = &walker->deques[victim];
+        int taken = 0;
+        
+        pthread_mutex_lock( &deque->lock );
+        if( deque->head < deque->tail )
+        {
+            *item = victim == thread ? deque->items[--deque->tail] : deque->items[deque->head++];
+            taken = 1;
+        }
+        pthread_mutex_unlock( &deque->lock );
+        
+        if( taken )
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+//Load one directory, visit its entries and queue its sub-directories
+
+static void WalkDirectory( struct Walker *walker, int thread, struct WalkItem *item )
+{
+    struct Directory directory;
+    uint32_t i = 0;
+    size_t path_length = strlen( item->path );
+    
+    if( LoadDirectory( walker->volume, item->cluster, &directory ) == -1 )
+    {
+        atomic_fetch_add( &walker->errors, 1 );
+        return;
+    }
+    
+    for( i = 0; i < directory.count; i++ )
+    {
+        const struct DirectoryEntry *entry = &directory.entries[i];
+        char name[13];
+        
+        if( entry->DIR_Name[0] == '\xE5' || entry->DIR_Name[0] == '.' ||
+                ( entry->DIR_Attr & ATTR_LONG_NAME ) == ATTR_LONG_NAME || ( entry->DIR_Attr & ATTR_VOLUME_ID ) )
+        {
+            continue;
+        }
+        
+        UnpackName( entry->DIR_Name, name );
+        char *path = malloc( path_length + strlen( name ) + 2 );
+        if( path == NULL )
+        {
+            atomic_fetch_add( &walker->errors, 1 );
+            continue;
+        }
+        sprintf( path, "%s/%s", path_length == 1 ? "" : item->path, name );
+        
+        void *user = walker->visit( walker, thread, item->user, path, entry );
+        
+        uint32_t cluster = FirstCluster( entry );
+        if( ( entry->DIR_Attr & ATTR_DIRECTORY ) && !IsEndOfChain( walker->volume, cluster ) &&
+                !( atomic_fetch_or( &walker->visited[cluster / 64], 1ULL << ( cluster % 64 ) ) & ( 1ULL << ( cluster % 64 ) ) ) )
+        {
+            struct WalkItem child = { cluster, path, user };
+            
+            if( WalkPush( walker, thread, &child ) == 0 )
+            {
+                continue; //The path now belongs to the queued item
+            }
+            atomic_fetch_add( &walker->errors, 1 );
+        }
+        free( path );
+    }
+    
+    FreeDirectory( &directory );
+}
+
+
+struct WalkThread
+{
+    struct Walker *walker;
+    int index;
+};
+
+
+//Tree walker worker: process local work, steal when out of it, sleep when nothing is queued anywhere
+
+static void * WalkWorker( void *arg )
+{
+    struct WalkThread *self = arg;
+    struct Walker *walker = self->walker;
+    struct WalkItem item;
+    
+    while( 1 )
+    {
+        if( WalkTake( walker, self->index, &item ) )
+        {
+            WalkDirectory( walker, self->index, &item );
+            free( item.path );
+            
+            pthread_mutex_lock( &walker->lock );
+            if( --walker->pending == 0 )
+            {
+                pthread_cond_broadcast( &walker->work );
+            }
+            pthread_mutex_unlock( &walker->lock );
+            continue;
+        }
+        
+        pthread_mutex_lock( &walker->lock );
+        if( walker->pending == 0 )
+        {
+            pthread_mutex_unlock( &walker->lock );
+            break;
+        }
+        
+        //Re-check under the walker lock: pushes signal under it after queueing, so no wakeup is lost
+        int queued = 0;
+        int i = 0;
+        for( i = 0; i < walker->thread_count && !queued; i++ )
+        {
+            pthread_mutex_lock( &walker->deques[i].lock );
+            queued = walker->deques[i].head < walker->deques[i].tail;
+            pthread_mutex_unlock( &walker->deques[i].lock );
+        }
+        if( !queued )
+        {
+            walker->idle++;
+            pthread_cond_wait( &walker->work, &walker->lock );
+            walker->idle--;
+        }
+        pthread_mutex_unlock( &walker->lock );
+    }
+    
+    return NULL;
+}
+
+
+//Walk the tree below the directory starting at cluster (whose absolute path is path) on
+//WalkThreadCount() threads, calling visit for every entry. user is the parent value passed
+//for the start directory's entries. Returns the number of directories that could not be
+//loaded, or -1 if the walk could not be started.
+
+int WalkTree( struct Volume *volume, uint32_t cluster, const char *path, void *user, WalkVisit visit, void *context )
+{
+    struct Walker *walker = calloc( 1, sizeof(struct Walker) );
+    struct WalkThread threads[MAX_WALK_THREADS];
+    pthread_t ids[MAX_WALK_THREADS];
+    int i = 0;
+    
+    if( walker == NULL )
+    {
+        return -1;
+    }
+    walker->visited = calloc( volume->fat_entries / 64 + 1, sizeof(uint64_t) );
+    if( walker->visited == NULL || IsEndOfChain( volume, cluster ) )
+    {
+        free( walker->visited );
+        free( walker );
+        return -1;
+    }
+    
+    walker->volume = volume;
+    walker->thread_count = WalkThreadCount();
+    walker->visit = visit;
+    walker->context = context;
+    pthread_mutex_init( &walker->lock, NULL );
+    pthread_cond_init( &walker->work, NULL );
+    for( i = 0; i < walker->thread_count; i++ )
+    {
+        pthread_mutex_init( &walker->deques[i].lock, NULL );
+    }
+    
+    struct WalkItem start = { cluster, strdup( path ), user };
+    walker->visited[cluster / 64] |= 1ULL << ( cluster % 64 );
+    if( start.path == NULL || WalkPush( walker, 0, &start ) == -1 )
+    {
+        free( start.path );
+        atomic_fetch_add( &walker->errors, 1 );
+    }
+    
+    int started = 0;
+    for( i = 0; i < walker->thread_count; i++ )
+    {
+        threads[i].walker = walker;
+        threads[i].index = i;
+        if( i > 0 && pthread_create( &ids[i], NULL, WalkWorker, &threads[i] ) != 0 )
+        {
+            break;
+        }
+        started++;
+    }
+    WalkWorker( &threads[0] ); //The calling thread is worker 0
+    for( i = 1; i < started; i++ )
+    {
+        pthread_join( ids[i], NULL );
+    }
+    
+    int errors = atomic_load( &walker->errors );
+    for( i = 0; i < walker->thread_count; i++ )
+    {
+        free( walker->deques[i].items );
+        pthread_mutex_destroy( &walker->deques[i].lock );
+    }
+    pthread_mutex_destroy( &walker->lock );
+    pthread_cond_destroy( &walker->work );
+    free( walker->visited );
+    free( walker );
+    return errors;
+}
+
+
+//Return 1 if name is a valid 8.3 short name: 1 to 8 characters, optionally a dot and 1 to 3 more,
+//none of them spaces, control characters or characters FAT reserves
+
+int ValidShortName( const char *name )
+{
+    const char *dot = strchr( name, '.' );
+    size_t base_length = dot != NULL ? (size_t)( dot - name ) : strlen( name );
+    size_t extension_length = dot != NULL ? strlen( dot + 1 ) : 0;
+    
+    if( base_length == 0 || base_length > 8 || extension_length > 3 || ( dot != NULL && extension_length == 0 ) ||
+            ( dot != NULL && strchr( dot + 1, '.' ) != NULL ) || (unsigned char)name[0] == 0xE5 )
+    {
+        return 0;
+    }
+    for( ; *name != '\0'; name++ )
+    {
+        if( (unsigned char)*name <= ' ' || ( *name != '.' && strchr( "\"*+,/:;<=>?[\\]|", *name ) != NULL ) )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+//Image offset of directory entry position in the directory starting at cluster,
+//or -1 if the directory's chain is shorter than that
+
+off_t DirectorySlotOffset( struct Volume *volume, uint32_t cluster, uint32_t position )
+{
+    uint32_t per_cluster = volume->cluster_size / sizeof(struct DirectoryEntry);
+    uint32_t hops = position / per_cluster;
+    
+    while( hops > 0 && !IsEndOfChain( volume, cluster ) )
+    {
+        cluster = NextLB( volume, cluster );
+        hops--;
+    }
+    if( IsEndOfChain( volume, cluster ) )
+    {
+        return -1;
+    }
+    return LBAToOffset( volume, cluster ) + (off_t)( position % per_cluster ) * sizeof(struct DirectoryEntry);
+}
+
+
+//Check the BPB fields the layout is computed from: a sector of 512 to 4096 bytes and a cluster
+//of a power of two sectors, at least one FAT of nonzero size, reserved sectors and FATs that fit in
+//the image (FATLoad allocates the FAT before reading it), and a root directory cluster the volume has.
+//The cluster count follows ClusterCount, which can't be used before the FAT is loaded.
+
+static int BPBValid( const struct Volume *volume )
+{
+    if( volume->BPB_BytsPerSec < 512 || volume->BPB_BytsPerSec > 4096 ||
+            ( volume->BPB_BytsPerSec & ( volume->BPB_BytsPerSec - 1 ) ) != 0 ||
+            volume->BPB_SecPerClus == 0 || ( volume->BPB_SecPerClus & ( volume->BPB_SecPerClus - 1 ) ) != 0 ||
+            volume->BPB_NumFATs < 1 || volume->BPB_FATSz32 == 0 )
+    {
+        return 0;
+    }
+    
+    uint64_t total_sectors = volume->BPB_TotSec16 != 0 ? volume->BPB_TotSec16 : volume->BPB_TotSec32;
+    uint64_t system_sectors = (uint64_t)volume->BPB_RsvdSecCnt + (uint64_t)volume->BPB_NumFATs * volume->BPB_FATSz32;
+    uint64_t clusters = (uint64_t)volume->BPB_FATSz32 * volume->BPB_BytsPerSec / 4 - 2;
+    
+    if( system_sectors * volume->BPB_BytsPerSec > (uint64_t)volume->image_size )
+    {
+        return 0;
+    }
+    if( total_sectors > system_sectors && ( total_sectors - system_sectors ) / volume->BPB_SecPerClus < clusters )
+    {
+        clusters = ( total_sectors - system_sectors ) / volume->BPB_SecPerClus;
+    }
+    return volume->BPB_RootClus >= 2 && volume->BPB_RootClus < clusters + 2;
+}
+
+
+//Open the file system image at path, read its BPB, size the block cache to cache_bytes (0 disables
+//it) and load the first FAT. The image is mapped unless use_mmap is 0. Returns NULL if the image
+//cannot be opened or its BPB is not usable; if the FAT cannot be loaded the volume is returned with fat_table NULL.
+//A current sidecar index (IndexBuild) is mapped, a stale one is deleted.
+
+struct Volume * VolumeOpen( const char *path, int use_mmap, size_t cache_bytes )
+{
+    struct Volume *volume = calloc( 1, sizeof(struct Volume) );
+    unsigned char boot_sector[64] = { 0 }; //Leading bytes of the boot sector holding the BPB
+    
+    if( volume == NULL )
+    {
+        return NULL;
+    }
+    volume->image_fd = -1;
+    volume->readahead_window = DEFAULT_READAHEAD;
+    pthread_mutex_init( &volume->cluster_index_lock, NULL );
+    pthread_mutex_init( &volume->dentry_lock, NULL );
+    pthread_mutex_init( &volume->block_cache.lock, NULL );
+    
+    if( ( volume->index_path = malloc( strlen( path ) + sizeof(INDEX_SUFFIX) ) ) == NULL ||
+            ImageOpen( volume, path, use_mmap ) == -1 )
+    {
+        VolumeClose( volume );
+        return NULL;
+    }
+    sprintf( volume->index_path, "%s%s", path, INDEX_SUFFIX );
+    if( ImageRead( volume, boot_sector, sizeof(boot_sector), 0 ) == -1 )
+    {
+        VolumeClose( volume );
+        return NULL;
+    }
+    
+    memcpy( &volume->BPB_BytsPerSec, &boot_sector[11], 2 ); //Bytes in one sector
+    memcpy( &volume->BPB_SecPerClus, &boot_sector[13], 1 ); //Sectors in one allocation unit
+    memcpy( &volume->BPB_RsvdSecCnt, &boot_sector[14], 2 ); //Sectors in the reserved region
+    memcpy( &volume->BPB_NumFATs, &boot_sector[16], 1 ); //Count of FAT data structures
+    memcpy( &volume->BPB_RootEntCnt, &boot_sector[17], 2 ); //Root directory entries of FAT 12 and 16 volumes, 0 for FAT 32
+    memcpy( &volume->BPB_FATSz32, &boot_sector[36], 4 ); //Sectors occupied by ONE FAT
+    memcpy( &volume->BPB_RootClus, &boot_sector[44], 4 ); //First cluster of the root directory
+    memcpy( &volume->BPB_TotSec16, &boot_sector[19], 2 ); //16 bit count of sectors, 0 when BPB_TotSec32 holds it
+    memcpy( &volume->BPB_TotSec32, &boot_sector[32], 4 ); //32 bit count of sectors on the volume
+    memcpy( &volume->BPB_FSInfo, &boot_sector[48], 2 ); //Sector of the FSInfo structure in the reserved area
+    
+    if( !BPBValid( volume ) ) //Not a FAT32 volume, or one whose geometry every offset computation would trip over
+    {
+        VolumeClose( volume );
+        return NULL;
+    }
+    volume->cluster_size = volume->BPB_BytsPerSec * volume->BPB_SecPerClus; //Every data path works in whole clusters
+    
+    //Cache blocks are clusters, aligned on the start of the data region
+    BlockCacheConfigure( volume, volume->cluster_size, LBAToOffset( volume, 2 ), cache_bytes );
+    FATLoad( volume ); //Every chain walk is served from the cached FAT
+    IndexOpen( volume ); //Directories and extents come from the sidecar index while it is current
+    return volume;
+}
+
+
+//Drop every cache built from a volume, close its image and free it. Nothing may still be using it:
+//directories, cluster indexes, readers and open files all have to be released first.
+
+void VolumeClose( struct Volume *volume )
+{
+    if( volume == NULL )
+    {
+        return;
+    }
+    
+    ClusterIndexFlush( volume );
+    DentryCacheFlush( volume );
+    IndexClose( volume );
+    free( volume->index_path );
+    FATFree( volume );
+    BlockCacheConfigure( volume, 0, 0, 0 );
+    ImageClose( volume );
+    free( volume->image_path );
+    pthread_mutex_destroy( &volume->cluster_index_lock );
+    pthread_mutex_destroy( &volume->dentry_lock );
+    pthread_mutex_destroy( &volume->block_cache.lock );
+    free( volume );
+}
+
+
+//Look up the directory entry of an absolute path (the root resolves to a synthesized entry).
+//Returns 0 on success, -1 if not found.
+
+int VolumeStat( struct Volume *volume, const char *path, struct DirectoryEntry *entry )
+{
+    return ResolvePath( volume, "/", path, entry );
+}
+
+
+//A directory stream opened by VolumeOpenDir
+
+struct VolumeDir
+{
+    struct Volume *volume;
+    struct Directory *directory; //Pinned in the directory cache until the stream is closed
+    uint32_t position; //Next entry VolumeReadDir looks at
+};
+
+
+//Open the directory at an absolute path for VolumeReadDir. Returns NULL if the path is not a directory.
+
+struct VolumeDir * VolumeOpenDir( struct Volume *volume, const char *path )
+{
+    struct DirectoryEntry entry;
+    struct VolumeDir *dir = NULL;
+    
+    if( VolumeStat( volume, path, &entry ) == -1 || !( entry.DIR_Attr & ATTR_DIRECTORY ) )
+    {
+        return NULL;
+    }
+    if( ( dir = calloc( 1, sizeof(struct VolumeDir) ) ) == NULL )
+    {
+        return NULL;
+    }
+    
+    dir->volume = volume;
+    dir->directory = DirectoryAcquire( volume, DirectoryCluster( volume, &entry ) );
+    if( dir->directory == NULL )
+    {
+        free( dir );
+        return NULL;
+    }
+    return dir;
+}
+
+
+//Hand out the next live entry of a directory stream with its NAME.EXT name; deleted entries,
+//long file name fragments and the volume label are skipped. Returns 1 for an entry, 0 at the end.
+
+int VolumeReadDir( struct VolumeDir *dir, char name[13], struct DirectoryEntry *entry )
+{
+    while( dir->position < dir->directory->count )
+    {
+        const struct DirectoryEntry *next = &dir->directory->entries[dir->position++];
+        
+        if( next->DIR_Name[0] == '\xE5' || ( next->DIR_Attr & ATTR_LONG_NAME ) == ATTR_LONG_NAME ||
+                ( next->DIR_Attr & ATTR_VOLUME_ID ) )
+        {
+            continue;
+        }
+        UnpackName( next->DIR_Name, name );
+        *entry = *next;
+        return 1;
+    }
+    return 0;
+}
+
+
+//Close a directory stream and unpin its directory
+
+void VolumeCloseDir( struct VolumeDir *dir )
+{
+    if( dir != NULL )
+    {
+        DirectoryRelease( dir->volume, dir->directory );
+        free( dir );
+    }
+}
+
+
+//A file found by IndexBuild and the extents of its chain
+
+struct IndexExtents
+{
+    uint32_t first_cluster;
+    int count;
+    struct Extent *extents;
+};
+
+//Directories and files found by one IndexBuild walker thread
+
+struct IndexList
+{
+    struct Directory *directories; //Loaded in full, sorted by cluster once merged
+    size_t directory_count;
+    size_t directory_capacity;
+    struct IndexExtents *files; //Sorted by first cluster once merged
+    size_t file_count;
+    size_t file_capacity;
+};
+
+struct IndexContext
+{
+    struct IndexList lists[MAX_WALK_THREADS]; //Per walker thread
+    atomic_int errors;
+};
+
+
+static int IndexAddDirectory( struct Volume *volume, struct IndexList *list, uint32_t cluster )
+{
+    if( list->directory_count == list->directory_capacity )
+    {
+        size_t capacity = list->directory_capacity > 0 ? list->directory_capacity * 2 : 64;
+        struct Directory *grown = realloc( list->directories, capacity * sizeof(struct Directory) );
+        
+        if( grown == NULL )
+        {
+            return -1;
+        }
+        list->directories = grown;
+        list->directory_capacity = capacity;
+    }
+    
+    if( LoadDirectory( volume, cluster, &list->directories[list->directory_count] ) == -1 )
+    {
+        return -1;
+    }
+    list->directory_count++;
+    return 0;
+}
+
+
+static int IndexAddFile( struct Volume *volume, struct IndexList *list, uint32_t first_cluster )
+{
+    if( list->file_count == list->file_capacity )
+    {
+        size_t capacity = list->file_capacity > 0 ? list->file_capacity * 2 : 256;
+        struct IndexExtents *grown = realloc( list->files, capacity * sizeof(struct IndexExtents) );
+        
+        if( grown == NULL )
+        {
+            return -1;
+        }
+        list->files = grown;
+        list->file_capacity = capacity;
+    }
+    
+    struct IndexExtents *file = &list->files[list->file_count];
+    file->first_cluster = first_cluster;
+    if( ( file->count = BuildExtents( volume, first_cluster, &file->extents ) ) == -1 )
+    {
+        return -1;
+    }
+    list->file_count++;
+    return 0;
+}
+
+
+static void * IndexVisit( struct Walker *walker, int thread, void *parent, const char *path,
+                            const struct DirectoryEntry *entry )
+{
+    struct IndexContext *context = walker->context;
+    uint32_t cluster = FirstCluster( entry );
+    int status = 0;
+    
+    (void)parent;
+    (void)path;
+    if( IsEndOfChain( walker->volume, cluster ) )
+    {
+        return NULL; //Empty file, nothing to index
+    }
+    
+    if( entry->DIR_Attr & ATTR_DIRECTORY )
+    {
+        status = IndexAddDirectory( walker->volume, &context->lists[thread], cluster );
+    }
+    else
+    {
+        status = IndexAddFile( walker->volume, &context->lists[thread], cluster );
+    }
+    if( status == -1 )
+    {
+        atomic_fetch_add( &context->errors, 1 );
+    }
+    return NULL;
+}
+
+static int CompareIndexDirectories( const void *a, const void *b )
+{
+    return CompareIndexKeys( &( (const struct Directory *)a )->cluster, &( (const struct Directory *)b )->cluster );
+}
+
+static int CompareIndexFiles( const void *a, const void *b )
+{
+    return CompareIndexKeys( &( (const struct IndexExtents *)a )->first_cluster,
+                                &( (const struct IndexExtents *)b )->first_cluster );
+}
+
+
+//Write the sidecar index for the merged and sorted directories and files of list to path.
+//Returns 0 on success, -1 on failure.
+
+static int IndexWrite( struct Volume *volume, const struct IndexList *list, const struct ClusterUsage *usage,
+                        const char *path )
+{
+    struct IndexHeader header;
+    struct stat image_stat;
+    FILE *out = NULL;
+    size_t i = 0;
+    
+    //put and defrag change the image after it was opened: stamp its current modification time,
+    //which is also what IndexOpen checks the new index against
+    if( fstat( volume->image_fd, &image_stat ) == -1 || ( out = fopen( path, "w" ) ) == NULL )
+    {
+        return -1;
+    }
+    volume->image_mtime = image_stat.st_mtim;
+    
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, INDEX_MAGIC, sizeof(header.magic) );
+    header.version = INDEX_VERSION;
+    header.cluster_size = volume->cluster_size;
+    header.image_size = volume->image_size;
+    header.mtime_sec = volume->image_mtime.tv_sec;
+    header.mtime_nsec = volume->image_mtime.tv_nsec;
+    header.fat_crc = Crc32c( 0, volume->fat_table, (size_t)volume->fat_entries * 4 );
+    header.directory_count = list->directory_count;
+    header.file_count = list->file_count;
+    header.free_count = volume->free_space.count;
+    header.usage = *usage;
+    
+    //Tables first, then the directory entries and extents they point to. Every record is a
+    //multiple of 8 bytes, so every offset stays aligned.
+    
+    uint64_t offset = sizeof(struct IndexHeader);
+    header.directories = offset;
+    offset += list->directory_count * sizeof(struct IndexDirectory);
+    header.files = offset;
+    offset += list->file_count * sizeof(struct IndexFile);
+    header.free_runs = offset;
+    offset += (uint64_t)volume->free_space.count * sizeof(struct Extent);
+    
+    fwrite( &header, sizeof(header), 1, out );
+    for( i = 0; i < list->directory_count; i++ )
+    {
+        struct IndexDirectory record = { list->directories[i].cluster, list->directories[i].count, offset };
+        
+        fwrite( &record, sizeof(record), 1, out );
+        offset += (uint64_t)record.count * sizeof(struct DirectoryEntry);
+    }
+    for( i = 0; i < list->file_count; i++ )
+    {
+        struct IndexFile record = { list->files[i].first_cluster, list->files[i].count, offset };
+        
+        fwrite( &record, sizeof(record), 1, out );
+        offset += (uint64_t)record.extent_count * sizeof(struct Extent);
+    }
+    fwrite( volume->free_space.runs, sizeof(struct Extent), volume->free_space.count, out );
+    for( i = 0; i < list->directory_count; i++ )
+    {
+        fwrite( list->directories[i].entries, sizeof(struct DirectoryEntry), list->directories[i].count, out );
+    }
+    for( i = 0; i < list->file_count; i++ )
+    {
+        fwrite( list->files[i].extents, sizeof(struct Extent), list->files[i].count, out );
+    }
+    
+    //The total size goes in last, a partly written index never validates
+    header.size = offset;
+    fseek( out, offsetof( struct IndexHeader, size ), SEEK_SET );
+    fwrite( &header.size, sizeof(header.size), 1, out );
+    
+    int failed = ferror( out );
+    return fclose( out ) != 0 || failed ? -1 : 0;
+}
+
+
+//Walk the whole tree and write a sidecar index of every directory, the extents of every file and
+//the free space, then start using it. Returns 0 on success, -1 on failure (no index is left behind).
+
+int IndexBuild( struct Volume *volume )
+{
+    struct IndexContext *context = calloc( 1, sizeof(struct IndexContext) );
+    struct IndexList all;
+    struct ClusterUsage usage;
+    char *temporary = NULL;
+    int status = 0;
+    int t = 0;
+    size_t i = 0;
+    
+    memset( &all, 0, sizeof(all) );
+    IndexRemove( volume ); //Everything below comes from the image itself
+    if( context == NULL || volume->fat_table == NULL || volume->index_path == NULL ||
+            ( temporary = malloc( strlen( volume->index_path ) + 5 ) ) == NULL )
+    {
+        free( context );
+        return -1;
+    }
+    sprintf( temporary, "%s.tmp", volume->index_path );
+    
+    //The root directory is not an entry of any directory, so the walk never visits it
+    if( IndexAddDirectory( volume, &context->lists[0], volume->BPB_RootClus ) == -1 ||
+            WalkTree( volume, volume->BPB_RootClus, "/", NULL, IndexVisit, context ) != 0 ||
+            atomic_load( &context->errors ) > 0 )
+    {
+        status = -1;
+    }
+    
+    //Merge the per-thread lists
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        all.directory_count += context->lists[t].directory_count;
+        all.file_count += context->lists[t].file_count;
+    }
+    all.directories = malloc( ( all.directory_count + 1 ) * sizeof(struct Directory) );
+    all.files = malloc( ( all.file_count + 1 ) * sizeof(struct IndexExtents) );
+    all.directory_count = 0;
+    all.file_count = 0;
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        struct IndexList *list = &context->lists[t];
+        
+        if( all.directories != NULL && all.files != NULL )
+        {
+            if( list->directory_count > 0 ) //A thread that found nothing never allocated its lists
+            {
+                memcpy( &all.directories[all.directory_count], list->directories, list->directory_count * sizeof(struct Directory) );
+            }
+            if( list->file_count > 0 )
+            {
+                memcpy( &all.files[all.file_count], list->files, list->file_count * sizeof(struct IndexExtents) );
+            }
+            all.directory_count += list->directory_count;
+            all.file_count += list->file_count;
+        }
+        else
+        {
+            for( i = 0; i < list->directory_count; i++ )
+            {
+                FreeDirectory( &list->directories[i] );
+            }
+            for( i = 0; i < list->file_count; i++ )
+            {
+                free( list->files[i].extents );
+            }
+            status = -1;
+        }
+        free( list->directories );
+        free( list->files );
+    }
+    free( context );
+    
+    if( status == 0 )
+    {
+        //Cross-linked chains show up more than once, keep one record per key
+        qsort( all.directories, all.directory_count, sizeof(struct Directory), CompareIndexDirectories );
+        qsort( all.files, all.file_count, sizeof(struct IndexExtents), CompareIndexFiles );
+        
+        size_t kept = 0;
+        for( i = 0; i < all.directory_count; i++ )
+        {
+            if( kept > 0 && all.directories[kept - 1].cluster == all.directories[i].cluster )
+            {
+                FreeDirectory( &all.directories[i] );
+                continue;
+            }
+            all.directories[kept++] = all.directories[i];
+        }
+        all.directory_count = kept;
+        
+        kept = 0;
+        for( i = 0; i < all.file_count; i++ )
+        {
+            if( kept > 0 && all.files[kept - 1].first_cluster == all.files[i].first_cluster )
+            {
+                free( all.files[i].extents );
+                continue;
+            }
+            all.files[kept++] = all.files[i];
+        }
+        all.file_count = kept;
+        
+        FATCountClusters( volume, &usage );
+        if( ( !volume->free_space.valid && FreeSpaceBuild( volume ) == -1 ) ||
+                IndexWrite( volume, &all, &usage, temporary ) == -1 || rename( temporary, volume->index_path ) == -1 )
+        {
+            status = -1;
+        }
+    }
+    
+    for( i = 0; i < all.directory_count; i++ )
+    {
+        FreeDirectory( &all.directories[i] );
+    }
+    for( i = 0; i < all.file_count; i++ )
+    {
+        free( all.files[i].extents );
+    }
+    free( all.directories );
+    free( all.files );
+    
+    if( status == -1 )
+    {
+        unlink( temporary );
+    }
+    free( temporary );
+    return status == 0 ? IndexOpen( volume ) : -1;
+}
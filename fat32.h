@@ -0,0 +1,441 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016, 2017 Trevor Bakker
+// Copyright (c) 2020 Himanshu Rijal
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//FAT32 image access library: opens an image as a Volume and reads it through paths, directory
+//streams and file readers (ReaderOpen). Every Volume is independent, and the read calls on one Volume
+//may be made from any number of threads at once. The calls that change the image (ImageWrite,
+//FATSetEntry, FATFlush, the FreeSpace allocator) need exclusive use of the Volume.
+
+#ifndef FAT32_H
+#define FAT32_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_SIMD 1 //SSE2 baseline; SSSE3 and AVX2 paths are picked at run time when the CPU has them
+#endif
+
+#define MAX_PATH_LENGTH 4096 //Longest normalized absolute path
+#define MAX_NAME_LENGTH 254 //Longest single path component
+
+#define DIRECTORY_CACHE_SIZE 64 //Loaded directories kept in memory between commands
+#define DIRECTORY_CACHE_ENTRIES ( 1024 * 1024 ) //Total cached directory entries before unused directories are evicted
+#define PATH_CACHE_SIZE 4096 //Resolved absolute paths remembered
+#define PATH_CACHE_BUCKETS 8192 //Hash buckets for the path cache, a power of two
+
+#define DIR_NOT_FOUND -1 //Returned by DirectoryLookup when a name is not in the directory
+
+#define ATTR_READ_ONLY 0x01 //Directory entry attribute bits
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define ATTR_LONG_NAME 0x0F //All of read only, hidden, system and volume id: a long file name fragment
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF //Only the low 28 bits of a FAT32 entry are the cluster number
+#define FAT_BAD_CLUSTER 0x0FFFFFF7 //Entry value marking a bad cluster
+#define FAT_EOC 0x0FFFFFF8 //Entry values at or above this mark the end of a chain
+#define FAT_EOC_MARK 0x0FFFFFFF //End of chain value written by put
+#define FAT_MAX_FILE_SIZE 0xFFFFFFFFULL //DIR_FileSize is 32 bits
+
+#define EXTENT_CHUNK_SIZE ( 4 * 1024 * 1024 ) //Largest single read issued while copying an extent
+
+#define COPY_METHOD_RANGE 0    //copy_file_range: kernel copies (or reflinks) image bytes into the output file
+#define COPY_METHOD_SENDFILE 1 //sendfile: kernel copies through the page cache
+#define COPY_METHOD_BUFFERED 2 //write() from the mapping, or pread into a bounce buffer
+
+#define DEFAULT_READAHEAD ( 1024 * 1024 ) //Bytes fetched per streaming reader buffer, rounded up to whole clusters
+
+#define BUFFER_EMPTY 0  //Streaming reader buffer states
+#define BUFFER_QUEUED 1 //Fill requested, nobody working on it yet
+#define BUFFER_BUSY 2   //Being filled by the readahead thread
+#define BUFFER_READY 3  //Filled, waiting to be handed out
+#define BUFFER_ERROR 4  //Fill failed
+
+#define MAX_WALK_THREADS 64 //Upper bound on tree walker threads, one per online CPU below that
+
+#define STAT_IMAGE_READS 0      //Instrumentation counters, indexes into stat_counters
+#define STAT_IMAGE_READ_BYTES 1 //Bytes copied out of the image into user space
+#define STAT_PREAD_CALLS 2      //pread system calls issued by ImageRead
+#define STAT_FAT_LOOKUPS 3      //FAT entries followed by chain walks
+#define STAT_OUTPUT_WRITES 4    //copy_file_range, sendfile or write calls made while extracting
+#define STAT_OUTPUT_BYTES 5
+#define STAT_DIRECTORY_HITS 6
+#define STAT_DIRECTORY_MISSES 7
+#define STAT_PATH_HITS 8
+#define STAT_PATH_MISSES 9
+#define STAT_INDEX_HITS 10
+#define STAT_INDEX_MISSES 11
+#define STAT_BLOCK_HITS 12      //Block cache
+#define STAT_BLOCK_MISSES 13
+#define STAT_BLOCK_EVICTIONS 14
+#define STAT_IMAGE_WRITES 15     //pwrite calls made by put
+#define STAT_IMAGE_WRITE_BYTES 16
+#define STAT_COUNTERS 17
+
+#define STAT_BUCKETS 40 //Latency histogram bucket n counts durations in [2^n, 2^(n+1)) nanoseconds
+
+#define FSINFO_LEAD_SIG 0x41615252 //FSInfo signatures at offsets 0 and 484
+#define FSINFO_STRUC_SIG 0x61417272
+#define FSINFO_UNKNOWN 0xFFFFFFFF //FSInfo free count or next free not maintained
+
+#define BLOCK_CACHE_DEFAULT ( 64 * 1024 * 1024 ) //Bytes of image blocks kept by the block cache
+
+#define IMAGE_ADVICE_NORMAL 0     //Access pattern hints passed to ImageAdvise
+#define IMAGE_ADVICE_SEQUENTIAL 1 //Whole-file extraction, read ahead aggressively
+#define IMAGE_ADVICE_RANDOM 2     //Small random reads, don't read ahead
+
+#define INDEX_SUFFIX ".idx" //Sidecar metadata index file name: the image path plus this
+#define INDEX_MAGIC "MFSIDX1" //First 8 bytes of a sidecar index, terminator included
+#define INDEX_VERSION 1
+
+
+//Directory specification structure
+struct __attribute__((__packed__)) DirectoryEntry
+{
+    char DIR_Name[11];
+    uint8_t DIR_Attr;
+    uint8_t DIR_NTRes;
+    uint8_t DIR_CrtTimeTenth;
+    uint16_t DIR_CrtTime; //FAT times: hours << 11 | minutes << 5 | seconds / 2, local time
+    uint16_t DIR_CrtDate; //FAT dates: ( year - 1980 ) << 9 | month << 5 | day
+    uint16_t DIR_LstAccDate;
+    uint16_t DIR_FirstClusterHigh;
+    uint16_t DIR_WrtTime;
+    uint16_t DIR_WrtDate;
+    uint16_t DIR_FirstClusterLow;
+    uint32_t DIR_FileSize;
+};
+
+//Every entry of one directory, loaded by following the directory's own cluster chain,
+//with an open addressing hash index over the packed 11 byte names
+struct Directory
+{
+    uint32_t cluster; //First cluster of the directory
+    struct DirectoryEntry *entries; //Entries up to the end-of-directory marker
+    uint32_t count; //Number of entries
+    uint32_t *buckets; //Hash buckets holding entry index + 1, 0 when empty
+    uint32_t bucket_count; //Power of two, at least twice the number of indexed entries
+};
+
+struct CachedDirectory;
+struct CachedPath;
+struct CachedBlock;
+
+//Fixed-capacity cache of image blocks with CLOCK eviction. Blocks are one cluster and their grid
+//is shifted so every data cluster is exactly one block; the reserved area and FATs simply fall on
+//the same grid. Every ImageRead goes through it.
+struct BlockCache
+{
+    size_t block_size;
+    uint64_t shift; //Added to image offsets before dividing by block_size
+    size_t capacity; //Slots
+    struct CachedBlock *slots;
+    size_t used; //Slots handed out so far, they are never given back until the cache is reset
+    size_t hand; //CLOCK hand
+    struct CachedBlock **buckets;
+    size_t bucket_count; //Power of two
+    pthread_mutex_t lock;
+};
+
+//A run of physically contiguous clusters belonging to one file
+struct Extent
+{
+    uint32_t start_cluster; //First cluster of the run
+    uint32_t length; //Number of clusters in the run
+};
+
+//Runs of free clusters sorted by cluster number, built from the cached FAT on the first
+//allocation and kept in step with every allocation made by put
+struct FreeSpace
+{
+    struct Extent *runs;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t total; //Free clusters in all runs
+    int valid; //0 until built, and again whenever the FAT is reloaded
+};
+
+//Logical to physical cluster map of one file, so any byte offset resolves in O(1).
+//Cached while the file's directory stays current; users pins it against eviction.
+struct ClusterIndex
+{
+    uint32_t first_cluster; //Key: first cluster of the file
+    uint32_t *clusters; //clusters[n] is the physical cluster holding logical cluster n
+    uint32_t count; //Number of clusters in the chain
+    int users; //Readers currently holding the index
+    int stale; //Dropped from the cache, freed when the last user releases it
+    struct ClusterIndex *next; //Next entry in most-recently-used order
+};
+
+//Cluster counts from a scan of the FAT
+struct ClusterUsage
+{
+    uint64_t free; //Entry 0
+    uint64_t used; //Next cluster or end of chain
+    uint64_t bad; //FAT_BAD_CLUSTER
+    uint64_t reserved; //1 and 0x0FFFFFF0 - 0x0FFFFFF6
+};
+
+//Header of the sidecar metadata index written by IndexBuild. The index is native endian and
+//only ever read back by the build that wrote it. It holds a copy of every directory, the extents
+//of every file and the free space summary, and is valid while the image's size, modification
+//time and first FAT all still match what it was built from. Every offset is from the start
+//of the file and 8 byte aligned.
+struct IndexHeader
+{
+    char magic[8]; //INDEX_MAGIC
+    uint32_t version; //INDEX_VERSION
+    uint32_t cluster_size;
+    uint64_t image_size;
+    int64_t mtime_sec; //Image modification time
+    int64_t mtime_nsec;
+    uint32_t fat_crc; //CRC32C of the first FAT
+    uint32_t directory_count;
+    uint32_t file_count;
+    uint32_t free_count;
+    struct ClusterUsage usage; //FAT scan result
+    uint64_t directories; //directory_count IndexDirectory records sorted by cluster
+    uint64_t files; //file_count IndexFile records sorted by first cluster
+    uint64_t free_runs; //free_count Extents, the FreeSpace runs
+    uint64_t size; //Bytes in the whole index
+};
+
+//A directory in the sidecar index: every entry up to the end-of-directory marker
+struct IndexDirectory
+{
+    uint32_t cluster; //First cluster of the directory
+    uint32_t count;
+    uint64_t entries; //Offset of count DirectoryEntry records
+};
+
+//A non-empty file in the sidecar index: its cluster chain as runs of contiguous clusters
+struct IndexFile
+{
+    uint32_t first_cluster;
+    uint32_t extent_count;
+    uint64_t extents; //Offset of extent_count Extents
+};
+
+//An open file system image and everything cached about it
+struct Volume
+{
+    //FAT32 file system image specification
+    int16_t BPB_BytsPerSec;
+    uint8_t BPB_SecPerClus;
+    int16_t BPB_RsvdSecCnt;
+    uint8_t BPB_NumFATs;
+    int16_t BPB_RootEntCnt;
+    int32_t BPB_FATSz32;
+    uint16_t BPB_TotSec16;
+    uint32_t BPB_TotSec32;
+    uint16_t BPB_FSInfo;
+    uint32_t BPB_RootClus; //First cluster of the root directory
+
+    char *image_path; //Host path of the image, reopened read-write by ImageMakeWritable
+    int image_fd; //File descriptor for the file system image
+    int image_writable; //The image has been reopened read-write by the first command that writes it
+    unsigned char *image_map; //Read-only mapping of the whole image, NULL when falling back to pread
+    off_t image_size; //Size of the file system image in bytes
+    struct timespec image_mtime; //Modification time of the image when it was opened, or last indexed
+    uint32_t *fat_table; //In-memory copy of the first FAT, loaded once on open
+    uint32_t fat_entries; //Number of 32 bit entries in fat_table
+    struct FreeSpace free_space; //Free cluster runs for the allocator
+    uint32_t cluster_size; //Bytes per cluster (BPB_BytsPerSec * BPB_SecPerClus)
+    size_t readahead_window; //Bytes fetched ahead by streaming readers
+    struct BlockCache block_cache;
+    char *index_path; //Sidecar metadata index of the image
+    const struct IndexHeader *index; //Mapped sidecar index, NULL when there is none or it went stale
+
+    struct ClusterIndex *cluster_index_cache; //Cached cluster indexes, most recently used first
+    pthread_mutex_t cluster_index_lock; //Guards cluster_index_cache and users counts
+
+    struct CachedDirectory *directory_cache_head; //Most recently used loaded directory
+    struct CachedDirectory *directory_cache_tail; //Least recently used loaded directory
+    int directory_cache_count;
+    uint64_t directory_cache_entries; //Directory entries held by the directory cache
+    struct CachedPath *path_cache_buckets[PATH_CACHE_BUCKETS];
+    struct CachedPath *path_cache_head; //Most recently used path
+    struct CachedPath *path_cache_tail; //Least recently used path
+    int path_cache_count;
+    pthread_mutex_t dentry_lock; //Guards the directory and path caches
+};
+
+//Sequential reader over one file. Bytes are pulled in readahead-window sized chunks
+//(whole clusters) into two buffers: while the caller consumes one, a background thread
+//fills the other.
+struct FileReader
+{
+    struct Volume *volume;
+    struct ClusterIndex *index; //Cluster index of the file
+    uint64_t position; //Logical offset of the next byte handed out
+    uint64_t next_fetch; //Logical offset the next queued fill starts at
+    uint64_t end; //Logical offset fills stop at
+    uint64_t file_size; //DIR_FileSize of the file
+    size_t window; //Bytes per fill, a multiple of the cluster size
+    char *buffer[2];
+    uint64_t fill_position[2]; //Logical offset each buffer is filled from
+    size_t fill_length[2]; //Bytes requested for each buffer
+    int state[2]; //BUFFER_* state of each buffer
+    int current; //Buffer handed out by the next ReaderNext
+    int handed; //Buffer the caller currently holds, -1 if none
+    int thread_started; //Readahead thread only exists once a second buffer is queued
+    int stop; //Tells the readahead thread to exit
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+//A directory stream opened by VolumeOpenDir
+struct VolumeDir;
+
+//A directory waiting to be loaded by the tree walker
+struct WalkItem
+{
+    uint32_t cluster; //First cluster of the directory
+    char *path; //Absolute path of the directory
+    void *user; //What the visit callback returned for the directory's own entry
+};
+
+//Per-thread double ended queue of the tree walker. The owner pushes and pops at the tail
+//(depth first, good locality), idle threads steal from the head (large subtrees).
+struct WalkDeque
+{
+    struct WalkItem *items;
+    int head; //items[head..tail) are queued
+    int tail;
+    int capacity;
+    pthread_mutex_t lock;
+};
+
+struct Walker;
+
+//Called for every live entry below the start directory. For sub-directories the return value is
+//handed back as parent for the entries inside them. thread identifies the calling worker.
+typedef void * (*WalkVisit)( struct Walker *walker, int thread, void *parent, const char *path,
+                                const struct DirectoryEntry *entry );
+
+//Parallel work-stealing traversal of a directory tree. Each worker loads directories with
+//positional reads into its own buffers, so there is no shared seek position or cache lock.
+struct Walker
+{
+    struct Volume *volume;
+    int thread_count;
+    struct WalkDeque deques[MAX_WALK_THREADS];
+    pthread_mutex_t lock; //Guards pending and idle
+    pthread_cond_t work; //Signalled when work is queued or the walk finishes
+    int pending; //Directories queued or being processed
+    int idle; //Workers waiting for work
+    _Atomic uint64_t *visited; //One bit per cluster, directories already queued (guards against loops)
+    atomic_int errors; //Directories that could not be loaded
+    WalkVisit visit;
+    void *context; //Caller state for the visit callback
+};
+
+//Latency histogram with power of two nanosecond buckets, updated without locks
+struct Histogram
+{
+    _Atomic uint64_t count;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t buckets[STAT_BUCKETS];
+};
+
+extern _Atomic uint64_t stat_counters[STAT_COUNTERS]; //Instrumentation counters, relaxed atomics
+extern struct Histogram stat_read_latency; //ImageRead calls
+extern struct Histogram stat_output_latency; //Output calls made while extracting
+
+
+//FUNCTIONS
+struct Volume * VolumeOpen( const char *path, int use_mmap, size_t cache_bytes );
+void VolumeClose( struct Volume *volume );
+int VolumeStat( struct Volume *volume, const char *path, struct DirectoryEntry *entry );
+struct VolumeDir * VolumeOpenDir( struct Volume *volume, const char *path );
+int VolumeReadDir( struct VolumeDir *dir, char name[13], struct DirectoryEntry *entry );
+void VolumeCloseDir( struct VolumeDir *dir );
+void StatAdd( int counter, uint64_t value );
+uint64_t StatClock( void );
+void HistogramRecord( struct Histogram *histogram, uint64_t start );
+int ImageOpen( struct Volume *volume, const char *path, int use_mmap );
+int ImageClose( struct Volume *volume );
+int ImageMakeWritable( struct Volume *volume );
+int ImageRead( struct Volume *volume, void *buffer, size_t length, off_t offset );
+int ImageWrite( struct Volume *volume, const void *buffer, size_t length, off_t offset );
+int BlockCacheConfigure( struct Volume *volume, size_t block_size, off_t aligned_offset, size_t bytes );
+void BlockCacheInvalidate( struct Volume *volume, off_t offset, size_t length );
+const void * ImagePointer( struct Volume *volume, off_t offset, size_t length );
+void ImageAdvise( struct Volume *volume, int advice );
+int FATLoad( struct Volume *volume );
+void FATFree( struct Volume *volume );
+uint32_t Crc32c( uint32_t crc, const void *data, size_t length );
+int IndexOpen( struct Volume *volume );
+void IndexClose( struct Volume *volume );
+int IndexBuild( struct Volume *volume );
+void IndexRemove( struct Volume *volume );
+off_t LBAToOffset( struct Volume *volume, uint32_t sector );
+uint32_t NextLB( struct Volume *volume, uint32_t sector );
+int IsEndOfChain( struct Volume *volume, uint32_t cluster );
+uint32_t FirstCluster( const struct DirectoryEntry *entry );
+uint32_t ClusterCount( struct Volume *volume );
+void FATCountClusters( struct Volume *volume, struct ClusterUsage *usage );
+int FreeSpaceBuild( struct Volume *volume );
+int FreeSpaceAllocate( struct Volume *volume, uint32_t clusters, struct Extent **extents );
+int FreeSpaceTake( struct Volume *volume, uint32_t clusters, struct Extent *extent );
+void FreeSpaceRelease( struct Volume *volume, const struct Extent *extents, int count );
+void FATSetEntry( struct Volume *volume, uint32_t cluster, uint32_t value );
+int FATFlush( struct Volume *volume, const struct Extent *ranges, int count );
+int BuildExtents( struct Volume *volume, uint32_t first_cluster, struct Extent **extents );
+int CopyImageRange( struct Volume *volume, int out_fd, off_t offset, uint64_t length, int *method );
+int StreamFile( struct Volume *volume, const struct DirectoryEntry *entry, int out_fd, int *method );
+int ExtractFile( struct Volume *volume, const struct DirectoryEntry *entry, const char *path );
+struct ClusterIndex * ClusterIndexAcquire( struct Volume *volume, uint32_t first_cluster );
+void ClusterIndexRelease( struct Volume *volume, struct ClusterIndex *index );
+void ClusterIndexFlush( struct Volume *volume );
+int ReadClusters( struct Volume *volume, const struct ClusterIndex *index, uint64_t start, size_t length, char *buffer );
+int ReaderOpen( struct Volume *volume, struct FileReader *reader, const struct DirectoryEntry *entry );
+int ReaderSeek( struct FileReader *reader, uint64_t position, uint64_t length );
+ssize_t ReaderNext( struct FileReader *reader, const char **data );
+ssize_t ReaderNextRange( struct FileReader *reader, off_t *offset );
+void ReaderClose( struct FileReader *reader );
+int LoadDirectory( struct Volume *volume, uint32_t cluster, struct Directory *directory );
+void FreeDirectory( struct Directory *directory );
+void PackName( const char *input, char packed[11] );
+void UnpackName( const char packed[11], char *name );
+int HostSafeName( const char packed[11] );
+int DirectoryLookup( const struct Directory *directory, const char packed[11] );
+struct Directory * DirectoryAcquire( struct Volume *volume, uint32_t cluster );
+void DirectoryRelease( struct Volume *volume, struct Directory *directory );
+void DentryCacheFlush( struct Volume *volume );
+int NormalizePath( const char *cwd, const char *path, char *normalized );
+int ResolvePath( struct Volume *volume, const char *cwd, const char *path, struct DirectoryEntry *entry );
+uint32_t DirectoryCluster( struct Volume *volume, const struct DirectoryEntry *entry );
+int WalkThreadCount( void );
+int WalkTree( struct Volume *volume, uint32_t cluster, const char *path, void *user, WalkVisit visit, void *context );
+uint32_t HashPath( const char *path );
+int ValidShortName( const char *name );
+off_t DirectorySlotOffset( struct Volume *volume, uint32_t cluster, uint32_t position );
+
+#endif
@@ -32,581 +32,4769 @@
 #include <signal.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fat32.h"
 
 #define WHITESPACE " \t\n"      // We want to split our command line up into tokens
                                 // so we need to define what delimits our tokens.
                                 // In this case  white space
                                 // will separate the tokens on our command line
 
-#define MAX_COMMAND_SIZE 255    // The maximum command-line size
+#define MAX_COMMAND_SIZE 255    // The maximum command-line size
+
+#define MAX_NUM_ARGUMENTS 5     // Mav shell only supports five arguments
+
+#define OUTPUT_BUFFER_SIZE ( 64 * 1024 ) //stdout buffer in batch mode
+
+#define COMMAND_BUCKETS 64 //Hash buckets of the command table, a power of two
+
+#define MGET_INFLIGHT_BYTES ( 256ULL * 1024 * 1024 ) //File bytes being extracted at once by mget
+#define MGET_BATCH_BYTES ( 1024 * 1024 ) //Small files are handed to mget workers in batches up to this size
+#define MGET_BATCH_FILES 64 //and at most this many files
+
+#define HEX_LAYOUT_PLAIN 0 //read output: "xx " per byte on one line
+#define HEX_LAYOUT_XXD 1   //read output: xxd style offset, 8 groups of 2 bytes and ASCII per 16 bytes
+#define HEX_OUTPUT_SIZE ( 1024 * 1024 ) //Formatted hex collected before one write to stdout
+
+#define FSCK_REPORT_LIMIT 20 //Problems of one kind printed by fsck before the rest are only counted
+#define FSCK_OWNERS 4 //Chains named per cross-linked cluster
+
+#define SUM_CRC32C 0 //sum algorithms
+#define SUM_SHA256 1
+#define SUM_DIGEST_SIZE 65 //Hex digest and terminator, SHA-256 being the longest
+
+#define TAR_BLOCK_SIZE 512
+#define EXPORT_BUFFER_SIZE ( 1024 * 1024 ) //Tar headers, padding and small files collected before one write
+#define EXPORT_INLINE_SIZE ( 64 * 1024 ) //Files up to this size are copied into the export buffer, larger ones by the kernel
+
+#define SERVE_BACKLOG 16 //Daemon connections waiting to be accepted
+
+
+//One parsed command line. The tokens point into line, so parsing allocates nothing
+//and the same CommandLine is reused for every command of a session or batch.
+struct CommandLine
+{
+    char line[MAX_COMMAND_SIZE];
+    char *token[MAX_NUM_ARGUMENTS]; //Whitespace separated words, NULL past the last one
+    int token_count;
+};
+
+//What commands run against: the shell's own image, or one daemon client's. Everything a served
+//command prints goes to out.
+struct Session
+{
+    FILE *in; //A daemon client's connection, NULL for the shell
+    FILE *out;
+    char cwd[PATH_MAX]; //A daemon client's working directory, relative host paths are taken from there
+    struct Volume *volume; //The open file system image, NULL when none is open
+    struct Directory *current_dir; //Structure for the current directory, pinned in the directory cache
+    char current_path[MAX_PATH_LENGTH]; //Normalized absolute path of the current directory
+};
+
+//A shell command and its handler, looked up by name in a hash table
+struct Command
+{
+    const char *name;
+    void (*handler)( struct Session *session, char **token );
+    int needs_image; //Refused while no image is open
+    int served; //Also run for daemon clients
+};
+
+//Where each output character of one 16 byte hex block comes from. For output position p,
+//hi[p] / lo[p] name the input byte whose high / low nibble is printed there (0x80: none, which
+//is also what makes pshufb write a zero), and literal[p] is OR-ed in (separators).
+struct HexTemplate
+{
+    unsigned char hi[48];
+    unsigned char lo[48];
+    unsigned char literal[48];
+    int width; //Characters of a full block, separators included
+};
+
+//Streaming hex formatter for read: bytes go in in any chunk sizes, whole 16 byte blocks
+//are formatted straight into output, which is written to out when it fills up
+struct HexDump
+{
+    FILE *out; //stdout, or a daemon client's connection
+    int layout; //HEX_LAYOUT_*
+    uint64_t offset; //File offset of the next block, printed by the xxd layout
+    unsigned char carry[16]; //Bytes waiting for the rest of their block
+    int carry_length;
+    char *output;
+    size_t used;
+};
+
+//Incremental SHA-256
+struct Sha256
+{
+    uint32_t state[8];
+    uint64_t length; //Bytes hashed so far
+    unsigned char block[64]; //Partial block
+    size_t used;
+};
+
+//One file to hash for sum, and its result
+struct SumJob
+{
+    char *path; //Absolute image path
+    struct DirectoryEntry entry;
+    char digest[SUM_DIGEST_SIZE];
+    int status; //0 hashed, -1 unreadable or not found
+    char *expected; //Digest from the manifest being verified, NULL when producing one
+};
+
+struct SumList
+{
+    struct SumJob *jobs;
+    size_t count;
+    size_t capacity;
+};
+
+//State shared by the sum enumeration and its hashing threads
+struct SumContext
+{
+    struct Volume *volume;
+    int algorithm; //SUM_*
+    struct SumList files[MAX_WALK_THREADS]; //Per walker thread
+    atomic_int errors;
+    struct SumJob *jobs; //All files, merged and sorted after enumeration
+    size_t job_count;
+    atomic_size_t next_job; //Next job a hashing thread claims
+};
+
+//Tar archive being written by export. Headers, padding and small files are collected in buffer and
+//go out in large writes; larger files are copied from the image to fd by the kernel in between.
+struct TarStream
+{
+    struct Volume *volume;
+    int fd;
+    char *buffer; //EXPORT_BUFFER_SIZE bytes
+    size_t used;
+    int method; //COPY_METHOD_* reached by StreamFile, kept from one file to the next
+    FILE *report; //Where problems are printed: stderr while the archive goes to stdout
+    char path[MAX_PATH_LENGTH]; //Image path of the directory being exported
+    char name[MAX_PATH_LENGTH]; //Its member name
+    uint64_t files;
+    uint64_t bytes;
+};
+
+struct Session shell = { .current_path = "/" }; //The interactive or batch session, output goes to stdout
+const char *stats_file = NULL; //Where quit writes the statistics as JSON, if anywhere
+size_t block_cache_bytes = BLOCK_CACHE_DEFAULT; //Configured capacity, 0 disables the cache
+size_t readahead_window = DEFAULT_READAHEAD; //Bytes fetched ahead by streaming readers of the next image opened
+
+
+//FUNCTIONS
+void StatsReset( void );
+void StatsPrint( FILE *out, int json );
+int HexDumpOpen( struct HexDump *dump, FILE *out, int layout, uint64_t offset );
+int HexDumpWrite( struct HexDump *dump, const unsigned char *data, size_t length );
+int HexDumpClose( struct HexDump *dump );
+void ListDirectory( FILE *out, const struct Directory *directory );
+int ChangeDirectory( struct Session *session, const char *path );
+void FindCommand( struct Session *session, const char *pattern, const char *path );
+void DuCommand( struct Session *session, const char *path );
+void MgetCommand( struct Session *session, const char *source, const char *destination );
+int FsckCommand( struct Session *session );
+int PutCommand( struct Session *session, const char *source, const char *name );
+int DefragCommand( struct Session *session, const char *path, int dry_run );
+int SumCommand( struct Session *session, const char *path, int recursive, int algorithm );
+int SumVerify( struct Session *session, const char *manifest );
+int ExportCommand( struct Session *session, const char *path, const char *target );
+struct Volume * ServeImage( const char *path, int use_mmap );
+int SessionHostPath( const struct Session *session, const char *path, char host[PATH_MAX] );
+int Serve( const char *path, char **images, int image_count );
+int RemoteConnect( const char *path );
+void ParseCommand( struct CommandLine *command );
+void RunCommand( struct CommandLine *command );
+void Quit( int status );
+
+int main( int argc, char *argv[] )
+{
+  struct CommandLine *command = malloc( sizeof(struct CommandLine) ); //Reused for every command
+  const char *commands = NULL; //-c: commands separated by ';'
+  const char *script = NULL; //-f: file with one command per line
+  const char *serve = NULL; //-d: run as a daemon on this Unix socket
+  const char *remote = NULL; //-r: send every command to the daemon on this Unix socket
+  FILE *input = stdin;
+  int option = 0;
+
+  while( ( option = getopt( argc, argv, "c:f:s:d:r:" ) ) != -1 )
+  {
+    if( option == 'c' )
+    {
+      commands = optarg;
+    }
+    else if( option == 'f' )
+    {
+      script = optarg;
+    }
+    else if( option == 's' )
+    {
+      stats_file = optarg; //Statistics are written here as JSON by quit
+    }
+    else if( option == 'd' )
+    {
+      serve = optarg;
+    }
+    else if( option == 'r' )
+    {
+      remote = optarg;
+    }
+    else
+    {
+      fprintf( stderr, "Usage: %s [-c \"command; command ...\"] [-f script] [-s stats.json] [-r socket]\n"
+                       "       %s -d socket [image ...]\n", argv[0], argv[0] );
+      return 1;
+    }
+  }
+
+  if( command == NULL )
+  {
+    return 1;
+  }
+
+  shell.out = stdout;
+
+  if( serve != NULL ) //Daemon mode: the images named after the options are opened up front
+  {
+    return Serve( serve, argv + optind, argc - optind ) == -1 ? 1 : 0;
+  }
+
+  if( script != NULL && ( input = fopen( script, "r" ) ) == NULL )
+  {
+    fprintf( stderr, "%s: %s\n", script, strerror( errno ) );
+    return 1;
+  }
+
+  if( remote != NULL && RemoteConnect( remote ) == -1 )
+  {
+    return 1;
+  }
+
+  //Batch mode: no prompts and block buffered output. The image and every cache
+  //stay open from one command to the next until quit or the end of the input.
+  int batch = commands != NULL || script != NULL || !isatty( STDIN_FILENO );
+
+  if( batch )
+  {
+    setvbuf( stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE );
+  }
+
+  if( commands != NULL )
+  {
+    const char *next = commands;
+
+    while( next != NULL )
+    {
+      const char *end = strchr( next, ';' );
+      int length = end != NULL ? (int)( end - next ) : (int)strlen( next );
+
+      snprintf( command->line, sizeof(command->line), "%.*s", length, next );
+      ParseCommand( command );
+      RunCommand( command );
+      next = end != NULL ? end + 1 : NULL;
+    }
+  }
+  else
+  {
+    while( 1 )
+    {
+      if( !batch )
+      {
+        printf ("mfs> ");
+      }
+
+      //Read the command from the commandline.  The
+      //maximum command that will be read is MAX_COMMAND_SIZE.
+      //End of input ends the session like quit
+      if( !fgets( command->line, MAX_COMMAND_SIZE, input ) )
+      {
+        break;
+      }
+
+      ParseCommand( command );
+      RunCommand( command );
+    }
+  }
+
+  Quit( 0 );
+  return 0;
+}
+
+
+//Upper bound, in nanoseconds, of the bucket holding the given fraction of the recorded durations
+
+static uint64_t HistogramPercentile( struct Histogram *histogram, double fraction )
+{
+    uint64_t count = atomic_load( &histogram->count );
+    uint64_t seen = 0;
+    int bucket = 0;
+    
+    if( count == 0 )
+    {
+        return 0;
+    }
+    for( bucket = 0; bucket < STAT_BUCKETS - 1; bucket++ )
+    {
+        seen += atomic_load( &histogram->buckets[bucket] );
+        if( seen >= fraction * count )
+        {
+            break;
+        }
+    }
+    uint64_t bound = ( 2ULL << bucket ) - 1;
+    uint64_t max = atomic_load( &histogram->max_ns );
+    return bound < max ? bound : max;
+}
+
+
+static void HistogramReset( struct Histogram *histogram )
+{
+    int bucket = 0;
+    
+    atomic_store( &histogram->count, 0 );
+    atomic_store( &histogram->total_ns, 0 );
+    atomic_store( &histogram->max_ns, 0 );
+    for( bucket = 0; bucket < STAT_BUCKETS; bucket++ )
+    {
+        atomic_store( &histogram->buckets[bucket], 0 );
+    }
+}
+
+
+//One histogram line (or JSON object) of StatsPrint
+
+static void HistogramPrint( FILE *out, int json, const char *name, struct Histogram *histogram, int first )
+{
+    uint64_t count = atomic_load( &histogram->count );
+    uint64_t total = atomic_load( &histogram->total_ns );
+    
+    if( json )
+    {
+        fprintf( out, "%s\"%s\": {\"count\": %llu, \"total_us\": %.3f, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+                      "\"p99_us\": %.3f, \"max_us\": %.3f}",
+                 first ? "" : ", ", name, (unsigned long long)count, total / 1e3, count > 0 ? total / 1e3 / count : 0.0,
+                 HistogramPercentile( histogram, 0.5 ) / 1e3, HistogramPercentile( histogram, 0.99 ) / 1e3,
+                 atomic_load( &histogram->max_ns ) / 1e3 );
+    }
+    else
+    {
+        fprintf( out, " %-16s %10llu %12.3f %10.3f %10.3f %10.3f\n", name, (unsigned long long)count, total / 1e6,
+                 HistogramPercentile( histogram, 0.5 ) / 1e3, HistogramPercentile( histogram, 0.99 ) / 1e3,
+                 atomic_load( &histogram->max_ns ) / 1e3 );
+    }
+}
+
+
+static const char hex_digits[] = "0123456789abcdef";
+static struct HexTemplate hex_templates[2]; //By layout, built on first use
+static int hex_use_simd = 0;
+static pthread_once_t hex_once = PTHREAD_ONCE_INIT; //Templates and the CPU check, done by the first dump
+
+
+static void HexTemplatesBuild( void )
+{
+    int p = 0;
+    
+    memset( hex_templates, 0, sizeof(hex_templates) );
+    memset( hex_templates[0].hi, 0x80, 48 );
+    memset( hex_templates[0].lo, 0x80, 48 );
+    memset( hex_templates[1].hi, 0x80, 48 );
+    memset( hex_templates[1].lo, 0x80, 48 );
+    
+    //Plain: "xx " for each of the 16 bytes
+    for( p = 0; p < 48; p++ )
+    {
+        if( p % 3 == 0 ) hex_templates[HEX_LAYOUT_PLAIN].hi[p] = p / 3;
+        else if( p % 3 == 1 ) hex_templates[HEX_LAYOUT_PLAIN].lo[p] = p / 3;
+        else hex_templates[HEX_LAYOUT_PLAIN].literal[p] = ' ';
+    }
+    hex_templates[HEX_LAYOUT_PLAIN].width = 48;
+    
+    //xxd: "xxxx " for each pair of bytes, the last group followed by two spaces before the ASCII column
+    for( p = 0; p < 41; p++ )
+    {
+        int q = p % 5;
+        
+        if( p >= 39 || q == 4 ) hex_templates[HEX_LAYOUT_XXD].literal[p] = ' ';
+        else if( q % 2 == 0 ) hex_templates[HEX_LAYOUT_XXD].hi[p] = ( p / 5 ) * 2 + q / 2;
+        else hex_templates[HEX_LAYOUT_XXD].lo[p] = ( p / 5 ) * 2 + q / 2;
+    }
+    hex_templates[HEX_LAYOUT_XXD].width = 41;
+    
+#ifdef X86_SIMD
+    __builtin_cpu_init();
+    hex_use_simd = __builtin_cpu_supports( "ssse3" );
+#else
+    hex_use_simd = 0;
+#endif
+}
+
+
+//Format the first length (at most 16) bytes of block by the template. Missing bytes print as spaces.
+
+static void HexBlockScalar( const struct HexTemplate *template, const unsigned char *block, int length, char *out )
+{
+    int p = 0;
+    
+    for( p = 0; p < template->width; p++ )
+    {
+        if( template->hi[p] != 0x80 )
+        {
+            out[p] = template->hi[p] < length ? hex_digits[block[template->hi[p]] >> 4] : ' ';
+        }
+        else if( template->lo[p] != 0x80 )
+        {
+            out[p] = template->lo[p] < length ? hex_digits[block[template->lo[p]] & 0x0F] : ' ';
+        }
+        else
+        {
+            out[p] = template->literal[p];
+        }
+    }
+}
+
+
+static void HexAsciiScalar( const unsigned char *block, int length, char *out )
+{
+    int i = 0;
+    
+    for( i = 0; i < length; i++ )
+    {
+        out[i] = block[i] >= 0x20 && block[i] < 0x7F ? block[i] : '.';
+    }
+}
+
+
+#ifdef X86_SIMD
+
+//Full 16 byte block: both nibbles become ASCII with one table shuffle each, then three shuffles
+//per 16 output characters place them (and zero the rest) before the separators are OR-ed in.
+//Always stores 48 bytes at out.
+
+__attribute__((target("ssse3")))
+static void HexBlockSSSE3( const struct HexTemplate *template, const unsigned char *block, char *out )
+{
+    const __m128i digits = _mm_loadu_si128( (const __m128i *)hex_digits );
+    const __m128i nibble = _mm_set1_epi8( 0x0F );
+    __m128i bytes = _mm_loadu_si128( (const __m128i *)block );
+    __m128i hi = _mm_shuffle_epi8( digits, _mm_and_si128( _mm_srli_epi16( bytes, 4 ), nibble ) );
+    __m128i lo = _mm_shuffle_epi8( digits, _mm_and_si128( bytes, nibble ) );
+    int k = 0;
+    
+    for( k = 0; k < 3; k++ )
+    {
+        __m128i v = _mm_or_si128( _mm_shuffle_epi8( hi, _mm_loadu_si128( (const __m128i *)&template->hi[16 * k] ) ),
+                                  _mm_shuffle_epi8( lo, _mm_loadu_si128( (const __m128i *)&template->lo[16 * k] ) ) );
+        v = _mm_or_si128( v, _mm_loadu_si128( (const __m128i *)&template->literal[16 * k] ) );
+        _mm_storeu_si128( (__m128i *)&out[16 * k], v );
+    }
+}
+
+
+//ASCII column of a full block: printable bytes as they are, everything else as '.'
+
+static void HexAsciiSSE2( const unsigned char *block, char *out )
+{
+    __m128i bytes = _mm_loadu_si128( (const __m128i *)block );
+    __m128i printable = _mm_and_si128( _mm_cmpgt_epi8( bytes, _mm_set1_epi8( 0x1F ) ),
+                                       _mm_cmplt_epi8( bytes, _mm_set1_epi8( 0x7F ) ) ); //Signed: 0x80-0xFF fail
+    _mm_storeu_si128( (__m128i *)out, _mm_or_si128( _mm_and_si128( printable, bytes ),
+                                                    _mm_andnot_si128( printable, _mm_set1_epi8( '.' ) ) ) );
+}
+
+#endif
+
+
+//Write out everything formatted so far. out is flushed first so earlier printf output stays in order.
+
+static int HexDumpFlush( struct HexDump *dump )
+{
+    size_t done = 0;
+    
+    fflush( dump->out );
+    while( done < dump->used )
+    {
+        ssize_t n = write( fileno( dump->out ), dump->output + done, dump->used - done );
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            return -1;
+        }
+        done += n;
+    }
+    dump->used = 0;
+    return 0;
+}
+
+
+//Format one block of length bytes (16 except for the last one)
+
+static void HexDumpBlock( struct HexDump *dump, const unsigned char *block, int length )
+{
+    const struct HexTemplate *template = &hex_templates[dump->layout];
+    char *out = dump->output + dump->used;
+    int shift = 0;
+    
+    if( dump->layout == HEX_LAYOUT_XXD )
+    {
+        for( shift = dump->offset >> 32 ? 60 : 28; shift >= 0; shift -= 4 )
+        {
+            *out++ = hex_digits[( dump->offset >> shift ) & 0x0F];
+        }
+        *out++ = ':';
+        *out++ = ' ';
+    }
+    
+#ifdef X86_SIMD
+    if( length == 16 && hex_use_simd )
+    {
+        HexBlockSSSE3( template, block, out );
+    }
+    else
+#endif
+    {
+        HexBlockScalar( template, block, length, out );
+    }
+    
+    if( dump->layout == HEX_LAYOUT_PLAIN )
+    {
+        out += 3 * length;
+    }
+    else
+    {
+        out += template->width;
+#ifdef X86_SIMD
+        if( length == 16 )
+        {
+            HexAsciiSSE2( block, out );
+        }
+        else
+#endif
+        {
+            HexAsciiScalar( block, length, out );
+        }
+        out += length;
+        *out++ = '\n';
+    }
+    
+    dump->used = out - dump->output;
+    dump->offset += length;
+}
+
+
+//Start a hex dump to out of bytes starting at file offset offset. Returns 0 on success, -1 on allocation failure.
+
+int HexDumpOpen( struct HexDump *dump, FILE *out, int layout, uint64_t offset )
+{
+    pthread_once( &hex_once, HexTemplatesBuild );
+    
+    memset( dump, 0, sizeof(struct HexDump) );
+    dump->out = out;
+    dump->layout = layout;
+    dump->offset = offset;
+    dump->output = malloc( HEX_OUTPUT_SIZE + 128 ); //Room for one more line than the flush threshold
+    return dump->output != NULL ? 0 : -1;
+}
+
+
+//Format length bytes. Returns 0 on success, -1 when out cannot be written.
+
+int HexDumpWrite( struct HexDump *dump, const unsigned char *data, size_t length )
+{
+    while( length > 0 )
+    {
+        const unsigned char *block = data;
+        
+        if( dump->carry_length > 0 || length < 16 ) //Complete a partial block first
+        {
+            int take = 16 - dump->carry_length < (int)length ? 16 - dump->carry_length : (int)length;
+            
+            memcpy( &dump->carry[dump->carry_length], data, take );
+            dump->carry_length += take;
+            data += take;
+            length -= take;
+            if( dump->carry_length < 16 )
+            {
+                break;
+            }
+            block = dump->carry;
+            dump->carry_length = 0;
+        }
+        else
+        {
+            data += 16;
+            length -= 16;
+        }
+        
+        HexDumpBlock( dump, block, 16 );
+        if( dump->used >= HEX_OUTPUT_SIZE && HexDumpFlush( dump ) == -1 )
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+//Format the last partial block, end the plain layout's line, write everything out and free the buffer.
+//Returns 0 on success, -1 when out cannot be written.
+
+int HexDumpClose( struct HexDump *dump )
+{
+    int status = 0;
+    
+    if( dump->carry_length > 0 )
+    {
+        HexDumpBlock( dump, dump->carry, dump->carry_length );
+    }
+    if( dump->layout == HEX_LAYOUT_PLAIN )
+    {
+        dump->output[dump->used++] = '\n';
+    }
+    status = HexDumpFlush( dump );
+    free( dump->output );
+    dump->output = NULL;
+    return status;
+}
+
+//Print the names of the files and sub-directories in a directory to out
+
+void ListDirectory( FILE *out, const struct Directory *directory )
+{
+    uint32_t i = 0;
+    int j = 0;
+    
+    for ( i = 0; i < directory->count; i++ )
+    {
+        const struct DirectoryEntry *entry = &directory->entries[i];
+        char substring[12];
+        for ( j = 0; j < 11; j++)
+        {
+            substring[j] = entry->DIR_Name[j];
+        }
+        substring[11] = '\0'; //Create substring of file name for each file in directory entry array
+        
+        if ( ( entry->DIR_Attr == 0x01 || entry->DIR_Attr == 0x10
+            || entry->DIR_Attr == 0x20 ) && entry->DIR_Name[0] != '\xE5' )
+        {
+            fprintf(out,"%s\n",substring);
+        }
+    }
+}
+
+
+//Make the directory at path the current directory of a session. The previous one stays in the directory cache.
+//Returns 0 on success, -1 if the path is not a directory or cannot be loaded.
+
+int ChangeDirectory( struct Session *session, const char *path )
+{
+    char normalized[MAX_PATH_LENGTH];
+    struct DirectoryEntry entry;
+    
+    if( NormalizePath( session->current_path, path, normalized ) == -1 ||
+            ResolvePath( session->volume, session->current_path, normalized, &entry ) == -1 || !( entry.DIR_Attr & ATTR_DIRECTORY ) )
+    {
+        return -1;
+    }
+    
+    struct Directory *directory = DirectoryAcquire( session->volume, DirectoryCluster( session->volume, &entry ) );
+    if( directory == NULL )
+    {
+        return -1;
+    }
+    
+    DirectoryRelease( session->volume, session->current_dir );
+    session->current_dir = directory;
+    strcpy( session->current_path, normalized );
+    return 0;
+}
+
+
+//Growable list of strings, one per walker thread, merged after the walk
+
+struct PathList
+{
+    char **paths;
+    size_t count;
+    size_t capacity;
+};
+
+static int PathListAdd( struct PathList *list, const char *path )
+{
+    if( list->count == list->capacity )
+    {
+        size_t capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+        char **grown = realloc( list->paths, capacity * sizeof(char *) );
+        if( grown == NULL )
+        {
+            return -1;
+        }
+        list->paths = grown;
+        list->capacity = capacity;
+    }
+    if( ( list->paths[list->count] = strdup( path ) ) == NULL )
+    {
+        return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+static int ComparePaths( const void *a, const void *b )
+{
+    return strcmp( *(char * const *)a, *(char * const *)b );
+}
+
+
+struct FindContext
+{
+    const char *pattern;
+    struct PathList matches[MAX_WALK_THREADS]; //Per thread, so visits never contend
+};
+
+static void * FindVisit( struct Walker *walker, int thread, void *parent, const char *path,
+                            const struct DirectoryEntry *entry )
+{
+    struct FindContext *find = walker->context;
+    const char *name = strrchr( path, '/' ) + 1;
+    
+    (void)parent;
+    (void)entry;
+    if( fnmatch( find->pattern, name, FNM_CASEFOLD ) == 0 )
+    {
+        PathListAdd( &find->matches[thread], path );
+    }
+    return NULL;
+}
+
+
+//find: print, in sorted order, every path below path whose last component matches the shell pattern
+
+void FindCommand( struct Session *session, const char *pattern, const char *path )
+{
+    struct Volume *volume = session->volume;
+    struct FindContext *find = calloc( 1, sizeof(struct FindContext) );
+    struct DirectoryEntry entry;
+    char normalized[MAX_PATH_LENGTH];
+    struct PathList all = { NULL, 0, 0 };
+    size_t i = 0;
+    int t = 0;
+    
+    if( find == NULL )
+    {
+        return;
+    }
+    
+    if( NormalizePath( session->current_path, path, normalized ) == -1 || ResolvePath( volume, session->current_path, normalized, &entry ) == -1 ||
+            !( entry.DIR_Attr & ATTR_DIRECTORY ) )
+    {
+        printf("%s: No such directory.\n",path);
+        free( find );
+        return;
+    }
+    
+    find->pattern = pattern;
+    int errors = WalkTree( volume, DirectoryCluster( volume, &entry ), normalized, NULL, FindVisit, find );
+    
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        all.capacity += find->matches[t].count;
+    }
+    all.paths = malloc( ( all.capacity + 1 ) * sizeof(char *) );
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        for( i = 0; i < find->matches[t].count; i++ )
+        {
+            if( all.paths != NULL )
+            {
+                all.paths[all.count++] = find->matches[t].paths[i];
+            }
+            else
+            {
+                free( find->matches[t].paths[i] );
+            }
+        }
+        free( find->matches[t].paths );
+    }
+    
+    if( all.count > 0 )
+    {
+        qsort( all.paths, all.count, sizeof(char *), ComparePaths );
+    }
+    for( i = 0; i < all.count; i++ )
+    {
+        printf("%s\n",all.paths[i]);
+        free( all.paths[i] );
+    }
+    if( errors != 0 )
+    {
+        printf("Error: %d director%s could not be read\n",errors,errors == 1 ? "y" : "ies");
+    }
+    
+    free( all.paths );
+    free( find );
+}
+
+
+//Totals of one directory for du, including everything below it
+
+struct DuNode
+{
+    char *path;
+    struct DuNode *parent;
+    _Atomic uint64_t bytes; //Sum of DIR_FileSize of every file below
+    _Atomic uint64_t files; //Number of files below
+};
+
+struct DuContext
+{
+    struct DuNode **nodes[MAX_WALK_THREADS]; //Directories created by each thread
+    size_t count[MAX_WALK_THREADS];
+    size_t capacity[MAX_WALK_THREADS];
+};
+
+static void * DuVisit( struct Walker *walker, int thread, void *parent, const char *path,
+                          const struct DirectoryEntry *entry )
+{
+    struct DuContext *du = walker->context;
+    struct DuNode *node = NULL;
+    
+    if( !( entry->DIR_Attr & ATTR_DIRECTORY ) ) //Charge the file to every directory above it
+    {
+        for( node = parent; node != NULL; node = node->parent )
+        {
+            atomic_fetch_add( &node->bytes, entry->DIR_FileSize );
+            atomic_fetch_add( &node->files, 1 );
+        }
+        return NULL;
+    }
+    
+    if( du->count[thread] == du->capacity[thread] )
+    {
+        size_t capacity = du->capacity[thread] == 0 ? 256 : du->capacity[thread] * 2;
+        struct DuNode **grown = realloc( du->nodes[thread], capacity * sizeof(struct DuNode *) );
+        if( grown == NULL )
+        {
+            return NULL;
+        }
+        du->nodes[thread] = grown;
+        du->capacity[thread] = capacity;
+    }
+    if( ( node = calloc( 1, sizeof(struct DuNode) ) ) == NULL || ( node->path = strdup( path ) ) == NULL )
+    {
+        free( node );
+        return NULL;
+    }
+    node->parent = parent;
+    du->nodes[thread][du->count[thread]++] = node;
+    return node;
+}
+
+static int CompareDuNodes( const void *a, const void *b )
+{
+    return strcmp( (*(struct DuNode * const *)a)->path, (*(struct DuNode * const *)b)->path );
+}
+
+
+//du: print the total file bytes and file count of path and of every directory below it, sorted by path
+
+void DuCommand( struct Session *session, const char *path )
+{
+    struct Volume *volume = session->volume;
+    struct DuContext *du = calloc( 1, sizeof(struct DuContext) );
+    struct DirectoryEntry entry;
+    char normalized[MAX_PATH_LENGTH];
+    struct DuNode root;
+    struct DuNode **all = NULL;
+    size_t total = 0;
+    size_t i = 0;
+    int t = 0;
+    
+    if( du == NULL )
+    {
+        return;
+    }
+    
+    if( NormalizePath( session->current_path, path, normalized ) == -1 || ResolvePath( volume, session->current_path, normalized, &entry ) == -1 ||
+            !( entry.DIR_Attr & ATTR_DIRECTORY ) )
+    {
+        printf("%s: No such directory.\n",path);
+        free( du );
+        return;
+    }
+    
+    memset( &root, 0, sizeof(root) );
+    root.path = normalized;
+    int errors = WalkTree( volume, DirectoryCluster( volume, &entry ), normalized, &root, DuVisit, du );
+    
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        total += du->count[t];
+    }
+    all = malloc( ( total + 1 ) * sizeof(struct DuNode *) );
+    total = 0;
+    if( all != NULL )
+    {
+        all[total++] = &root;
+    }
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        for( i = 0; i < du->count[t]; i++ )
+        {
+            if( all != NULL )
+            {
+                all[total++] = du->nodes[t][i];
+            }
+        }
+    }
+    
+    if( all != NULL )
+    {
+        qsort( all, total, sizeof(struct DuNode *), CompareDuNodes );
+        for( i = 0; i < total; i++ )
+        {
+            printf("%12llu %8llu %s\n",(unsigned long long)atomic_load( &all[i]->bytes ),
+                        (unsigned long long)atomic_load( &all[i]->files ),all[i]->path);
+        }
+    }
+    if( errors != 0 )
+    {
+        printf("Error: %d director%s could not be read\n",errors,errors == 1 ? "y" : "ies");
+    }
+    
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        for( i = 0; i < du->count[t]; i++ )
+        {
+            free( du->nodes[t][i]->path );
+            free( du->nodes[t][i] );
+        }
+        free( du->nodes[t] );
+    }
+    free( all );
+    free( du );
+}
+
+
+//One file to extract in a bulk extraction
+
+struct ExtractJob
+{
+    char *target; //Host path to create
+    struct DirectoryEntry entry;
+};
+
+struct ExtractList
+{
+    struct ExtractJob *jobs;
+    size_t count;
+    size_t capacity;
+};
+
+static int ExtractListAdd( struct ExtractList *list, const char *target, const struct DirectoryEntry *entry )
+{
+    if( list->count == list->capacity )
+    {
+        size_t capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+        struct ExtractJob *grown = realloc( list->jobs, capacity * sizeof(struct ExtractJob) );
+        if( grown == NULL )
+        {
+            return -1;
+        }
+        list->jobs = grown;
+        list->capacity = capacity;
+    }
+    if( ( list->jobs[list->count].target = strdup( target ) ) == NULL )
+    {
+        return -1;
+    }
+    list->jobs[list->count].entry = *entry;
+    list->count++;
+    return 0;
+}
+
+
+//State shared by the mget enumeration and its worker pool
+
+struct MgetContext
+{
+    struct Volume *volume;
+    const char *destination; //Host directory the tree is recreated under
+    size_t strip; //Leading characters of image paths dropped when building host paths
+    struct ExtractList files[MAX_WALK_THREADS]; //Per walker thread
+    struct ExtractList directories[MAX_WALK_THREADS];
+    atomic_int errors;
+    
+    struct ExtractJob *jobs; //All files, merged after enumeration
+    size_t job_count;
+    size_t next_job; //Next job to hand out, guarded by lock
+    uint64_t in_flight; //Bytes of the batches being extracted, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t budget; //Signalled when in-flight bytes are released
+    _Atomic uint64_t bytes_done;
+    atomic_int files_done;
+};
+
+
+//Host path for an image path: destination plus the image path without its stripped prefix.
+//Returns NULL if the path has a . or .. component, which would put the target outside destination.
+
+static char * MgetTarget( const struct MgetContext *mget, const char *path )
+{
+    const char *relative = strlen( path ) > mget->strip ? path + mget->strip : "";
+    const char *component = relative;
+    
+    while( *component != '\0' )
+    {
+        size_t length = strcspn( component, "/" );
+        
+        if( ( length == 1 && component[0] == '.' ) || ( length == 2 && component[0] == '.' && component[1] == '.' ) )
+        {
+            printf("Error: %s would be extracted outside %s\n",path,mget->destination);
+            return NULL;
+        }
+        component += length;
+        component += *component == '/';
+    }
+    
+    char *target = malloc( strlen( mget->destination ) + strlen( relative ) + 2 );
+    
+    if( target != NULL )
+    {
+        sprintf( target, "%s%s%s", mget->destination, relative[0] == '/' ? "" : "/", relative );
+    }
+    return target;
+}
+
+static char mget_skipped; //Returned for a skipped directory, so its whole subtree is skipped with it
+
+static void * MgetVisit( struct Walker *walker, int thread, void *parent, const char *path,
+                            const struct DirectoryEntry *entry )
+{
+    struct MgetContext *mget = walker->context;
+    
+    if( parent == &mget_skipped ) //Already reported with its directory
+    {
+        return &mget_skipped;
+    }
+    //The name would escape, or can't be, a host path component. The root has no name of its own.
+    if( strcmp( path, "/" ) != 0 && !HostSafeName( entry->DIR_Name ) )
+    {
+        printf("Error: %s has a name that can't be extracted, skipped\n",path);
+        atomic_fetch_add( &mget->errors, 1 );
+        return &mget_skipped;
+    }
+    
+    char *target = MgetTarget( mget, path );
+    
+    if( target == NULL ||
+            ExtractListAdd( entry->DIR_Attr & ATTR_DIRECTORY ? &mget->directories[thread] : &mget->files[thread],
+                                target, entry ) == -1 )
+    {
+        atomic_fetch_add( &mget->errors, 1 );
+        free( target );
+        return &mget_skipped;
+    }
+    free( target );
+    return NULL;
+}
+
+static int CompareExtractTargets( const void *a, const void *b )
+{
+    return strcmp( ( (const struct ExtractJob *)a )->target, ( (const struct ExtractJob *)b )->target );
+}
+
+
+//mget worker: claim a batch of files (one large file, or small files up to MGET_BATCH_BYTES),
+//wait until the batch fits in the in-flight byte budget, extract it, release the budget
+
+static void * MgetWorker( void *arg )
+{
+    struct MgetContext *mget = arg;
+    struct Volume *volume = mget->volume;
+    
+    while( 1 )
+    {
+        pthread_mutex_lock( &mget->lock );
+        size_t first = mget->next_job;
+        uint64_t batch_bytes = 0;
+        
+        while( mget->next_job < mget->job_count &&
+                ( mget->next_job == first ||
+                  ( batch_bytes + mget->jobs[mget->next_job].entry.DIR_FileSize <= MGET_BATCH_BYTES &&
+                    mget->next_job - first < MGET_BATCH_FILES ) ) )
+        {
+            batch_bytes += mget->jobs[mget->next_job].entry.DIR_FileSize;
+            mget->next_job++;
+        }
+        size_t last = mget->next_job;
+        
+        if( first == last )
+        {
+            pthread_mutex_unlock( &mget->lock );
+            break;
+        }
+        
+        uint64_t cost = batch_bytes < MGET_INFLIGHT_BYTES ? batch_bytes : MGET_INFLIGHT_BYTES;
+        while( mget->in_flight > 0 && mget->in_flight + cost > MGET_INFLIGHT_BYTES )
+        {
+            pthread_cond_wait( &mget->budget, &mget->lock );
+        }
+        mget->in_flight += cost;
+        pthread_mutex_unlock( &mget->lock );
+        
+        size_t i = 0;
+        for( i = first; i < last; i++ )
+        {
+            if( ExtractFile( volume, &mget->jobs[i].entry, mget->jobs[i].target ) == -1 )
+            {
+                printf("Error: Unable to extract %s\n",mget->jobs[i].target);
+                atomic_fetch_add( &mget->errors, 1 );
+            }
+            else
+            {
+                atomic_fetch_add( &mget->bytes_done, mget->jobs[i].entry.DIR_FileSize );
+                atomic_fetch_add( &mget->files_done, 1 );
+            }
+        }
+        
+        pthread_mutex_lock( &mget->lock );
+        mget->in_flight -= cost;
+        pthread_cond_broadcast( &mget->budget );
+        pthread_mutex_unlock( &mget->lock );
+    }
+    
+    return NULL;
+}
+
+
+//Enumerate one matched directory into the mget lists, the directory itself included
+
+static void MgetDirectory( struct MgetContext *mget, const char *path, const struct DirectoryEntry *entry )
+{
+    struct Volume *volume = mget->volume;
+    if( MgetVisit( &(struct Walker){ .context = mget }, 0, NULL, path, entry ) == &mget_skipped )
+    {
+        return;
+    }
+    
+    int errors = WalkTree( volume, DirectoryCluster( volume, entry ), path, NULL, MgetVisit, mget );
+    if( errors != 0 )
+    {
+        atomic_fetch_add( &mget->errors, errors < 0 ? 1 : errors );
+    }
+}
+
+
+//mget: recreate a directory tree, or every file and directory matching a glob in one directory,
+//under destination on the host. Directories are created first, then the files are extracted by a
+//pool of WalkThreadCount() threads with at most MGET_INFLIGHT_BYTES of file data in flight.
+
+void MgetCommand( struct Session *session, const char *source, const char *destination )
+{
+    struct Volume *volume = session->volume;
+    struct MgetContext *mget = calloc( 1, sizeof(struct MgetContext) );
+    char normalized[MAX_PATH_LENGTH];
+    struct DirectoryEntry entry;
+    struct timespec start, end;
+    size_t i = 0;
+    int t = 0;
+    
+    if( mget == NULL )
+    {
+        return;
+    }
+    mget->volume = volume;
+    mget->destination = destination;
+    pthread_mutex_init( &mget->lock, NULL );
+    pthread_cond_init( &mget->budget, NULL );
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    
+    //Enumerate. Host paths keep the last component of the source, so mget SUB creates ./SUB/...
+    
+    if( strpbrk( source, "*?[" ) == NULL )
+    {
+        if( NormalizePath( session->current_path, source, normalized ) == -1 || ResolvePath( volume, session->current_path, normalized, &entry ) == -1 )
+        {
+            printf("Error: File not found\n");
+            atomic_fetch_add( &mget->errors, 1 );
+        }
+        else
+        {
+            mget->strip = strrchr( normalized, '/' ) - normalized;
+            if( entry.DIR_Attr & ATTR_DIRECTORY )
+            {
+                MgetDirectory( mget, normalized, &entry );
+            }
+            else
+            {
+                MgetVisit( &(struct Walker){ .context = mget }, 0, NULL, normalized, &entry );
+            }
+        }
+    }
+    else
+    {
+        //Glob: resolve the directory part, match the last component against its entries
+        char directory_path[MAX_PATH_LENGTH];
+        const char *slash = strrchr( source, '/' );
+        const char *pattern = slash != NULL ? slash + 1 : source;
+        
+        snprintf( directory_path, sizeof(directory_path), "%.*s", slash != NULL ? (int)( slash - source ) + 1 : 1,
+                        slash != NULL ? source : "." );
+        
+        struct Directory *directory = NULL;
+        if( NormalizePath( session->current_path, directory_path, normalized ) == -1 || ResolvePath( volume, session->current_path, normalized, &entry ) == -1 ||
+                !( entry.DIR_Attr & ATTR_DIRECTORY ) || ( directory = DirectoryAcquire( volume, DirectoryCluster( volume, &entry ) ) ) == NULL )
+        {
+            printf("%s: No such directory.\n",directory_path);
+            atomic_fetch_add( &mget->errors, 1 );
+        }
+        else
+        {
+            mget->strip = strcmp( normalized, "/" ) == 0 ? 0 : strlen( normalized );
+            
+            for( i = 0; i < directory->count; i++ )
+            {
+                const struct DirectoryEntry *match = &directory->entries[i];
+                char name[13];
+                char path[MAX_PATH_LENGTH];
+                
+                if( match->DIR_Name[0] == '\xE5' || match->DIR_Name[0] == '.' ||
+                        ( match->DIR_Attr & ATTR_LONG_NAME ) == ATTR_LONG_NAME || ( match->DIR_Attr & ATTR_VOLUME_ID ) )
+                {
+                    continue;
+                }
+                UnpackName( match->DIR_Name, name );
+                if( fnmatch( pattern, name, FNM_CASEFOLD ) != 0 )
+                {
+                    continue;
+                }
+                
+                snprintf( path, sizeof(path), "%s/%s", strcmp( normalized, "/" ) == 0 ? "" : normalized, name );
+                if( match->DIR_Attr & ATTR_DIRECTORY )
+                {
+                    MgetDirectory( mget, path, match );
+                }
+                else
+                {
+                    MgetVisit( &(struct Walker){ .context = mget }, 0, NULL, path, match );
+                }
+            }
+            DirectoryRelease( volume, directory );
+        }
+    }
+    
+    //Create the host directories, parents sort before their children
+    
+    struct ExtractList directories = { NULL, 0, 0 };
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        for( i = 0; i < mget->directories[t].count; i++ )
+        {
+            ExtractListAdd( &directories, mget->directories[t].jobs[i].target, &mget->directories[t].jobs[i].entry );
+            free( mget->directories[t].jobs[i].target );
+        }
+        free( mget->directories[t].jobs );
+    }
+    if( directories.count > 0 )
+    {
+        qsort( directories.jobs, directories.count, sizeof(struct ExtractJob), CompareExtractTargets );
+    }
+    for( i = 0; i < directories.count; i++ )
+    {
+        if( mkdir( directories.jobs[i].target, 0755 ) == -1 && errno != EEXIST )
+        {
+            printf("Error: Unable to create %s\n",directories.jobs[i].target);
+            atomic_fetch_add( &mget->errors, 1 );
+        }
+        free( directories.jobs[i].target );
+    }
+    free( directories.jobs );
+    
+    //Merge the per-thread file lists
+    
+    size_t total = 0;
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        total += mget->files[t].count;
+    }
+    mget->jobs = malloc( ( total + 1 ) * sizeof(struct ExtractJob) );
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        if( mget->jobs != NULL && mget->files[t].count > 0 )
+        {
+            memcpy( &mget->jobs[mget->job_count], mget->files[t].jobs, mget->files[t].count * sizeof(struct ExtractJob) );
+            mget->job_count += mget->files[t].count;
+        }
+        else
+        {
+            for( i = 0; i < mget->files[t].count; i++ )
+            {
+                free( mget->files[t].jobs[i].target );
+            }
+        }
+        free( mget->files[t].jobs );
+    }
+    
+    //Extract
+    
+    int thread_count = WalkThreadCount();
+    pthread_t ids[MAX_WALK_THREADS];
+    int started = 0;
+    
+    for( t = 1; t < thread_count; t++ )
+    {
+        if( pthread_create( &ids[started], NULL, MgetWorker, mget ) != 0 )
+        {
+            break;
+        }
+        started++;
+    }
+    MgetWorker( mget );
+    for( t = 0; t < started; t++ )
+    {
+        pthread_join( ids[t], NULL );
+    }
+    
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    double seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+    uint64_t bytes = atomic_load( &mget->bytes_done );
+    
+    if( mget->job_count > 0 || atomic_load( &mget->errors ) == 0 ) //Otherwise nothing matched and that's been reported
+    {
+        printf("Extracted %d file(s), %llu bytes in %.3f s (%.1f MB/s)\n",atomic_load( &mget->files_done ),
+                    (unsigned long long)bytes,seconds,seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+        if( atomic_load( &mget->errors ) != 0 )
+        {
+            printf("Error: %d file(s) or director%s could not be extracted\n",atomic_load( &mget->errors ),
+                        atomic_load( &mget->errors ) == 1 ? "y" : "ies");
+        }
+    }
+    
+    for( i = 0; i < mget->job_count; i++ )
+    {
+        free( mget->jobs[i].target );
+    }
+    free( mget->jobs );
+    pthread_mutex_destroy( &mget->lock );
+    pthread_cond_destroy( &mget->budget );
+    free( mget );
+}
+
+
+//A cluster reached by more than one chain, and the chains found holding it
+struct FsckConflict
+{
+    uint32_t cluster;
+    char *owners[FSCK_OWNERS];
+    int owner_count;
+};
+
+struct FsckContext
+{
+    struct Volume *volume;
+    _Atomic uint64_t *owned; //One bit per cluster, set by the first chain to reach it
+    uint32_t limit; //First cluster number past the end of the volume
+    struct PathList problems[MAX_WALK_THREADS]; //Per thread, formatted messages
+    struct PathList cross_links[MAX_WALK_THREADS]; //Per thread, "cluster path" of chains that ran into an owned cluster
+    atomic_int files;
+    atomic_int directories;
+    atomic_int errors; //Messages that could not be recorded
+    struct FsckConflict *conflicts; //Second pass: sorted by cluster
+    size_t conflict_count;
+    pthread_mutex_t lock; //Guards conflict owners in the second pass
+};
+
+
+static void FsckProblem( struct FsckContext *fsck, int thread, const char *format, ... ) __attribute__((format(printf,3,4)));
+
+static void FsckProblem( struct FsckContext *fsck, int thread, const char *format, ... )
+{
+    char message[MAX_PATH_LENGTH + 128];
+    va_list args;
+    
+    va_start( args, format );
+    vsnprintf( message, sizeof(message), format, args );
+    va_end( args );
+    if( PathListAdd( &fsck->problems[thread], message ) == -1 )
+    {
+        atomic_fetch_add( &fsck->errors, 1 );
+    }
+}
+
+
+//Return 1 if cluster is among the first hops clusters of the chain starting at first
+
+static int FsckInChain( struct Volume *volume, uint32_t first, uint32_t cluster, uint64_t hops )
+{
+    uint64_t i = 0;
+    
+    for( i = 0; i < hops; i++ )
+    {
+        if( first == cluster )
+        {
+            return 1;
+        }
+        first = volume->fat_table[first] & FAT_ENTRY_MASK;
+    }
+    return 0;
+}
+
+
+//Claim every cluster of one entry's chain. A chain stops at the first cluster another chain (or an
+//earlier hop of its own, a cycle) already owns, so every cluster is followed once and the whole
+//check stays proportional to the FAT.
+
+static void FsckChain( struct FsckContext *fsck, int thread, const char *path, const struct DirectoryEntry *entry )
+{
+    struct Volume *volume = fsck->volume;
+    uint32_t first = FirstCluster( entry );
+    uint32_t cluster = first;
+    uint64_t length = 0;
+    int complete = 0; //Chain ended in an end-of-chain marker
+    
+    if( first == 0 )
+    {
+        if( entry->DIR_FileSize > 0 && !( entry->DIR_Attr & ATTR_DIRECTORY ) )
+        {
+            FsckProblem( fsck, thread, "%s: size %u but no clusters", path, entry->DIR_FileSize );
+        }
+        else if( entry->DIR_Attr & ATTR_DIRECTORY )
+        {
+            FsckProblem( fsck, thread, "%s: directory without clusters", path );
+        }
+        return;
+    }
+    
+    while( 1 )
+    {
+        if( cluster < 2 || cluster >= fsck->limit )
+        {
+            FsckProblem( fsck, thread, "%s: chain points outside the volume (cluster %u after %llu)", path,
+                            cluster, (unsigned long long)length );
+            break;
+        }
+        
+        uint64_t bit = 1ULL << ( cluster % 64 );
+        if( atomic_fetch_or( &fsck->owned[cluster / 64], bit ) & bit )
+        {
+            if( FsckInChain( volume, first, cluster, length ) )
+            {
+                FsckProblem( fsck, thread, "%s: chain loops back to cluster %u after %llu clusters", path,
+                                cluster, (unsigned long long)length );
+            }
+            else
+            {
+                char record[MAX_PATH_LENGTH + 16];
+                snprintf( record, sizeof(record), "%u %s", cluster, path );
+                if( PathListAdd( &fsck->cross_links[thread], record ) == -1 )
+                {
+                    atomic_fetch_add( &fsck->errors, 1 );
+                }
+            }
+            return; //The rest of the chain belongs to someone else, its length is unknown
+        }
+        length++;
+        
+        uint32_t next = volume->fat_table[cluster] & FAT_ENTRY_MASK;
+        if( next >= FAT_EOC )
+        {
+            complete = 1;
+            break;
+        }
+        if( next == 0 || next == 1 || next >= 0x0FFFFFF0 )
+        {
+            FsckProblem( fsck, thread, "%s: chain ends in a %s entry at cluster %u", path,
+                            next == 0 ? "free" : next == FAT_BAD_CLUSTER ? "bad cluster" : "reserved", cluster );
+            break;
+        }
+        cluster = next;
+    }
+    
+    if( complete && !( entry->DIR_Attr & ATTR_DIRECTORY ) )
+    {
+        uint64_t needed = ( (uint64_t)entry->DIR_FileSize + volume->cluster_size - 1 ) / volume->cluster_size;
+        
+        if( length != needed )
+        {
+            FsckProblem( fsck, thread, "%s: chain has %llu clusters, size %u needs %llu", path,
+                            (unsigned long long)length, entry->DIR_FileSize, (unsigned long long)needed );
+        }
+    }
+}
+
+
+static void * FsckVisit( struct Walker *walker, int thread, void *parent, const char *path,
+                            const struct DirectoryEntry *entry )
+{
+    struct FsckContext *fsck = walker->context;
+    
+    (void)parent;
+    atomic_fetch_add( entry->DIR_Attr & ATTR_DIRECTORY ? &fsck->directories : &fsck->files, 1 );
+    FsckChain( fsck, thread, path, entry );
+    return NULL;
+}
+
+
+static int CompareConflicts( const void *a, const void *b )
+{
+    uint32_t x = ( (const struct FsckConflict *)a )->cluster;
+    uint32_t y = ( (const struct FsckConflict *)b )->cluster;
+    return x < y ? -1 : x > y;
+}
+
+
+static void FsckAddOwner( struct FsckConflict *conflict, const char *path )
+{
+    int i = 0;
+    
+    for( i = 0; i < conflict->owner_count; i++ )
+    {
+        if( strcmp( conflict->owners[i], path ) == 0 )
+        {
+            return;
+        }
+    }
+    if( conflict->owner_count < FSCK_OWNERS && ( conflict->owners[conflict->owner_count] = strdup( path ) ) != NULL )
+    {
+        conflict->owner_count++;
+    }
+}
+
+
+//Second pass, only run when chains collided: name every chain holding a cross-linked cluster.
+//Chains are cut off after limit hops so a cycle cannot hold a walker.
+
+static void * FsckOwnerVisit( struct Walker *walker, int thread, void *parent, const char *path,
+                                const struct DirectoryEntry *entry )
+{
+    struct Volume *volume = walker->volume;
+    struct FsckContext *fsck = walker->context;
+    uint32_t cluster = FirstCluster( entry );
+    uint32_t hops = 0;
+    
+    (void)thread;
+    (void)parent;
+    while( cluster >= 2 && cluster < fsck->limit && hops++ < fsck->limit )
+    {
+        struct FsckConflict key = { .cluster = cluster };
+        struct FsckConflict *conflict = bsearch( &key, fsck->conflicts, fsck->conflict_count,
+                                                    sizeof(struct FsckConflict), CompareConflicts );
+        if( conflict != NULL )
+        {
+            pthread_mutex_lock( &fsck->lock );
+            FsckAddOwner( conflict, path );
+            pthread_mutex_unlock( &fsck->lock );
+        }
+        
+        uint32_t next = volume->fat_table[cluster] & FAT_ENTRY_MASK;
+        if( next == cluster )
+        {
+            break;
+        }
+        cluster = next;
+    }
+    return NULL;
+}
+
+
+//Print the messages of one kind, sorted, at most FSCK_REPORT_LIMIT of them
+
+static void FsckPrint( struct PathList *list )
+{
+    size_t i = 0;
+    
+    if( list->count > 0 ) //An empty list never allocated its array
+    {
+        qsort( list->paths, list->count, sizeof(char *), ComparePaths );
+    }
+    for( i = 0; i < list->count; i++ )
+    {
+        if( i < FSCK_REPORT_LIMIT )
+        {
+            printf("%s\n",list->paths[i]);
+        }
+        free( list->paths[i] );
+    }
+    if( list->count > FSCK_REPORT_LIMIT )
+    {
+        printf("... and %zu more\n",list->count - FSCK_REPORT_LIMIT);
+    }
+    free( list->paths );
+    memset( list, 0, sizeof(struct PathList) );
+}
+
+
+//fsck: read-only consistency check of the open image. Every entry's chain is claimed in a shared
+//atomic bitset by the parallel tree walker; cross-links, cycles, broken chains and size mismatches
+//fall out of that walk. Used clusters nobody claimed are lost chains, and every FAT copy is compared
+//with the first. Returns the number of problems found.
+
+int FsckCommand( struct Session *session )
+{
+    struct Volume *volume = session->volume;
+    struct FsckContext *fsck = calloc( 1, sizeof(struct FsckContext) );
+    struct DirectoryEntry root;
+    struct PathList merged = { NULL, 0, 0 };
+    uint64_t problems = 0;
+    uint32_t cluster = 0;
+    int t = 0;
+    size_t i = 0;
+    
+    if( fsck == NULL )
+    {
+        printf("Error: Out of memory\n");
+        return -1;
+    }
+    fsck->volume = volume;
+    fsck->limit = ClusterCount(volume) + 2;
+    fsck->owned = calloc( fsck->limit / 64 + 1, sizeof(uint64_t) );
+    pthread_mutex_init( &fsck->lock, NULL );
+    if( fsck->owned == NULL || ResolvePath( volume, session->current_path, "/", &root ) == -1 )
+    {
+        printf("Error: Out of memory\n");
+        free( fsck->owned );
+        free( fsck );
+        return -1;
+    }
+    
+    //Chains of the root directory and of everything below it
+    
+    FsckChain( fsck, 0, "/", &root );
+    if( WalkTree( volume, volume->BPB_RootClus, "/", NULL, FsckVisit, fsck ) != 0 )
+    {
+        PathListAdd( &fsck->problems[0], "Some directories could not be read" );
+    }
+    
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        for( i = 0; i < fsck->problems[t].count; i++ )
+        {
+            PathListAdd( &merged, fsck->problems[t].paths[i] );
+            free( fsck->problems[t].paths[i] );
+        }
+        free( fsck->problems[t].paths );
+        fsck->conflict_count += fsck->cross_links[t].count;
+    }
+    problems += merged.count;
+    FsckPrint( &merged );
+    
+    //Cross-links: collect the distinct clusters, then find every chain holding them
+    
+    if( fsck->conflict_count > 0 && ( fsck->conflicts = calloc( fsck->conflict_count, sizeof(struct FsckConflict) ) ) != NULL )
+    {
+        size_t n = 0;
+        
+        for( t = 0; t < MAX_WALK_THREADS; t++ )
+        {
+            for( i = 0; i < fsck->cross_links[t].count; i++ )
+            {
+                fsck->conflicts[n++].cluster = strtoul( fsck->cross_links[t].paths[i], NULL, 10 );
+            }
+        }
+        qsort( fsck->conflicts, n, sizeof(struct FsckConflict), CompareConflicts );
+        fsck->conflict_count = 0;
+        for( i = 0; i < n; i++ )
+        {
+            if( fsck->conflict_count == 0 || fsck->conflicts[fsck->conflict_count - 1].cluster != fsck->conflicts[i].cluster )
+            {
+                fsck->conflicts[fsck->conflict_count++] = fsck->conflicts[i];
+            }
+        }
+        
+        FsckOwnerVisit( &(struct Walker){ .context = fsck }, 0, NULL, "/", &root );
+        WalkTree( volume, volume->BPB_RootClus, "/", NULL, FsckOwnerVisit, fsck );
+        
+        for( i = 0; i < fsck->conflict_count; i++ )
+        {
+            struct FsckConflict *conflict = &fsck->conflicts[i];
+            char message[FSCK_OWNERS * 256 + 64];
+            int length = snprintf( message, sizeof(message), "Cross-linked cluster %u:", conflict->cluster );
+            int k = 0;
+            
+            for( k = 0; k < conflict->owner_count; k++ )
+            {
+                if( length < (int)sizeof(message) )
+                {
+                    length += snprintf( message + length, sizeof(message) - length, " %s", conflict->owners[k] );
+                }
+                free( conflict->owners[k] );
+            }
+            PathListAdd( &merged, message );
+        }
+        problems += merged.count;
+        FsckPrint( &merged );
+        free( fsck->conflicts );
+    }
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        for( i = 0; i < fsck->cross_links[t].count; i++ )
+        {
+            free( fsck->cross_links[t].paths[i] );
+        }
+        free( fsck->cross_links[t].paths );
+    }
+    
+    //Lost chains: allocated in the FAT but claimed by no entry. A lost cluster no other lost cluster
+    //points at starts a lost chain.
+    
+    uint64_t lost_clusters = 0;
+    uint64_t lost_chains = 0;
+    _Atomic uint64_t *pointed = calloc( fsck->limit / 64 + 1, sizeof(uint64_t) );
+    
+    for( cluster = 2; cluster < fsck->limit; cluster++ )
+    {
+        uint32_t value = volume->fat_table[cluster] & FAT_ENTRY_MASK;
+        int allocated = value != 0 && value != 1 && ( value < 0x0FFFFFF0 || value >= FAT_EOC );
+        
+        if( allocated && !( fsck->owned[cluster / 64] & ( 1ULL << ( cluster % 64 ) ) ) )
+        {
+            lost_clusters++;
+            if( pointed != NULL && value >= 2 && value < fsck->limit )
+            {
+                pointed[value / 64] |= 1ULL << ( value % 64 );
+            }
+        }
+    }
+    if( lost_clusters > 0 )
+    {
+        for( cluster = 2; cluster < fsck->limit && pointed != NULL; cluster++ )
+        {
+            uint32_t value = volume->fat_table[cluster] & FAT_ENTRY_MASK;
+            int allocated = value != 0 && value != 1 && ( value < 0x0FFFFFF0 || value >= FAT_EOC );
+            
+            if( allocated && !( fsck->owned[cluster / 64] & ( 1ULL << ( cluster % 64 ) ) ) &&
+                    !( pointed[cluster / 64] & ( 1ULL << ( cluster % 64 ) ) ) )
+            {
+                lost_chains++;
+            }
+        }
+        printf("Lost: %llu cluster(s) in %llu chain(s) not reachable from any directory\n",
+                    (unsigned long long)lost_clusters,(unsigned long long)lost_chains);
+        problems++;
+    }
+    free( pointed );
+    
+    //FAT copies: compare each with the first, a chunk at a time
+    
+    size_t fat_bytes = (size_t)volume->fat_entries * 4;
+    char *copy = malloc( EXTENT_CHUNK_SIZE );
+    for( t = 1; t < volume->BPB_NumFATs && copy != NULL; t++ )
+    {
+        off_t offset = ( (off_t)volume->BPB_RsvdSecCnt + (off_t)t * volume->BPB_FATSz32 ) * volume->BPB_BytsPerSec;
+        uint64_t differences = 0;
+        uint64_t first_difference = 0;
+        size_t done = 0;
+        
+        while( done < fat_bytes )
+        {
+            size_t chunk = fat_bytes - done < EXTENT_CHUNK_SIZE ? fat_bytes - done : EXTENT_CHUNK_SIZE;
+            
+            if( ImageRead( volume, copy, chunk, offset + done ) == -1 )
+            {
+                printf("FAT %d: unreadable\n",t + 1);
+                problems++;
+                break;
+            }
+            if( memcmp( copy, (char *)volume->fat_table + done, chunk ) != 0 )
+            {
+                for( i = 0; i < chunk / 4; i++ )
+                {
+                    if( memcmp( copy + i * 4, (char *)volume->fat_table + done + i * 4, 4 ) != 0 )
+                    {
+                        if( differences++ == 0 )
+                        {
+                            first_difference = done / 4 + i;
+                        }
+                    }
+                }
+            }
+            done += chunk;
+        }
+        if( differences > 0 )
+        {
+            printf("FAT %d differs from FAT 1 in %llu entries (first at cluster %llu)\n",t + 1,
+                        (unsigned long long)differences,(unsigned long long)first_difference);
+            problems++;
+        }
+    }
+    free( copy );
+    
+    printf("Checked %d file(s) and %d director%s\n",atomic_load( &fsck->files ),atomic_load( &fsck->directories ) + 1,
+                atomic_load( &fsck->directories ) == 0 ? "y" : "ies");
+    if( atomic_load( &fsck->errors ) > 0 )
+    {
+        printf("Error: %d problem(s) could not be recorded\n",atomic_load( &fsck->errors ));
+    }
+    if( problems == 0 )
+    {
+        printf("No problems found\n");
+    }
+    else
+    {
+        printf("%llu problem(s) found\n",(unsigned long long)problems);
+    }
+    
+    free( fsck->owned );
+    pthread_mutex_destroy( &fsck->lock );
+    free( fsck );
+    return (int)problems;
+}
+
+
+//Copy the host file source into the open image as name (a path whose directory must exist).
+//Clusters come from the best-fit free run allocator so the file is as contiguous as the free space
+//allows, and its data is written in extent-sized writes. The FAT changes are then written to every
+//FAT copy in one flush, followed by the directory entry and the FSInfo free count and next free hint.
+//Returns 0 on success, -1 on failure (a message has been printed).
+
+int PutCommand( struct Session *session, const char *source, const char *name )
+{
+    struct Volume *volume = session->volume;
+    char directory_path[MAX_PATH_LENGTH];
+    const char *base = strrchr( name, '/' ) != NULL ? strrchr( name, '/' ) + 1 : name;
+    struct DirectoryEntry parent;
+    struct DirectoryEntry entry;
+    struct stat source_stat;
+    struct Extent *extents = NULL; //Clusters of the file
+    struct Extent *grow = NULL; //Cluster added to a full directory
+    struct Extent *dirty = NULL; //FAT ranges to flush
+    uint32_t *saved = NULL; //Entries of the dirty ranges before the put, in the same order
+    int extent_count = 0;
+    int dirty_count = 0;
+    uint32_t slot = 0;
+    uint32_t directory_clusters = 0; //Length of the directory's chain
+    uint32_t last_directory_cluster = 0;
+    uint32_t clusters = 0;
+    char *buffer = NULL;
+    int source_fd = -1;
+    int status = -1;
+    int i = 0;
+    
+    if( ImageMakeWritable( volume ) == -1 )
+    {
+        printf("Error: File system image is read-only\n");
+        return -1;
+    }
+    
+    //Find the directory and a free slot in it
+    
+    snprintf( directory_path, sizeof(directory_path), "%.*s", (int)( base - name ), name );
+    if( directory_path[0] == '\0' )
+    {
+        strcpy( directory_path, "." );
+    }
+    if( !ValidShortName( base ) )
+    {
+        printf("Error: %s is not a valid 8.3 file name\n",base);
+        return -1;
+    }
+    if( ResolvePath( volume, session->current_path, directory_path, &parent ) == -1 || !( parent.DIR_Attr & ATTR_DIRECTORY ) )
+    {
+        printf("Error: Directory not found\n");
+        return -1;
+    }
+    
+    memset( &entry, 0, sizeof(struct DirectoryEntry) );
+    PackName( base, entry.DIR_Name );
+    entry.DIR_Attr = ATTR_ARCHIVE;
+    
+    uint32_t directory_cluster = DirectoryCluster( volume, &parent );
+    struct Directory *directory = DirectoryAcquire( volume, directory_cluster );
+    if( directory == NULL )
+    {
+        printf("Error: Unable to load the directory\n");
+        return -1;
+    }
+    int exists = DirectoryLookup( directory, entry.DIR_Name ) != DIR_NOT_FOUND;
+    while( slot < directory->count && directory->entries[slot].DIR_Name[0] != '\xE5' ) //Reuse a deleted entry if there is one
+    {
+        slot++;
+    }
+    uint32_t directory_count = directory->count;
+    DirectoryRelease( volume, directory );
+    
+    if( exists )
+    {
+        printf("Error: %s already exists\n",base);
+        return -1;
+    }
+    
+    for( last_directory_cluster = directory_cluster; ; last_directory_cluster = NextLB( volume, last_directory_cluster ) )
+    {
+        directory_clusters++;
+        if( IsEndOfChain( volume, NextLB( volume, last_directory_cluster ) ) || directory_clusters >= volume->fat_entries )
+        {
+            break;
+        }
+    }
+    int full = slot >= directory_clusters * ( volume->cluster_size / sizeof(struct DirectoryEntry) );
+    
+    //Size up the source and allocate
+    
+    if( ( source_fd = open( source, O_RDONLY ) ) == -1 || fstat( source_fd, &source_stat ) == -1 )
+    {
+        printf("Error: Unable to open %s\n",source);
+        goto done;
+    }
+    if( !S_ISREG( source_stat.st_mode ) || (uint64_t)source_stat.st_size > FAT_MAX_FILE_SIZE )
+    {
+        printf("Error: %s is not a regular file of at most 4 GiB\n",source);
+        goto done;
+    }
+    
+    clusters = ( (uint64_t)source_stat.st_size + volume->cluster_size - 1 ) / volume->cluster_size;
+    if( !volume->free_space.valid && FreeSpaceBuild(volume) == -1 )
+    {
+        printf("Error: Out of memory\n");
+        goto done;
+    }
+    if( (uint64_t)clusters + full > volume->free_space.total )
+    {
+        printf("Error: Not enough free space\n");
+        goto done;
+    }
+    if( ( clusters > 0 && ( extent_count = FreeSpaceAllocate( volume, clusters, &extents ) ) == -1 ) ||
+            ( full && FreeSpaceAllocate( volume, 1, &grow ) == -1 ) ||
+            ( dirty = calloc( extent_count + 2, sizeof(struct Extent) ) ) == NULL ||
+            ( saved = malloc( ( (size_t)clusters + 2 ) * sizeof(uint32_t) ) ) == NULL ||
+            ( buffer = malloc( EXTENT_CHUNK_SIZE > volume->cluster_size ? EXTENT_CHUNK_SIZE : volume->cluster_size ) ) == NULL )
+    {
+        printf("Error: Out of memory\n");
+        goto undo;
+    }
+    
+    //Data first, one extent at a time, the tail of the last cluster zero filled
+    
+    uint64_t remaining = source_stat.st_size;
+    size_t chunk_limit = EXTENT_CHUNK_SIZE > volume->cluster_size ? EXTENT_CHUNK_SIZE : volume->cluster_size;
+    for( i = 0; i < extent_count; i++ )
+    {
+        uint64_t extent_bytes = (uint64_t)extents[i].length * volume->cluster_size;
+        uint64_t done = 0;
+        
+        while( done < extent_bytes )
+        {
+            size_t chunk = extent_bytes - done < chunk_limit ? extent_bytes - done : chunk_limit;
+            size_t wanted = remaining < chunk ? remaining : chunk;
+            size_t have = 0;
+            
+            while( have < wanted )
+            {
+                ssize_t got = read( source_fd, buffer + have, wanted - have );
+                if( got == -1 && errno == EINTR )
+                {
+                    continue;
+                }
+                if( got <= 0 )
+                {
+                    printf("Error: Unable to read %s\n",source);
+                    goto undo;
+                }
+                have += got;
+            }
+            memset( buffer + have, 0, chunk - have );
+            
+            if( ImageWrite( volume, buffer, chunk, LBAToOffset( volume, extents[i].start_cluster ) + done ) == -1 )
+            {
+                printf("Error: Unable to write to the file system image\n");
+                goto undo;
+            }
+            done += chunk;
+            remaining -= have;
+        }
+    }
+    
+    if( full ) //The new directory cluster starts out as all end-of-directory markers
+    {
+        memset( buffer, 0, volume->cluster_size );
+        if( ImageWrite( volume, buffer, volume->cluster_size, LBAToOffset( volume, grow[0].start_cluster ) ) == -1 )
+        {
+            printf("Error: Unable to write to the file system image\n");
+            goto undo;
+        }
+    }
+    
+    //Chain the clusters in the cached FAT, then write the touched entries to every FAT copy.
+    //The entries they replace are saved first so a failed flush can be rolled back.
+    
+    uint32_t saved_count = 0;
+    for( i = 0; i < extent_count; i++ )
+    {
+        uint32_t cluster = 0;
+        
+        for( cluster = extents[i].start_cluster; cluster < extents[i].start_cluster + extents[i].length - 1; cluster++ )
+        {
+            saved[saved_count++] = volume->fat_table[cluster];
+            FATSetEntry( volume, cluster, cluster + 1 );
+        }
+        saved[saved_count++] = volume->fat_table[cluster];
+        FATSetEntry( volume, cluster, i + 1 < extent_count ? extents[i + 1].start_cluster : FAT_EOC_MARK );
+        dirty[dirty_count++] = extents[i];
+    }
+    if( full )
+    {
+        saved[saved_count++] = volume->fat_table[last_directory_cluster];
+        FATSetEntry( volume, last_directory_cluster, grow[0].start_cluster );
+        saved[saved_count++] = volume->fat_table[grow[0].start_cluster];
+        FATSetEntry( volume, grow[0].start_cluster, FAT_EOC_MARK );
+        dirty[dirty_count].start_cluster = last_directory_cluster;
+        dirty[dirty_count++].length = 1;
+        dirty[dirty_count++] = grow[0];
+    }
+    
+    if( FATFlush( volume, dirty, dirty_count ) == -1 )
+    {
+        printf("Error: Unable to write the file allocation table\n");
+        
+        //Put the cached entries back and try to undo whatever part of the flush reached the image
+        for( i = 0, saved_count = 0; i < dirty_count; i++ )
+        {
+            memcpy( &volume->fat_table[dirty[i].start_cluster], &saved[saved_count], (size_t)dirty[i].length * 4 );
+            saved_count += dirty[i].length;
+        }
+        if( FATFlush( volume, dirty, dirty_count ) == -1 )
+        {
+            printf("Error: The FAT copies on the image may be inconsistent, run fsck\n");
+        }
+        goto undo;
+    }
+    
+    //Then the directory entry, keeping an end-of-directory marker after it
+    
+    if( extent_count > 0 )
+    {
+        entry.DIR_FirstClusterHigh = extents[0].start_cluster >> 16;
+        entry.DIR_FirstClusterLow = extents[0].start_cluster & 0xFFFF;
+    }
+    entry.DIR_FileSize = source_stat.st_size;
+    
+    off_t slot_offset = DirectorySlotOffset( volume, directory_cluster, slot );
+    if( slot_offset == -1 || ImageWrite( volume, &entry, sizeof(struct DirectoryEntry), slot_offset ) == -1 )
+    {
+        printf("Error: Unable to write the directory entry\n");
+        goto done;
+    }
+    if( slot == directory_count )
+    {
+        struct DirectoryEntry end;
+        off_t end_offset = DirectorySlotOffset( volume, directory_cluster, slot + 1 );
+        
+        memset( &end, 0, sizeof(struct DirectoryEntry) );
+        if( end_offset != -1 )
+        {
+            ImageWrite( volume, &end, sizeof(struct DirectoryEntry), end_offset );
+        }
+    }
+    
+    //And last the FSInfo hints, when the volume keeps them
+    
+    unsigned char fsinfo[512];
+    if( volume->BPB_FSInfo != 0 && volume->BPB_FSInfo < volume->BPB_RsvdSecCnt &&
+            ImageRead( volume, fsinfo, sizeof(fsinfo), (off_t)volume->BPB_FSInfo * volume->BPB_BytsPerSec ) == 0 )
+    {
+        uint32_t signatures[2];
+        uint32_t hints[2]; //Free count, next free
+        
+        memcpy( &signatures[0], &fsinfo[0], 4 );
+        memcpy( &signatures[1], &fsinfo[484], 4 );
+        memcpy( hints, &fsinfo[488], 8 );
+        if( signatures[0] == FSINFO_LEAD_SIG && signatures[1] == FSINFO_STRUC_SIG )
+        {
+            uint32_t allocated = clusters + full;
+            uint32_t last = full ? grow[0].start_cluster :
+                                extent_count > 0 ? extents[extent_count - 1].start_cluster + extents[extent_count - 1].length - 1 : 0;
+            
+            if( hints[0] != FSINFO_UNKNOWN )
+            {
+                hints[0] = hints[0] > allocated ? hints[0] - allocated : 0;
+            }
+            if( allocated > 0 )
+            {
+                hints[1] = last + 1;
+            }
+            ImageWrite( volume, hints, 8, (off_t)volume->BPB_FSInfo * volume->BPB_BytsPerSec + 488 );
+        }
+    }
+    status = 0;
+    goto done;
+    
+undo:
+    volume->free_space.valid = 0; //The cached FAT is as it was, the free runs are rebuilt from it on the next allocation
+    
+done:
+    if( status == 0 || dirty_count > 0 )
+    {
+        //The directory, its paths and cluster indexes may all be out of date now
+        ClusterIndexFlush(volume);
+        DentryCacheFlush(volume);
+        ChangeDirectory( session, session->current_path );
+    }
+    if( source_fd != -1 )
+    {
+        close( source_fd );
+    }
+    free( buffer );
+    free( saved );
+    free( dirty );
+    free( grow );
+    free( extents );
+    return status;
+}
+
+
+//A chain considered by defrag: a file or directory and where its entry lives
+struct DefragItem
+{
+    char *path;
+    struct DirectoryEntry entry;
+    uint32_t parent; //First cluster of the directory holding the entry
+    int depth; //Components in path
+    int extent_count; //Before
+    uint32_t clusters;
+    uint64_t reads; //Extent reads needed to copy the chain out, before
+    int moved; //Relocated (or, in a dry run, would be)
+    int shared; //Holds a cluster another chain (or the chain itself, a cycle) also reaches, left in place
+};
+
+struct DefragList
+{
+    struct DefragItem *items;
+    size_t count;
+    size_t capacity;
+};
+
+struct DefragContext
+{
+    struct Volume *volume;
+    struct DefragList lists[MAX_WALK_THREADS]; //Per walker thread
+    atomic_int errors;
+    _Atomic uint64_t *owned; //One bit per cluster, set by the first chain of the whole image to reach it
+    _Atomic uint64_t *shared; //One bit per cluster reached by more than one chain, or twice by one
+};
+
+
+//Reads issued to copy out a chain made of these extents: one per extent, or per EXTENT_CHUNK_SIZE of it
+
+static uint64_t ExtentReads( struct Volume *volume, const struct Extent *extents, int count )
+{
+    uint64_t reads = 0;
+    int i = 0;
+    
+    for( i = 0; i < count; i++ )
+    {
+        reads += ( (uint64_t)extents[i].length * volume->cluster_size + EXTENT_CHUNK_SIZE - 1 ) / EXTENT_CHUNK_SIZE;
+    }
+    return reads;
+}
+
+static int DefragListAdd( struct DefragList *list, const char *path, const struct DirectoryEntry *entry, uint32_t parent )
+{
+    const char *c = path;
+    
+    if( list->count == list->capacity )
+    {
+        size_t capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+        struct DefragItem *grown = realloc( list->items, capacity * sizeof(struct DefragItem) );
+        if( grown == NULL )
+        {
+            return -1;
+        }
+        list->items = grown;
+        list->capacity = capacity;
+    }
+    
+    struct DefragItem *item = &list->items[list->count];
+    memset( item, 0, sizeof(struct DefragItem) );
+    if( ( item->path = strdup( path ) ) == NULL )
+    {
+        return -1;
+    }
+    item->entry = *entry;
+    item->parent = parent;
+    for( ; *c != '\0'; c++ )
+    {
+        item->depth += *c == '/';
+    }
+    list->count++;
+    return 0;
+}
+
+//Directories hand their own first cluster down as the parent of the entries inside them
+
+static void * DefragVisit( struct Walker *walker, int thread, void *parent, const char *path,
+                            const struct DirectoryEntry *entry )
+{
+    struct DefragContext *defrag = walker->context;
+    
+    if( DefragListAdd( &defrag->lists[thread], path, entry, (uint32_t)(uintptr_t)parent ) == -1 )
+    {
+        atomic_fetch_add( &defrag->errors, 1 );
+    }
+    return (void *)(uintptr_t)FirstCluster( entry );
+}
+
+//Claim the clusters of one chain. As in fsck, a chain stops at the first cluster already owned; that
+//cluster is marked shared, and DefragMarkShared extends the mark over the rest of the chain from there.
+
+static void DefragClaim( struct DefragContext *defrag, const struct DirectoryEntry *entry )
+{
+    struct Volume *volume = defrag->volume;
+    uint32_t cluster = FirstCluster( entry );
+    
+    while( !IsEndOfChain( volume, cluster ) )
+    {
+        uint64_t bit = 1ULL << ( cluster % 64 );
+        
+        if( atomic_fetch_or( &defrag->owned[cluster / 64], bit ) & bit )
+        {
+            atomic_fetch_or( &defrag->shared[cluster / 64], bit );
+            return;
+        }
+        cluster = NextLB( volume, cluster );
+    }
+}
+
+
+static void * DefragClaimVisit( struct Walker *walker, int thread, void *parent, const char *path,
+                                const struct DirectoryEntry *entry )
+{
+    (void)thread;
+    (void)parent;
+    (void)path;
+    DefragClaim( walker->context, entry );
+    return NULL;
+}
+
+
+//Find every cluster more than one chain of the whole image reaches. Every chain is claimed, then each
+//shared cluster passes the mark down its chain: a cluster reached twice has every cluster after it
+//reached twice too. Chains outside the defragmented path count, a move must not free their clusters.
+//Returns 0 on success, -1 if some directory could not be read or on allocation failure.
+
+static int DefragMarkShared( struct DefragContext *defrag )
+{
+    struct Volume *volume = defrag->volume;
+    struct DirectoryEntry root;
+    size_t words = volume->fat_entries / 64 + 1;
+    uint32_t cluster = 0;
+    
+    if( ( defrag->owned = calloc( words, sizeof(uint64_t) ) ) == NULL ||
+            ( defrag->shared = calloc( words, sizeof(uint64_t) ) ) == NULL || ResolvePath( volume, "/", "/", &root ) == -1 )
+    {
+        return -1;
+    }
+    
+    DefragClaim( defrag, &root );
+    if( WalkTree( volume, volume->BPB_RootClus, "/", NULL, DefragClaimVisit, defrag ) != 0 )
+    {
+        return -1;
+    }
+    
+    for( cluster = 2; cluster < volume->fat_entries; cluster++ )
+    {
+        uint32_t next = cluster;
+        
+        if( !( defrag->shared[cluster / 64] & ( 1ULL << ( cluster % 64 ) ) ) )
+        {
+            continue;
+        }
+        //Stops at a cluster already marked, whose own chain has been or will be marked from there
+        while( !IsEndOfChain( volume, next = NextLB( volume, next ) ) &&
+                !( atomic_fetch_or( &defrag->shared[next / 64], 1ULL << ( next % 64 ) ) & ( 1ULL << ( next % 64 ) ) ) );
+    }
+    return 0;
+}
+
+
+//Return 1 if any cluster of the extents is shared
+
+static int DefragShared( const struct DefragContext *defrag, const struct Extent *extents, int count )
+{
+    uint32_t cluster = 0;
+    int i = 0;
+    
+    for( i = 0; i < count; i++ )
+    {
+        for( cluster = extents[i].start_cluster; cluster < extents[i].start_cluster + extents[i].length; cluster++ )
+        {
+            if( defrag->shared[cluster / 64] & ( 1ULL << ( cluster % 64 ) ) )
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+//Deepest first, so every directory holding an entry still sits where the walk found it
+//when the entry is rewritten
+
+static int CompareDefragDepth( const void *a, const void *b )
+{
+    const struct DefragItem *x = a;
+    const struct DefragItem *y = b;
+    
+    return x->depth != y->depth ? y->depth - x->depth : strcmp( x->path, y->path );
+}
+
+static int CompareDefragPaths( const void *a, const void *b )
+{
+    return strcmp( ( (const struct DefragItem *)a )->path, ( (const struct DefragItem *)b )->path );
+}
+
+
+//Point the entry named by an item at a new first cluster. When the item is a directory, its own
+//"." entry and the ".." entries of its sub-directories are repointed too. Returns 0 on success, -1 on failure.
+
+static int DefragRepoint( struct Volume *volume, const struct DefragItem *item, uint32_t cluster )
+{
+    struct Directory directory;
+    struct DirectoryEntry entry;
+    uint32_t i = 0;
+    int status = 0;
+    
+    if( LoadDirectory( volume, item->parent, &directory ) == -1 )
+    {
+        return -1;
+    }
+    int position = DirectoryLookup( &directory, item->entry.DIR_Name );
+    off_t offset = position == DIR_NOT_FOUND ? -1 : DirectorySlotOffset( volume, item->parent, position );
+    if( offset != -1 )
+    {
+        entry = directory.entries[position];
+        entry.DIR_FirstClusterHigh = cluster >> 16;
+        entry.DIR_FirstClusterLow = cluster & 0xFFFF;
+    }
+    FreeDirectory( &directory );
+    if( offset == -1 || ImageWrite( volume, &entry, sizeof(entry), offset ) == -1 )
+    {
+        return -1;
+    }
+    
+    if( !( item->entry.DIR_Attr & ATTR_DIRECTORY ) )
+    {
+        return 0;
+    }
+    
+    if( LoadDirectory( volume, cluster, &directory ) == -1 )
+    {
+        return -1;
+    }
+    for( i = 0; i < directory.count && status == 0; i++ )
+    {
+        struct DirectoryEntry *child = &directory.entries[i];
+        
+        if( child->DIR_Name[0] == '\xE5' || ( child->DIR_Attr & ATTR_LONG_NAME ) == ATTR_LONG_NAME ||
+                !( child->DIR_Attr & ATTR_DIRECTORY ) )
+        {
+            continue;
+        }
+        
+        if( memcmp( child->DIR_Name, ".          ", 11 ) == 0 ) //The directory itself
+        {
+            offset = DirectorySlotOffset( volume, cluster, i );
+            entry = *child;
+        }
+        else if( child->DIR_Name[0] == '.' || IsEndOfChain( volume, FirstCluster( child ) ) )
+        {
+            continue;
+        }
+        else if( ( offset = DirectorySlotOffset( volume, FirstCluster( child ), 1 ) ) == -1 ||
+                    ImageRead( volume, &entry, sizeof(entry), offset ) == -1 ||
+                    memcmp( entry.DIR_Name, "..         ", 11 ) != 0 )
+        {
+            continue; //Not a well formed sub-directory, nothing to repoint
+        }
+        
+        entry.DIR_FirstClusterHigh = cluster >> 16;
+        entry.DIR_FirstClusterLow = cluster & 0xFFFF;
+        if( offset == -1 || ImageWrite( volume, &entry, sizeof(entry), offset ) == -1 )
+        {
+            status = -1;
+        }
+    }
+    FreeDirectory( &directory );
+    return status;
+}
+
+
+//Copy a chain into the contiguous run target and switch it over: the new chain goes into every FAT
+//copy, then the directory entry is repointed, then the old clusters are freed. A crash part way
+//leaves at worst a lost chain, never a damaged file. Returns 0 on success, -1 on failure.
+
+static int DefragMove( struct Volume *volume, const struct DefragItem *item, const struct Extent *extents, int extent_count,
+                        const struct Extent *target, char *buffer )
+{
+    uint64_t written = 0;
+    uint32_t cluster = 0;
+    int i = 0;
+    
+    for( i = 0; i < extent_count; i++ )
+    {
+        uint64_t bytes = (uint64_t)extents[i].length * volume->cluster_size;
+        uint64_t done = 0;
+        
+        while( done < bytes )
+        {
+            size_t chunk = bytes - done < EXTENT_CHUNK_SIZE ? bytes - done : EXTENT_CHUNK_SIZE;
+            
+            if( ImageRead( volume, buffer, chunk, LBAToOffset( volume, extents[i].start_cluster ) + done ) == -1 ||
+                    ImageWrite( volume, buffer, chunk, LBAToOffset( volume, target->start_cluster ) + written ) == -1 )
+            {
+                return -1;
+            }
+            done += chunk;
+            written += chunk;
+        }
+    }
+    
+    for( cluster = target->start_cluster; cluster < target->start_cluster + target->length - 1; cluster++ )
+    {
+        FATSetEntry( volume, cluster, cluster + 1 );
+    }
+    FATSetEntry( volume, cluster, FAT_EOC_MARK );
+    if( FATFlush( volume, target, 1 ) == -1 || DefragRepoint( volume, item, target->start_cluster ) == -1 )
+    {
+        return -1;
+    }
+    
+    for( i = 0; i < extent_count; i++ )
+    {
+        for( cluster = extents[i].start_cluster; cluster < extents[i].start_cluster + extents[i].length; cluster++ )
+        {
+            FATSetEntry( volume, cluster, 0 );
+        }
+    }
+    return FATFlush( volume, extents, extent_count );
+}
+
+
+//Measure the fragmentation of every chain below path (or of the one file it names) and rewrite each
+//fragmented chain into the smallest free run that holds it. Clusters freed by one move are available to
+//the next. The root directory is left in place, and so is every chain sharing a cluster with another
+//(cross-linked) or with itself (a cycle): freeing its old clusters would free the other chain's data.
+//With dry_run nothing is written, but the same placement is worked out so the report shows the read
+//count the real run would reach.
+//Returns the number of chains moved, or -1 on failure.
+
+int DefragCommand( struct Session *session, const char *path, int dry_run )
+{
+    struct Volume *volume = session->volume;
+    struct DefragContext *defrag = calloc( 1, sizeof(struct DefragContext) );
+    struct DefragItem *items = NULL;
+    struct DirectoryEntry entry;
+    char normalized[MAX_PATH_LENGTH];
+    char *buffer = NULL;
+    size_t total = 0;
+    size_t i = 0;
+    uint64_t reads_before = 0;
+    uint64_t reads_after = 0;
+    int fragmented = 0;
+    int moved = 0;
+    int t = 0;
+    
+    if( defrag == NULL )
+    {
+        return -1;
+    }
+    defrag->volume = volume;
+    if( !dry_run && ImageMakeWritable( volume ) == -1 )
+    {
+        printf("Error: File system image is read-only\n");
+        free( defrag );
+        return -1;
+    }
+    if( NormalizePath( session->current_path, path, normalized ) == -1 || ResolvePath( volume, session->current_path, normalized, &entry ) == -1 )
+    {
+        printf("Error: File not found\n");
+        free( defrag );
+        return -1;
+    }
+    
+    //Collect the chains: the named file or directory itself unless it is the root, then everything below a directory
+    
+    if( strcmp( normalized, "/" ) != 0 )
+    {
+        char parent_path[MAX_PATH_LENGTH];
+        struct DirectoryEntry parent;
+        
+        snprintf( parent_path, sizeof(parent_path), "%.*s", (int)( strrchr( normalized, '/' ) - normalized ), normalized );
+        if( ResolvePath( volume, session->current_path, parent_path[0] == '\0' ? "/" : parent_path, &parent ) == -1 ||
+                DefragListAdd( &defrag->lists[0], normalized, &entry, DirectoryCluster( volume, &parent ) ) == -1 )
+        {
+            atomic_fetch_add( &defrag->errors, 1 );
+        }
+    }
+    if( entry.DIR_Attr & ATTR_DIRECTORY )
+    {
+        uint32_t cluster = DirectoryCluster( volume, &entry );
+        
+        if( WalkTree( volume, cluster, normalized, (void *)(uintptr_t)cluster, DefragVisit, defrag ) != 0 )
+        {
+            atomic_fetch_add( &defrag->errors, 1 );
+        }
+    }
+    
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        total += defrag->lists[t].count;
+    }
+    items = malloc( ( total + 1 ) * sizeof(struct DefragItem) );
+    buffer = dry_run ? NULL : malloc( EXTENT_CHUNK_SIZE );
+    total = 0;
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        if( items != NULL && defrag->lists[t].count > 0 )
+        {
+            memcpy( &items[total], defrag->lists[t].items, defrag->lists[t].count * sizeof(struct DefragItem) );
+            total += defrag->lists[t].count;
+        }
+        else
+        {
+            for( i = 0; i < defrag->lists[t].count; i++ )
+            {
+                free( defrag->lists[t].items[i].path );
+            }
+        }
+        free( defrag->lists[t].items );
+    }
+    if( items == NULL || ( !dry_run && buffer == NULL ) || ( !volume->free_space.valid && FreeSpaceBuild(volume) == -1 ) )
+    {
+        printf("Error: Out of memory\n");
+        total = 0;
+    }
+    else if( DefragMarkShared( defrag ) == -1 ) //Without the whole picture no chain is known to be safe to free
+    {
+        printf("Error: Unable to check the image for cross-linked chains\n");
+        for( i = 0; i < total; i++ )
+        {
+            free( items[i].path );
+        }
+        total = 0;
+    }
+    
+    //Move deepest chains first
+    
+    if( total > 0 )
+    {
+        qsort( items, total, sizeof(struct DefragItem), CompareDefragDepth );
+    }
+    for( i = 0; i < total; i++ )
+    {
+        struct DefragItem *item = &items[i];
+        struct Extent *extents = NULL;
+        struct Extent target;
+        
+        if( IsEndOfChain( volume, FirstCluster( &item->entry ) ) ||
+                ( item->extent_count = BuildExtents( volume, FirstCluster( &item->entry ), &extents ) ) <= 0 )
+        {
+            free( extents );
+            continue;
+        }
+        for( t = 0; t < item->extent_count; t++ )
+        {
+            item->clusters += extents[t].length;
+        }
+        item->reads = ExtentReads( volume, extents, item->extent_count );
+        reads_before += item->reads;
+        item->shared = DefragShared( defrag, extents, item->extent_count );
+        
+        if( item->extent_count > 1 && !item->shared && FreeSpaceTake( volume, item->clusters, &target ) == 0 )
+        {
+            if( dry_run || DefragMove( volume, item, extents, item->extent_count, &target, buffer ) == 0 )
+            {
+                FreeSpaceRelease( volume, extents, item->extent_count );
+                item->moved = 1;
+                moved++;
+            }
+            else
+            {
+                printf("Error: Unable to move %s\n",item->path);
+                volume->free_space.valid = 0; //The FAT no longer matches what was taken out of free_space
+                free( extents );
+                break;
+            }
+        }
+        reads_after += item->moved ? ExtentReads( volume, &target, 1 ) : item->reads;
+        free( extents );
+    }
+    
+    //Report in path order
+    
+    if( total > 0 )
+    {
+        qsort( items, total, sizeof(struct DefragItem), CompareDefragPaths );
+    }
+    for( i = 0; i < total; i++ )
+    {
+        if( items[i].extent_count > 1 )
+        {
+            fragmented++;
+            printf("%s: %d extents, %llu reads -> %s\n",items[i].path,items[i].extent_count,
+                        (unsigned long long)items[i].reads,
+                        items[i].moved ? "1 extent" : items[i].shared ? "cross-linked, left in place" : "no free run large enough");
+        }
+        free( items[i].path );
+    }
+    printf("%s %d of %d fragmented chain(s) of %zu, reads %llu -> %llu",dry_run ? "Would move" : "Moved",moved,fragmented,total,
+                (unsigned long long)reads_before,(unsigned long long)reads_after);
+    if( reads_before > 0 )
+    {
+        printf(" (%.1f%% fewer)",100.0 * ( reads_before - reads_after ) / reads_before);
+    }
+    printf("\n");
+    if( atomic_load( &defrag->errors ) > 0 )
+    {
+        printf("Warning: %d entries could not be checked\n",atomic_load( &defrag->errors ));
+    }
+    
+    if( dry_run )
+    {
+        volume->free_space.valid = 0; //Undo the simulated placement, the FAT is unchanged
+    }
+    else if( moved > 0 )
+    {
+        //Chains, directories and paths have all moved
+        ClusterIndexFlush(volume);
+        DentryCacheFlush(volume);
+        ChangeDirectory( session, session->current_path );
+    }
+    
+    free( buffer );
+    free( items );
+    free( (void *)defrag->owned );
+    free( (void *)defrag->shared );
+    free( defrag );
+    return moved;
+}
+
+
+static const uint32_t sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROTR( x, n ) ( ( (x) >> (n) ) | ( (x) << ( 32 - (n) ) ) )
+
+static void Sha256Block( uint32_t state[8], const unsigned char *block )
+{
+    uint32_t w[64];
+    uint32_t v[8];
+    int i = 0;
+    
+    for( i = 0; i < 16; i++ )
+    {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for( i = 16; i < 64; i++ )
+    {
+        uint32_t s0 = SHA256_ROTR( w[i - 15], 7 ) ^ SHA256_ROTR( w[i - 15], 18 ) ^ ( w[i - 15] >> 3 );
+        uint32_t s1 = SHA256_ROTR( w[i - 2], 17 ) ^ SHA256_ROTR( w[i - 2], 19 ) ^ ( w[i - 2] >> 10 );
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    memcpy( v, state, sizeof(v) );
+    for( i = 0; i < 64; i++ )
+    {
+        uint32_t s1 = SHA256_ROTR( v[4], 6 ) ^ SHA256_ROTR( v[4], 11 ) ^ SHA256_ROTR( v[4], 25 );
+        uint32_t ch = ( v[4] & v[5] ) ^ ( ~v[4] & v[6] );
+        uint32_t t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = SHA256_ROTR( v[0], 2 ) ^ SHA256_ROTR( v[0], 13 ) ^ SHA256_ROTR( v[0], 22 );
+        uint32_t maj = ( v[0] & v[1] ) ^ ( v[0] & v[2] ) ^ ( v[1] & v[2] );
+        
+        memmove( &v[1], &v[0], 7 * sizeof(uint32_t) );
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+    for( i = 0; i < 8; i++ )
+    {
+        state[i] += v[i];
+    }
+}
+
+static void Sha256Init( struct Sha256 *sha )
+{
+    static const uint32_t initial[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    
+    memcpy( sha->state, initial, sizeof(initial) );
+    sha->length = 0;
+    sha->used = 0;
+}
+
+static void Sha256Update( struct Sha256 *sha, const unsigned char *data, size_t length )
+{
+    sha->length += length;
+    if( sha->used > 0 )
+    {
+        size_t take = 64 - sha->used < length ? 64 - sha->used : length;
+        
+        memcpy( sha->block + sha->used, data, take );
+        sha->used += take;
+        data += take;
+        length -= take;
+        if( sha->used < 64 )
+        {
+            return;
+        }
+        Sha256Block( sha->state, sha->block );
+        sha->used = 0;
+    }
+    while( length >= 64 ) //Whole blocks straight from the caller's buffer
+    {
+        Sha256Block( sha->state, data );
+        data += 64;
+        length -= 64;
+    }
+    memcpy( sha->block, data, length );
+    sha->used = length;
+}
+
+static void Sha256Final( struct Sha256 *sha, unsigned char digest[32] )
+{
+    uint64_t bits = sha->length * 8;
+    int i = 0;
+    
+    sha->block[sha->used++] = 0x80;
+    if( sha->used > 56 )
+    {
+        memset( sha->block + sha->used, 0, 64 - sha->used );
+        Sha256Block( sha->state, sha->block );
+        sha->used = 0;
+    }
+    memset( sha->block + sha->used, 0, 56 - sha->used );
+    for( i = 0; i < 8; i++ )
+    {
+        sha->block[63 - i] = bits >> ( i * 8 );
+    }
+    Sha256Block( sha->state, sha->block );
+    
+    for( i = 0; i < 32; i++ )
+    {
+        digest[i] = sha->state[i / 4] >> ( 24 - ( i % 4 ) * 8 );
+    }
+}
+
+
+//Hash the contents of a file into a hex digest, streaming it from its cluster chain. With a mapped
+//image the contiguous ranges are hashed in place; otherwise through the reader's double buffers.
+//Returns 0 on success, -1 if the chain cannot be read or ends before DIR_FileSize bytes.
+
+static int SumFile( struct Volume *volume, const struct DirectoryEntry *entry, int algorithm, char digest[SUM_DIGEST_SIZE] )
+{
+    struct FileReader reader;
+    struct Sha256 sha;
+    uint32_t crc = 0;
+    ssize_t n = 0;
+    int i = 0;
+    
+    if( ReaderOpen( volume, &reader, entry ) == -1 )
+    {
+        return -1;
+    }
+    Sha256Init( &sha );
+    if( volume->image_map == NULL )
+    {
+        ReaderSeek( &reader, 0, entry->DIR_FileSize );
+    }
+    
+    while( 1 )
+    {
+        const char *data = NULL;
+        off_t offset;
+        
+        if( volume->image_map != NULL )
+        {
+            if( ( n = ReaderNextRange( &reader, &offset ) ) > 0 )
+            {
+                data = ImagePointer( volume, offset, n );
+            }
+        }
+        else
+        {
+            n = ReaderNext( &reader, &data );
+        }
+        if( n <= 0 || data == NULL )
+        {
+            break;
+        }
+        
+        if( algorithm == SUM_SHA256 )
+        {
+            Sha256Update( &sha, (const unsigned char *)data, n );
+        }
+        else
+        {
+            crc = Crc32c( crc, data, n );
+        }
+    }
+    
+    int status = n < 0 || reader.position < entry->DIR_FileSize ? -1 : 0;
+    ReaderClose( &reader );
+    
+    if( algorithm == SUM_SHA256 )
+    {
+        unsigned char bytes[32];
+        
+        Sha256Final( &sha, bytes );
+        for( i = 0; i < 32; i++ )
+        {
+            sprintf( digest + i * 2, "%02x", bytes[i] );
+        }
+    }
+    else
+    {
+        sprintf( digest, "%08x", crc );
+    }
+    return status;
+}
+
+
+static int SumListAdd( struct SumList *list, const char *path, const struct DirectoryEntry *entry )
+{
+    if( list->count == list->capacity )
+    {
+        size_t capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+        struct SumJob *grown = realloc( list->jobs, capacity * sizeof(struct SumJob) );
+        if( grown == NULL )
+        {
+            return -1;
+        }
+        list->jobs = grown;
+        list->capacity = capacity;
+    }
+    
+    struct SumJob *job = &list->jobs[list->count];
+    memset( job, 0, sizeof(struct SumJob) );
+    if( ( job->path = strdup( path ) ) == NULL )
+    {
+        return -1;
+    }
+    job->entry = *entry;
+    list->count++;
+    return 0;
+}
+
+static void * SumVisit( struct Walker *walker, int thread, void *parent, const char *path,
+                            const struct DirectoryEntry *entry )
+{
+    struct SumContext *sum = walker->context;
+    
+    (void)parent;
+    if( !( entry->DIR_Attr & ATTR_DIRECTORY ) && SumListAdd( &sum->files[thread], path, entry ) == -1 )
+    {
+        atomic_fetch_add( &sum->errors, 1 );
+    }
+    return NULL;
+}
+
+static int CompareSumPaths( const void *a, const void *b )
+{
+    return strcmp( ( (const struct SumJob *)a )->path, ( (const struct SumJob *)b )->path );
+}
+
+
+//Hashing thread: claim files one at a time until none are left
+
+static void * SumWorker( void *arg )
+{
+    struct SumContext *sum = arg;
+    size_t i = 0;
+    
+    while( ( i = atomic_fetch_add( &sum->next_job, 1 ) ) < sum->job_count )
+    {
+        struct SumJob *job = &sum->jobs[i];
+        
+        if( job->status == 0 )
+        {
+            job->status = SumFile( sum->volume, &job->entry, sum->algorithm, job->digest );
+        }
+    }
+    return NULL;
+}
+
+
+//Merge the per-thread lists into one path sorted job array and hash it on one thread per CPU.
+//Returns -1 on allocation failure.
+
+static int SumRun( struct SumContext *sum )
+{
+    pthread_t ids[MAX_WALK_THREADS];
+    int thread_count = WalkThreadCount();
+    int started = 0;
+    size_t i = 0;
+    int t = 0;
+    
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        sum->job_count += sum->files[t].count;
+    }
+    if( ( sum->jobs = malloc( ( sum->job_count + 1 ) * sizeof(struct SumJob) ) ) == NULL )
+    {
+        for( t = 0; t < MAX_WALK_THREADS; t++ )
+        {
+            for( i = 0; i < sum->files[t].count; i++ )
+            {
+                free( sum->files[t].jobs[i].path );
+                free( sum->files[t].jobs[i].expected );
+            }
+            free( sum->files[t].jobs );
+        }
+        sum->job_count = 0;
+        return -1;
+    }
+    sum->job_count = 0;
+    for( t = 0; t < MAX_WALK_THREADS; t++ )
+    {
+        if( sum->files[t].count > 0 )
+        {
+            memcpy( &sum->jobs[sum->job_count], sum->files[t].jobs, sum->files[t].count * sizeof(struct SumJob) );
+            sum->job_count += sum->files[t].count;
+        }
+        free( sum->files[t].jobs );
+        memset( &sum->files[t], 0, sizeof(struct SumList) );
+    }
+    qsort( sum->jobs, sum->job_count, sizeof(struct SumJob), CompareSumPaths );
+    
+    atomic_store( &sum->next_job, 0 );
+    for( t = 1; t < thread_count && (size_t)t < sum->job_count; t++ )
+    {
+        if( pthread_create( &ids[started], NULL, SumWorker, sum ) != 0 )
+        {
+            break;
+        }
+        started++;
+    }
+    SumWorker( sum );
+    for( t = 0; t < started; t++ )
+    {
+        pthread_join( ids[t], NULL );
+    }
+    return 0;
+}
+
+static void SumFree( struct SumContext *sum )
+{
+    size_t i = 0;
+    
+    for( i = 0; i < sum->job_count; i++ )
+    {
+        free( sum->jobs[i].path );
+        free( sum->jobs[i].expected );
+    }
+    free( sum->jobs );
+    free( sum );
+}
+
+
+//Print a manifest line "<digest>  <absolute path>" for the file at path, for every file directly in
+//the directory at path, or with recursive for every file below it. Nothing is written to the host.
+//Returns the number of files that could not be hashed, -1 if path does not exist.
+
+int SumCommand( struct Session *session, const char *path, int recursive, int algorithm )
+{
+    struct Volume *volume = session->volume;
+    struct SumContext *sum = calloc( 1, sizeof(struct SumContext) );
+    struct DirectoryEntry entry;
+    char normalized[MAX_PATH_LENGTH];
+    size_t i = 0;
+    
+    if( sum == NULL )
+    {
+        return -1;
+    }
+    sum->volume = volume;
+    sum->algorithm = algorithm;
+    
+    if( NormalizePath( session->current_path, path, normalized ) == -1 || ResolvePath( volume, session->current_path, normalized, &entry ) == -1 )
+    {
+        printf("Error: File not found\n");
+        free( sum );
+        return -1;
+    }
+    
+    if( !( entry.DIR_Attr & ATTR_DIRECTORY ) )
+    {
+        SumListAdd( &sum->files[0], normalized, &entry );
+    }
+    else if( recursive )
+    {
+        WalkTree( volume, DirectoryCluster( volume, &entry ), normalized, NULL, SumVisit, sum );
+    }
+    else
+    {
+        struct Directory *directory = DirectoryAcquire( volume, DirectoryCluster( volume, &entry ) );
+        char child[MAX_PATH_LENGTH + 13];
+        
+        for( i = 0; directory != NULL && i < directory->count; i++ )
+        {
+            const struct DirectoryEntry *file = &directory->entries[i];
+            char name[13];
+            
+            if( file->DIR_Name[0] == '\xE5' || ( file->DIR_Attr & ATTR_LONG_NAME ) == ATTR_LONG_NAME ||
+                    ( file->DIR_Attr & ( ATTR_DIRECTORY | ATTR_VOLUME_ID ) ) )
+            {
+                continue;
+            }
+            UnpackName( file->DIR_Name, name );
+            snprintf( child, sizeof(child), "%s/%s", strcmp( normalized, "/" ) == 0 ? "" : normalized, name );
+            SumListAdd( &sum->files[0], child, file );
+        }
+        DirectoryRelease( volume, directory );
+    }
+    
+    if( SumRun( sum ) == -1 )
+    {
+        printf("Error: Out of memory\n");
+    }
+    
+    int errors = atomic_load( &sum->errors );
+    for( i = 0; i < sum->job_count; i++ )
+    {
+        if( sum->jobs[i].status == 0 )
+        {
+            printf("%s  %s\n",sum->jobs[i].digest,sum->jobs[i].path);
+        }
+        else
+        {
+            printf("Error: Unable to read %s\n",sum->jobs[i].path);
+            errors++;
+        }
+    }
+    
+    SumFree( sum );
+    return errors;
+}
+
+
+//Check a manifest written by sum: every "<digest>  <path>" line is hashed again, with the algorithm
+//given by the digest length, and reported as OK or FAILED. Returns the number of mismatched or
+//unreadable files, -1 if the manifest cannot be read.
+
+int SumVerify( struct Session *session, const char *manifest )
+{
+    struct Volume *volume = session->volume;
+    struct SumContext *sum[2] = { calloc( 1, sizeof(struct SumContext) ), calloc( 1, sizeof(struct SumContext) ) };
+    char line[MAX_PATH_LENGTH + SUM_DIGEST_SIZE + 4];
+    FILE *file = fopen( manifest, "r" );
+    int failed = 0;
+    int passed = 0;
+    int a = 0;
+    size_t i = 0;
+    
+    if( file == NULL || sum[0] == NULL || sum[1] == NULL )
+    {
+        printf("Error: Unable to read %s\n",manifest);
+        if( file != NULL )
+        {
+            fclose( file );
+        }
+        free( sum[0] );
+        free( sum[1] );
+        return -1;
+    }
+    sum[SUM_CRC32C]->volume = volume;
+    sum[SUM_CRC32C]->algorithm = SUM_CRC32C;
+    sum[SUM_SHA256]->volume = volume;
+    sum[SUM_SHA256]->algorithm = SUM_SHA256;
+    
+    while( fgets( line, sizeof(line), file ) != NULL )
+    {
+        char *separator = strstr( line, "  " );
+        struct DirectoryEntry entry;
+        
+        line[strcspn( line, "\n" )] = '\0';
+        if( separator == NULL || ( separator - line != 8 && separator - line != 64 ) )
+        {
+            continue; //Not a manifest line
+        }
+        *separator = '\0';
+        
+        int algorithm = separator - line == 8 ? SUM_CRC32C : SUM_SHA256;
+        struct SumList *list = &sum[algorithm]->files[0];
+        int found = ResolvePath( volume, session->current_path, separator + 2, &entry ) == 0 && !( entry.DIR_Attr & ATTR_DIRECTORY );
+        
+        if( SumListAdd( list, separator + 2, &entry ) == -1 ||
+                ( list->jobs[list->count - 1].expected = strdup( line ) ) == NULL )
+        {
+            failed++;
+            continue;
+        }
+        list->jobs[list->count - 1].status = found ? 0 : -1;
+    }
+    fclose( file );
+    
+    for( a = SUM_CRC32C; a <= SUM_SHA256; a++ )
+    {
+        SumRun( sum[a] );
+        for( i = 0; i < sum[a]->job_count; i++ )
+        {
+            struct SumJob *job = &sum[a]->jobs[i];
+            
+            if( job->status == 0 && strcasecmp( job->digest, job->expected ) == 0 )
+            {
+                printf("%s: OK\n",job->path);
+                passed++;
+            }
+            else
+            {
+                printf("%s: FAILED%s\n",job->path,job->status == 0 ? "" : " (not found or unreadable)");
+                failed++;
+            }
+        }
+        SumFree( sum[a] );
+    }
+    
+    printf("%d OK, %d failed\n",passed,failed);
+    return failed;
+}
+
+
+//Seconds since the epoch of a FAT date and time, which are local time. An unset date gives 0.
+
+static time_t FatTimestamp( uint16_t date, uint16_t time )
+{
+    struct tm tm;
+    
+    if( date == 0 )
+    {
+        return 0;
+    }
+    memset( &tm, 0, sizeof(tm) );
+    tm.tm_year = 80 + ( date >> 9 );
+    tm.tm_mon = ( ( date >> 5 ) & 0x0F ) - 1;
+    tm.tm_mday = date & 0x1F;
+    tm.tm_hour = time >> 11;
+    tm.tm_min = ( time >> 5 ) & 0x3F;
+    tm.tm_sec = ( time & 0x1F ) * 2;
+    tm.tm_isdst = -1;
+    
+    time_t seconds = mktime( &tm );
+    return seconds != -1 ? seconds : 0;
+}
+
+
+//Write out everything collected in the tar buffer. Returns 0 on success, -1 on a write error.
+
+static int TarFlush( struct TarStream *tar )
+{
+    size_t done = 0;
+    
+    while( done < tar->used )
+    {
+        uint64_t start = StatClock();
+        ssize_t n = write( tar->fd, tar->buffer + done, tar->used - done );
+        
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            return -1;
+        }
+        HistogramRecord( &stat_output_latency, start );
+        StatAdd( STAT_OUTPUT_WRITES, 1 );
+        StatAdd( STAT_OUTPUT_BYTES, n );
+        done += n;
+    }
+    tar->used = 0;
+    return 0;
+}
+
+
+//Make room for length more bytes in the tar buffer. Returns 0 on success, -1 on a write error.
+
+static int TarReserve( struct TarStream *tar, size_t length )
+{
+    return tar->used + length > EXPORT_BUFFER_SIZE ? TarFlush( tar ) : 0;
+}
+
+
+//Zero fill the data of a member of size bytes up to the next block
+//(the buffer always has room for it, TarReserve is called with whole blocks)
+
+static void TarPad( struct TarStream *tar, uint64_t size )
+{
+    size_t pad = ( TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE ) % TAR_BLOCK_SIZE;
+    
+    memset( tar->buffer + tar->used, 0, pad );
+    tar->used += pad;
+}
+
+
+//Whether name can go into a tar header as is: relative, no empty, . or .. components (a directory's
+//trailing '/' aside) and no control characters, so extracting the archive stays below its directory
+
+static int TarSafeName( const char *name )
+{
+    const char *component = name;
+    const char *end = NULL;
+    
+    do
+    {
+        end = strchrnul( component, '/' );
+        if( ( end == component && *end != '\0' ) || ( end - component == 1 && component[0] == '.' ) ||
+                ( end - component == 2 && component[0] == '.' && component[1] == '.' ) )
+        {
+            return 0;
+        }
+        for( ; component < end; component++ )
+        {
+            if( (unsigned char)*component < ' ' || *component == 0x7F )
+            {
+                return 0;
+            }
+        }
+        component = end + 1;
+    } while( *end != '\0' && *component != '\0' );
+    return name[0] != '\0';
+}
+
+
+//Append the ustar header of a member named name (directories end in '/'). Names longer than the
+//name field are split at a '/' into the prefix field. Returns 0 on success, 1 if the name is unsafe
+//or cannot be stored, -1 on a write error.
+
+static int TarHeader( struct TarStream *tar, const char *name, const struct DirectoryEntry *entry )
+{
+    size_t length = strlen( name );
+    size_t split = 0; //Length of the part going into the prefix field, 0 for none
+    unsigned int checksum = 0;
+    int directory = ( entry->DIR_Attr & ATTR_DIRECTORY ) != 0;
+    int mode = directory ? 0755 : 0644;
+    int i = 0;
+    
+    if( !TarSafeName( name ) )
+    {
+        return 1;
+    }
+    if( length > 100 )
+    {
+        for( split = length - 1; split > 0 && ( name[split] != '/' || split > 155 || length - split - 1 > 100 ||
+                split == length - 1 ); split-- );
+        if( split == 0 )
+        {
+            return 1;
+        }
+    }
+    if( entry->DIR_Attr & ATTR_READ_ONLY )
+    {
+        mode &= ~0222;
+    }
+    
+    if( TarReserve( tar, TAR_BLOCK_SIZE ) == -1 )
+    {
+        return -1;
+    }
+    char *header = tar->buffer + tar->used;
+    
+    memset( header, 0, TAR_BLOCK_SIZE );
+    if( split > 0 )
+    {
+        memcpy( header + 345, name, split ); //prefix
+        memcpy( header, name + split + 1, length - split - 1 );
+    }
+    else
+    {
+        memcpy( header, name, length );
+    }
+    snprintf( header + 100, 8, "%07o", mode );
+    snprintf( header + 108, 8, "%07o", 0 ); //uid
+    snprintf( header + 116, 8, "%07o", 0 ); //gid
+    snprintf( header + 124, 12, "%011llo", directory ? 0ULL : (unsigned long long)entry->DIR_FileSize );
+    snprintf( header + 136, 12, "%011llo", (unsigned long long)FatTimestamp( entry->DIR_WrtDate, entry->DIR_WrtTime ) & 077777777777ULL );
+    memset( header + 148, ' ', 8 ); //Checksum field counts as spaces while summing
+    header[156] = directory ? '5' : '0';
+    memcpy( header + 257, "ustar", 6 );
+    memcpy( header + 263, "00", 2 );
+    
+    for( i = 0; i < TAR_BLOCK_SIZE; i++ )
+    {
+        checksum += (unsigned char)header[i];
+    }
+    snprintf( header + 148, 8, "%06o", checksum );
+    header[155] = ' ';
+    
+    tar->used += TAR_BLOCK_SIZE;
+    return 0;
+}
+
+
+//Append one file: header, data and padding. Small files are read into the buffer so many of them go
+//out in one write; larger ones are copied from the image by the kernel. The chain is checked against
+//DIR_FileSize before the header goes out, so a broken file is left out instead of cutting the stream short.
+//Returns 0 on success, 1 if the file was skipped, -1 on a write or read error (the stream is unusable).
+
+static int ExportFile( struct TarStream *tar, const char *name, const struct DirectoryEntry *entry )
+{
+    struct Volume *volume = tar->volume;
+    uint64_t size = entry->DIR_FileSize;
+    struct ClusterIndex *index = NULL;
+    int status = 0;
+    
+    if( size > 0 && ( ( index = ClusterIndexAcquire( volume, FirstCluster( entry ) ) ) == NULL ||
+            (uint64_t)index->count * volume->cluster_size < size ) )
+    {
+        fprintf( tar->report, "Error: Unable to read %s\n", name );
+        ClusterIndexRelease( volume, index );
+        return 1;
+    }
+    
+    if( ( status = TarHeader( tar, name, entry ) ) != 0 )
+    {
+        if( status == 1 )
+        {
+            fprintf( tar->report, "Error: %s: Name can't be stored in tar\n", name );
+        }
+        ClusterIndexRelease( volume, index );
+        return status;
+    }
+    
+    size_t padded = ( size + TAR_BLOCK_SIZE - 1 ) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    
+    if( size <= EXPORT_INLINE_SIZE )
+    {
+        if( TarReserve( tar, padded ) == -1 || ( size > 0 && ReadClusters( volume, index, 0, size, tar->buffer + tar->used ) == -1 ) )
+        {
+            status = -1;
+        }
+        else
+        {
+            tar->used += size;
+        }
+    }
+    else if( TarFlush( tar ) == -1 || StreamFile( volume, entry, tar->fd, &tar->method ) == -1 )
+    {
+        status = -1;
+    }
+    
+    ClusterIndexRelease( volume, index );
+    if( status == -1 )
+    {
+        fprintf( tar->report, "Error: Unable to export %s\n", name );
+        return -1;
+    }
+    
+    TarPad( tar, size );
+    tar->files++;
+    tar->bytes += size;
+    return 0;
+}
+
+
+//Append the directory at tar->path, member name tar->name (empty for the root, which gets no member),
+//and depth first in directory order everything below it. Children's paths and names are appended to
+//the same two buffers and cut off again, so a level of recursion only costs a small frame, and the
+//depth is bounded by MAX_PATH_LENGTH. Returns the number of entries left out, -1 once the stream is unusable.
+
+static int ExportDirectory( struct TarStream *tar, const struct DirectoryEntry *entry )
+{
+    struct Volume *volume = tar->volume;
+    struct VolumeDir *dir = VolumeOpenDir( volume, tar->path );
+    struct DirectoryEntry child;
+    size_t path_length = strlen( tar->path );
+    size_t name_length = strlen( tar->name );
+    char short_name[13];
+    int skipped = 0;
+    int status = 0;
+    
+    if( dir == NULL )
+    {
+        fprintf( tar->report, "Error: Unable to load directory %s\n", tar->path );
+        return 1;
+    }
+    
+    if( name_length > 0 )
+    {
+        strcpy( tar->name + name_length, "/" );
+        if( ( status = TarHeader( tar, tar->name, entry ) ) != 0 )
+        {
+            if( status == 1 )
+            {
+                fprintf( tar->report, "Error: %s: Name can't be stored in tar\n", tar->name );
+            }
+            VolumeCloseDir( dir );
+            return status;
+        }
+    }
+    
+    while( skipped != -1 && VolumeReadDir( dir, short_name, &child ) )
+    {
+        if( child.DIR_Name[0] == '.' ) //. and ..
+        {
+            continue;
+        }
+        
+        if( !HostSafeName( child.DIR_Name ) ) //Would escape, or can't be, a member name component
+        {
+            tar->path[path_length] = '\0';
+            fprintf( tar->report, "Error: %s%s%s has a name that can't be archived, skipped\n", tar->path,
+                        path_length > 1 ? "/" : "", short_name );
+            status = 1;
+        }
+        else if( snprintf( tar->path + path_length, MAX_PATH_LENGTH - path_length, "%s%s", path_length > 1 ? "/" : "",
+                    short_name ) >= (int)( MAX_PATH_LENGTH - path_length ) ||
+                snprintf( tar->name + name_length, MAX_PATH_LENGTH - name_length, "%s%s", name_length > 0 ? "/" : "",
+                    short_name ) >= (int)( MAX_PATH_LENGTH - name_length ) )
+        {
+            tar->path[path_length] = '\0';
+            fprintf( tar->report, "Error: %s/%s: Path too long\n", tar->path, short_name );
+            status = 1;
+        }
+        else if( child.DIR_Attr & ATTR_DIRECTORY )
+        {
+            status = ExportDirectory( tar, &child );
+        }
+        else
+        {
+            status = ExportFile( tar, tar->name, &child );
+        }
+        skipped = status == -1 ? -1 : skipped + status;
+    }
+    
+    tar->path[path_length] = '\0';
+    tar->name[name_length] = '\0';
+    VolumeCloseDir( dir );
+    return skipped;
+}
+
+
+//export: write the file or directory tree at path as a ustar archive to target, or to stdout when
+//target is NULL. Members are named from the last component of path down (nothing for the root) and
+//carry the FAT sizes and modification times. Problems go to stderr while the archive goes to stdout.
+//Returns the number of entries left out, -1 if the archive could not be completed.
+
+int ExportCommand( struct Session *session, const char *path, const char *target )
+{
+    struct Volume *volume = session->volume;
+    static struct TarStream tar; //Two MAX_PATH_LENGTH buffers, kept off the stack
+    char normalized[MAX_PATH_LENGTH];
+    struct DirectoryEntry entry;
+    struct timespec start, end;
+    int status = 0;
+    
+    memset( &tar, 0, sizeof(tar) );
+    tar.volume = volume;
+    tar.method = COPY_METHOD_RANGE;
+    tar.report = target == NULL ? stderr : stdout;
+    
+    if( NormalizePath( session->current_path, path, normalized ) == -1 || ResolvePath( volume, session->current_path, normalized, &entry ) == -1 )
+    {
+        fprintf( tar.report, "Error: File not found\n" );
+        return -1;
+    }
+    
+    if( target == NULL )
+    {
+        fflush( stdout ); //Earlier output stays ahead of the archive
+        tar.fd = STDOUT_FILENO;
+    }
+    else if( ( tar.fd = open( target, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ) == -1 )
+    {
+        printf("Error: Unable to create %s\n",target);
+        return -1;
+    }
+    if( ( tar.buffer = malloc( EXPORT_BUFFER_SIZE ) ) == NULL )
+    {
+        if( target != NULL )
+        {
+            close( tar.fd );
+        }
+        return -1;
+    }
+    
+    ImageAdvise( volume, IMAGE_ADVICE_SEQUENTIAL );
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    
+    strcpy( tar.path, normalized );
+    strcpy( tar.name, strrchr( normalized, '/' ) + 1 ); //Empty for the root
+    
+    if( entry.DIR_Attr & ATTR_DIRECTORY )
+    {
+        status = ExportDirectory( &tar, &entry );
+    }
+    else
+    {
+        status = ExportFile( &tar, tar.name, &entry );
+    }
+    
+    //End of archive: two zero blocks
+    
+    if( status != -1 && TarReserve( &tar, 2 * TAR_BLOCK_SIZE ) == 0 )
+    {
+        memset( tar.buffer + tar.used, 0, 2 * TAR_BLOCK_SIZE );
+        tar.used += 2 * TAR_BLOCK_SIZE;
+    }
+    if( status != -1 && TarFlush( &tar ) == -1 )
+    {
+        status = -1;
+    }
+    if( target != NULL && close( tar.fd ) != 0 )
+    {
+        status = -1;
+    }
+    free( tar.buffer );
+    
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    double seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+    
+    if( status == -1 )
+    {
+        fprintf( tar.report, "Error: Unable to write the archive\n" );
+    }
+    else if( target != NULL )
+    {
+        printf("Exported %llu file(s), %llu bytes in %.3f s (%.1f MB/s)\n",(unsigned long long)tar.files,
+                    (unsigned long long)tar.bytes,seconds,seconds > 0 ? tar.bytes / seconds / 1e6 : 0.0);
+    }
+    if( status > 0 )
+    {
+        fprintf( tar.report, "Error: %d file(s) or director%s left out of the archive\n", status, status == 1 ? "y" : "ies" );
+    }
+    return status;
+}
+
+
+//Split command->line on whitespace in place. Empty words are skipped and unused token slots are NULL.
+
+void ParseCommand( struct CommandLine *command )
+{
+    char *working_str = command->line;
+    char *arg_ptr = NULL;
+    
+    command->token_count = 0;
+    while( command->token_count < MAX_NUM_ARGUMENTS && ( arg_ptr = strsep( &working_str, WHITESPACE ) ) != NULL )
+    {
+        if( arg_ptr[0] != '\0' )
+        {
+            command->token[command->token_count++] = arg_ptr;
+        }
+    }
+    memset( &command->token[command->token_count], 0, ( MAX_NUM_ARGUMENTS - command->token_count ) * sizeof(char *) );
+}
+
+
+//Open the file system image: open <image> [pread]. A daemon client shares the image with every other
+//client that has it open.
+
+static void RunOpen( struct Session *session, char **token )
+{
+    char path[PATH_MAX];
+    
+    if( session->volume != NULL )
+    {
+        fprintf(session->out,"Error: File system image already open\n");
+        return;
+    }
+    
+    //Map the image unless the user explicitly asks for the pread backend (for a served image,
+    //only the first client to open it decides)
+    int use_mmap = !( token[2] != NULL && strcmp(token[2],"pread") == 0 );
+
+    if( token[1] == NULL || SessionHostPath(session,token[1],path) == -1 ||
+            ( session->volume = session->in != NULL ? ServeImage(path,use_mmap) : VolumeOpen(path,use_mmap,block_cache_bytes) ) == NULL )
+    {
+        fprintf(session->out,"Error: File system image not found.\n");
+        return;
+    }
+    if( session->in == NULL )
+    {
+        session->volume->readahead_window = readahead_window;
+    }
+    
+    if( session->volume->fat_table == NULL ) //Every chain walk is served from the cached FAT
+    {
+        fprintf(session->out,"Error: Unable to load the file allocation table.\n");
+    }
+    
+    //Load the root directory, following its cluster chain, as the current directory.
+    //Without one the image stays closed: every command that needs an image uses current_dir.
+    
+    strcpy(session->current_path,"/");
+    if( ChangeDirectory(session,"/") == -1 )
+    {
+        fprintf(session->out,"Error: Unable to load the root directory.\n");
+        if( session->in == NULL ) //A served image stays with the daemon
+        {
+            VolumeClose(session->volume);
+        }
+        session->volume = NULL;
+    }
+}
+
+
+//Close the file system image and drop every cache built from it. A daemon client only lets go of
+//the image, which stays open in the daemon.
+
+static void RunClose( struct Session *session, char **token )
+{
+    (void)token;
+    
+    if( session->volume == NULL )
+    {
+        fprintf(session->out,"Error: File system image not found\n");
+        return;
+    }
+    
+    DirectoryRelease(session->volume,session->current_dir);
+    session->current_dir = NULL;
+    strcpy(session->current_path,"/");
+    if( session->in == NULL )
+    {
+        VolumeClose(session->volume);
+    }
+    session->volume = NULL;
+    fprintf(session->out,"Use quit to exit the program. \n");
+}
+
+
+//Write the statistics file, release the shell's image and exit with status
+
+void Quit( int status )
+{
+    if( stats_file != NULL ) //Machine readable statistics of the whole session
+    {
+        FILE *out = fopen( stats_file, "w" );
+        
+        if( out == NULL )
+        {
+            printf("Error: Unable to write %s\n",stats_file);
+        }
+        else
+        {
+            StatsPrint( out, 1 );
+            fclose( out );
+        }
+    }
+    
+    if( shell.volume != NULL )
+    {
+        DirectoryRelease(shell.volume,shell.current_dir);
+        shell.current_dir = NULL;
+        VolumeClose(shell.volume);
+        shell.volume = NULL;
+    }
+    exit(status);
+}
+
+
+//Release the image and exit
+
+static void RunQuit( struct Session *session, char **token )
+{
+    (void)session;
+    (void)token;
+    
+    Quit(0);
+}
+
+
+//Print information about the specifications of the file system image
+
+static void RunInfo( struct Session *session, char **token )
+{
+    struct Volume *volume = session->volume;
+    
+    (void)token;
+    
+    fprintf(session->out," BPB_BytsPerSec: %d\n BPB_BytsPerSec: %x\n\n BPB_SecPerClus: %d\n BPB_SecPerClus: %x\n\n BPB_RsvdSecCnt: %d\n BPB_RsvdSecCnt: %x\n\n BPB_NumFATs: %d\n BPB_NumFATs: %x\n\n BPB_FATSz32: %d\n BPB_FATSz32: %x\n\n",
+             volume->BPB_BytsPerSec,volume->BPB_BytsPerSec,
+             volume->BPB_SecPerClus,volume->BPB_SecPerClus,
+             volume->BPB_RsvdSecCnt,volume->BPB_RsvdSecCnt,
+             volume->BPB_NumFATs,volume->BPB_NumFATs,
+             volume->BPB_FATSz32,volume->BPB_FATSz32);
+}
+
+
+//Display the attributes and the starting cluster number of a file or directory
+
+static void RunStat( struct Session *session, char **token )
+{
+    struct DirectoryEntry entry; //Entry of the file or sub-directory, the name may be a full path
+    
+    if( token[1] == NULL || ResolvePath(session->volume,session->current_path,token[1],&entry) == -1 ) //If file or directory cannot be found
+    {
+        fprintf(session->out,"Error: File not found\n");
+    }
+    else
+    {
+        fprintf(session->out,"Attribute: %x\nSize: %x\nStarting Cluster Number:%x\n",
+            entry.DIR_Attr,entry.DIR_FileSize,FirstCluster(&entry));
+    }
+}
+
+
+//Bulk extraction of a directory tree or glob: mget <path|glob> [dest]
+
+static void RunMget( struct Session *session, char **token )
+{
+    if( token[1] == NULL )
+    {
+        printf("Error: File not found\n");
+    }
+    else
+    {
+        ImageAdvise(session->volume,IMAGE_ADVICE_SEQUENTIAL);
+        MgetCommand(session,token[1],token[2] != NULL ? token[2] : ".");
+    }
+}
+
+
+//Extract one file into the local working directory (a daemon client's own): get <path>,
+//get -r <path|glob> [dest]
+
+static void RunGet( struct Session *session, char **token )
+{
+    char target[PATH_MAX];
+    
+    if( token[1] != NULL && strcmp(token[1],"-r") == 0 )
+    {
+        if( session->in != NULL ) //Bulk extraction stays with the local shell
+        {
+            fprintf(session->out,"Error: Command not supported\n");
+        }
+        else
+        {
+            RunMget(session,token + 1); //get -r <path> [dest] is mget <path> [dest]
+        }
+        return;
+    }
+    
+    struct DirectoryEntry entry; //Entry of the file, the name may be a full path
+    
+    if( token[1] == NULL || ResolvePath(session->volume,session->current_path,token[1],&entry) == -1 )
+    {
+        fprintf(session->out,"Error: File not found\n");
+    }
+    else if( entry.DIR_Attr & ATTR_DIRECTORY )
+    {
+        fprintf(session->out,"Error: %s is a directory\n",token[1]);
+    }
+    else
+    {
+        //The file is created in the local working directory under its last path component
+        const char *name = strrchr(token[1],'/') != NULL ? strrchr(token[1],'/') + 1 : token[1];
+        
+        if( session->in == NULL ) //Advice covers the whole mapping, which daemon clients share
+        {
+            ImageAdvise(session->volume,IMAGE_ADVICE_SEQUENTIAL); //The whole chain is about to be read front to back
+        }
+        
+        if( SessionHostPath(session,name,target) == -1 || ExtractFile(session->volume,&entry,target) == -1 )
+        {
+            fprintf(session->out,"Error: Unable to extract %s\n",name);
+        }
+    }
+}
+
+
+//Change directories
+
+static void RunCd( struct Session *session, char **token )
+{
+    if( session->in == NULL ) //A served image's indexes are shared with the other clients
+    {
+        ClusterIndexFlush(session->volume); //Indexes only live as long as their directory is current
+    }
+    
+    struct DirectoryEntry entry;
+    
+    if( token[1] == NULL || (token[1] != NULL && strcmp(token[1],".") == 0) )
+    {
+        ChangeDirectory(session,"/"); //Set the root directory as the current directory
+    }
+    else if( strcmp(session->current_path,"/") == 0 && strcmp(token[1],"..") == 0 )
+    {
+        fprintf(session->out,"Already at root directory.\n");
+    }
+    else if( ResolvePath(session->volume,session->current_path,token[1],&entry) == -1 )
+    {
+        fprintf(session->out,"%s: No such file or directory.\n",token[1]);
+    }
+    else if( !( entry.DIR_Attr & ATTR_DIRECTORY ) )
+    {
+        fprintf(session->out,"%s: Not a directory.\n",token[1]);
+    }
+    else if( ChangeDirectory(session,token[1]) == -1 ) //If sub-directory exists change it to current directory
+    {
+        fprintf(session->out,"Error: Unable to load directory.\n");
+    }
+}
+
+
+//List the files and sub-directories of the current directory or a path
+
+static void RunLs( struct Session *session, char **token )
+{
+    struct DirectoryEntry entry;
+    
+    if( token[1] == NULL )
+    {
+        ListDirectory(session->out,session->current_dir);
+    }
+    else if( strcmp(session->current_path,"/") == 0 && strcmp(token[1],"..") == 0 )
+    {
+        fprintf(session->out,"Already at root directory. Use ls\n");
+    }
+    else if( ResolvePath(session->volume,session->current_path,token[1],&entry) == -1 || !( entry.DIR_Attr & ATTR_DIRECTORY ) )
+    {
+        fprintf(session->out,"%s: No such directory.\n",token[1]);
+    }
+    else //List another directory, served from the directory cache when it was loaded before
+    {
+        struct Directory *directory = DirectoryAcquire(session->volume,DirectoryCluster(session->volume,&entry));
+        
+        if( directory == NULL )
+        {
+            fprintf(session->out,"Error: Unable to load directory.\n");
+        }
+        else
+        {
+            ListDirectory(session->out,directory);
+            DirectoryRelease(session->volume,directory);
+        }
+    }
+}
+
+
+//Print bytes of a file as hex: read <path> <position> <bytes> [plain|xxd]
+
+static void RunRead( struct Session *session, char **token )
+{
+    struct DirectoryEntry entry; //Entry of the file, the name may be a full path
+    int64_t start_position = token[2] != NULL ? atoll(token[2]) : 0; //Position in file to start reading
+    int64_t num_bytes = token[3] != NULL ? atoll(token[3]) : 0; //Number of bytes given position in file to read
+    int layout = token[4] != NULL && strcmp(token[4],"xxd") == 0 ? HEX_LAYOUT_XXD : HEX_LAYOUT_PLAIN;
+    
+    if( token[1] == NULL || ResolvePath(session->volume,session->current_path,token[1],&entry) == -1 )
+    {
+        fprintf(session->out,"Error: File not found.\n");
+    }
+    else if( start_position < 0 || num_bytes < 0 || start_position + num_bytes > entry.DIR_FileSize )
+    {
+        fprintf(session->out,"Error: Number of bytes to be read exceeds file size.\n");
+    }
+    else if( token[4] != NULL && layout == HEX_LAYOUT_PLAIN && strcmp(token[4],"plain") != 0 )
+    {
+        fprintf(session->out,"Error: Layout must be plain or xxd.\n");
+    }
+    else
+    {
+        //A few clusters are not worth readahead, a large range is streamed front to back. Daemon
+        //clients share the mapping, so they leave the advice alone.
+        if( session->in == NULL )
+        {
+            ImageAdvise( session->volume, (uint64_t)num_bytes < session->volume->readahead_window ? IMAGE_ADVICE_RANDOM : IMAGE_ADVICE_SEQUENTIAL );
+        }
+        
+        struct FileReader reader;
+        struct HexDump dump;
+        int64_t done = 0; //Bytes formatted so far
+        int status = -1;
+        
+        if( ReaderOpen(session->volume,&reader,&entry) == 0 )
+        {
+            if( HexDumpOpen(&dump,session->out,layout,start_position) == 0 )
+            {
+                const char *data;
+                ssize_t n = 0;
+                
+                status = 0;
+                ReaderSeek(&reader,start_position,num_bytes);
+                while( status == 0 && done < num_bytes && ( n = ReaderNext(&reader,&data) ) > 0 )
+                {
+                    status = HexDumpWrite(&dump,(const unsigned char *)data,n);
+                    done += n;
+                }
+                if( HexDumpClose(&dump) == -1 )
+                {
+                    status = -1;
+                }
+            }
+            ReaderClose(&reader);
+        }
+        
+        if( status == -1 || done != num_bytes )
+        {
+            fprintf(session->out,"Error: Unable to read file.\n");
+        }
+    }
+}
+
+
+//Report free, used, bad and reserved clusters from a scan of the FAT, checked against FSInfo
+
+static void RunDf( struct Session *session, char **token )
+{
+    struct ClusterUsage usage;
+    unsigned char fsinfo[512];
+    uint32_t signatures[2] = { 0, 0 };
+    uint32_t fsinfo_free = FSINFO_UNKNOWN;
+    uint32_t fsinfo_next = FSINFO_UNKNOWN;
+    
+    (void)token;
+    
+    FATCountClusters(session->volume,&usage);
+    uint64_t total = usage.free + usage.used + usage.bad + usage.reserved;
+    
+    printf("Clusters: %llu of %u bytes (%llu bytes)\n",(unsigned long long)total,session->volume->cluster_size,
+                (unsigned long long)total * session->volume->cluster_size);
+    printf("Used: %llu clusters (%llu bytes, %.1f%%)\n",(unsigned long long)usage.used,
+                (unsigned long long)usage.used * session->volume->cluster_size,total > 0 ? 100.0 * usage.used / total : 0.0);
+    printf("Free: %llu clusters (%llu bytes, %.1f%%)\n",(unsigned long long)usage.free,
+                (unsigned long long)usage.free * session->volume->cluster_size,total > 0 ? 100.0 * usage.free / total : 0.0);
+    printf("Bad: %llu clusters\nReserved: %llu clusters\n",(unsigned long long)usage.bad,(unsigned long long)usage.reserved);
+    
+    //FSInfo keeps a hint of the free count that drivers do not always update
+    
+    if( session->volume->BPB_FSInfo == 0 || session->volume->BPB_FSInfo >= session->volume->BPB_RsvdSecCnt ||
+            ImageRead(session->volume,fsinfo,sizeof(fsinfo),(off_t)session->volume->BPB_FSInfo * session->volume->BPB_BytsPerSec) == -1 )
+    {
+        printf("FSInfo: not present\n");
+        return;
+    }
+    memcpy(&signatures[0],&fsinfo[0],4);
+    memcpy(&signatures[1],&fsinfo[484],4);
+    memcpy(&fsinfo_free,&fsinfo[488],4);
+    memcpy(&fsinfo_next,&fsinfo[492],4);
+    
+    if( signatures[0] != FSINFO_LEAD_SIG || signatures[1] != FSINFO_STRUC_SIG )
+    {
+        printf("FSInfo: invalid signature\n");
+    }
+    else if( fsinfo_free == FSINFO_UNKNOWN )
+    {
+        printf("FSInfo free count: unknown\n");
+    }
+    else if( fsinfo_free == usage.free )
+    {
+        printf("FSInfo free count: %u (matches)\n",fsinfo_free);
+    }
+    else
+    {
+        printf("FSInfo free count: %u (stale, scan found %llu)\n",fsinfo_free,(unsigned long long)usage.free);
+    }
+    if( signatures[0] == FSINFO_LEAD_SIG && fsinfo_next != FSINFO_UNKNOWN )
+    {
+        printf("FSInfo next free: %u\n",fsinfo_next);
+    }
+}
+
+
+//Copy a host file into the image: put <hostfile> [name]. The name defaults to the host file's
+//last path component and may be a path into an existing directory.
+
+static void RunPut( struct Session *session, char **token )
+{
+    if( token[1] == NULL )
+    {
+        printf("Error: File not found\n");
+        return;
+    }
+    
+    const char *name = token[2] != NULL ? token[2] :
+                            strrchr(token[1],'/') != NULL ? strrchr(token[1],'/') + 1 : token[1];
+    
+    PutCommand(session,token[1],name);
+}
+
+
+//Make fragmented chains contiguous: defrag [-n] [path]. -n only reports what would be moved.
+
+static void RunDefrag( struct Session *session, char **token )
+{
+    int dry_run = token[1] != NULL && strcmp(token[1],"-n") == 0;
+    const char *path = token[1 + dry_run] != NULL ? token[1 + dry_run] : "/";
+    
+    ImageAdvise(session->volume,IMAGE_ADVICE_RANDOM);
+    DefragCommand(session,path,dry_run);
+}
+
+
+//Hash files without extracting them: sum [-s] [-r] [path], or sum -c <manifest> to verify.
+//CRC32C by default, -s for SHA-256; a directory is summed one level deep unless -r is given.
+
+static void RunSum( struct Session *session, char **token )
+{
+    int algorithm = SUM_CRC32C;
+    int recursive = 0;
+    const char *path = NULL;
+    int i = 0;
+    
+    for( i = 1; i < MAX_NUM_ARGUMENTS && token[i] != NULL; i++ )
+    {
+        if( strcmp(token[i],"-c") == 0 )
+        {
+            if( token[i + 1] == NULL )
+            {
+                printf("Error: sum -c needs a manifest file\n");
+            }
+            else
+            {
+                ImageAdvise(session->volume,IMAGE_ADVICE_SEQUENTIAL);
+                SumVerify(session,token[i + 1]);
+            }
+            return;
+        }
+        else if( strcmp(token[i],"-s") == 0 )
+        {
+            algorithm = SUM_SHA256;
+        }
+        else if( strcmp(token[i],"-r") == 0 )
+        {
+            recursive = 1;
+        }
+        else
+        {
+            path = token[i];
+        }
+    }
+    
+    ImageAdvise(session->volume,IMAGE_ADVICE_SEQUENTIAL);
+    SumCommand(session,path != NULL ? path : ".",recursive,algorithm);
+}
+
+
+//Write a file or directory tree as a tar archive: export <path> [file], to stdout without a file
+
+static void RunExport( struct Session *session, char **token )
+{
+    if( token[1] == NULL )
+    {
+        printf("Error: File not found\n");
+    }
+    else
+    {
+        ExportCommand(session,token[1],token[2]);
+    }
+}
+
+
+//Check the consistency of the open image without changing it
+
+static void RunFsck( struct Session *session, char **token )
+{
+    (void)token;
+    
+    ImageAdvise(session->volume,IMAGE_ADVICE_RANDOM); //Only directories and the FATs are read
+    FsckCommand(session);
+}
+
+
+//Show or set the streaming reader readahead window
+
+static void RunReadahead( struct Session *session, char **token )
+{
+    if( token[1] != NULL )
+    {
+        long window = atol(token[1]);
+        
+        if( window <= 0 )
+        {
+            printf("Error: Readahead window must be a positive number of bytes\n");
+        }
+        else
+        {
+            readahead_window = window;
+            if( session->volume != NULL )
+            {
+                session->volume->readahead_window = window;
+            }
+        }
+    }
+    printf("Readahead: %zu bytes\n",readahead_window);
+}
+
+
+//Show the block cache, or set its capacity in bytes (0 disables it). Resizing drops every cached block.
+
+static void RunCache( struct Session *session, char **token )
+{
+    if( token[1] != NULL )
+    {
+        char *end = NULL;
+        long long bytes = strtoll(token[1],&end,10);
+        
+        if( *end != '\0' || bytes < 0 )
+        {
+            printf("Error: Cache size must be a number of bytes\n");
+        }
+        else
+        {
+            block_cache_bytes = bytes;
+            if( session->volume != NULL && BlockCacheConfigure(session->volume,session->volume->cluster_size,LBAToOffset(session->volume,2),block_cache_bytes) == -1 )
+            {
+                printf("Error: Unable to allocate the block cache\n");
+            }
+        }
+    }
+    
+    printf("Block cache: %zu bytes",block_cache_bytes);
+    if( session->volume != NULL )
+    {
+        struct BlockCache *cache = &session->volume->block_cache;
+        
+        pthread_mutex_lock(&cache->lock);
+        printf(", %zu of %zu blocks of %zu bytes in use",cache->used,cache->capacity,cache->block_size);
+        pthread_mutex_unlock(&cache->lock);
+    }
+    printf("\nHits: %llu Misses: %llu Evictions: %llu\n",
+        (unsigned long long)atomic_load(&stat_counters[STAT_BLOCK_HITS]),
+        (unsigned long long)atomic_load(&stat_counters[STAT_BLOCK_MISSES]),
+        (unsigned long long)atomic_load(&stat_counters[STAT_BLOCK_EVICTIONS]));
+}
+
+
+//Show the sidecar metadata index, build it from a full scan, or delete it: index [build|drop]
+
+static void RunIndex( struct Session *session, char **token )
+{
+    if( token[1] != NULL && strcmp(token[1],"build") == 0 )
+    {
+        uint64_t start = StatClock();
+        
+        if( IndexBuild(session->volume) == -1 )
+        {
+            printf("Error: Unable to write %s\n",session->volume->index_path);
+            return;
+        }
+        printf("Indexed in %.3f s\n",( StatClock() - start ) / 1e9);
+    }
+    else if( token[1] != NULL && strcmp(token[1],"drop") == 0 )
+    {
+        IndexRemove(session->volume);
+    }
+    else if( token[1] != NULL )
+    {
+        printf("Error: index takes build or drop\n");
+        return;
+    }
+    
+    if( session->volume->index == NULL )
+    {
+        printf("Index: none\n");
+    }
+    else
+    {
+        printf("Index: %s, %u directories, %u files, %llu bytes\n",session->volume->index_path,session->volume->index->directory_count,
+            session->volume->index->file_count,(unsigned long long)session->volume->index->size);
+    }
+}
+
+
+//List the contiguous cluster runs making up a file
+
+static void RunExtents( struct Session *session, char **token )
+{
+    struct DirectoryEntry entry; //Entry of the file, the name may be a full path
+    
+    if( token[1] == NULL )
+    {
+        printf("Error: File not found\n");
+    }
+    else
+    {
+        if( ResolvePath(session->volume,session->current_path,token[1],&entry) == -1 )
+        {
+            printf("Error: File not found\n");
+        }
+        else
+        {
+            struct Extent *extents = NULL;
+            int extent_count = BuildExtents(session->volume,FirstCluster(&entry),&extents);
+            uint32_t total_clusters = 0;
+            int i = 0;
+            
+            for( i = 0; i < extent_count; i++ )
+            {
+                printf("Extent %d: Starting Cluster Number: %x Clusters: %u Offset: %llx\n",
+                    i,extents[i].start_cluster,extents[i].length,(unsigned long long)LBAToOffset(session->volume,extents[i].start_cluster));
+                total_clusters += extents[i].length;
+            }
+            printf("Total: %d extent(s), %u cluster(s)\n",extent_count < 0 ? 0 : extent_count,total_clusters);
+            
+            free(extents);
+        }
+    }
+}
+
+
+//List every path below a directory whose name matches a pattern
+
+static void RunFind( struct Session *session, char **token )
+{
+    if( token[1] == NULL )
+    {
+        printf("Error: find needs a pattern\n");
+    }
+    else
+    {
+        FindCommand(session,token[1],token[2] != NULL ? token[2] : "/");
+    }
+}
+
+
+//Report the size of every directory below a path
+
+static void RunDu( struct Session *session, char **token )
+{
+    DuCommand(session,token[1] != NULL ? token[1] : session->current_path);
+}
+
+
+//Show or clear the instrumentation counters and latency histograms: stats [reset|json]
+
+static void RunStats( struct Session *session, char **token )
+{
+    (void)session;
+    
+    if( token[1] != NULL && strcmp(token[1],"reset") == 0 )
+    {
+        StatsReset();
+    }
+    else if( token[1] != NULL && strcmp(token[1],"json") == 0 )
+    {
+        StatsPrint(stdout,1);
+    }
+    else if( token[1] != NULL )
+    {
+        printf("Error: stats takes reset or json\n");
+    }
+    else
+    {
+        StatsPrint(stdout,0);
+    }
+}
+
+
+static const struct Command command_table[] =
+{
+    { "open", RunOpen, 0, 1 },
+    { "close", RunClose, 0, 1 },
+    { "quit", RunQuit, 0, 0 },
+    { "info", RunInfo, 1, 1 },
+    { "stat", RunStat, 1, 1 },
+    { "get", RunGet, 1, 1 },
+    { "put", RunPut, 1, 0 },
+    { "defrag", RunDefrag, 1, 0 },
+    { "sum", RunSum, 1, 0 },
+    { "mget", RunMget, 1, 0 },
+    { "export", RunExport, 1, 0 },
+    { "cd", RunCd, 1, 1 },
+    { "ls", RunLs, 1, 1 },
+    { "read", RunRead, 1, 1 },
+    { "readahead", RunReadahead, 1, 0 },
+    { "cache", RunCache, 0, 0 },
+    { "index", RunIndex, 1, 0 },
+    { "extents", RunExtents, 1, 0 },
+    { "find", RunFind, 1, 0 },
+    { "du", RunDu, 1, 0 },
+    { "df", RunDf, 1, 0 },
+    { "fsck", RunFsck, 1, 0 },
+    { "stats", RunStats, 0, 0 },
+};
+
+#define COMMAND_COUNT ( sizeof(command_table) / sizeof(command_table[0]) )
+
+struct Histogram command_latency[COMMAND_COUNT]; //Wall time of every command, by command_table index
+
+
+//Find a command by name. The open addressing table is built on first use. Returns NULL for unknown names.
+
+static const struct Command * LookupCommand( const char *name )
+{
+    static const struct Command *buckets[COMMAND_BUCKETS];
+    static int built = 0;
+    uint32_t slot = 0;
+    size_t i = 0;
+    
+    if( !built )
+    {
+        for( i = 0; i < sizeof(command_table) / sizeof(command_table[0]); i++ )
+        {
+            for( slot = HashPath( command_table[i].name ) & ( COMMAND_BUCKETS - 1 ); buckets[slot] != NULL;
+                    slot = ( slot + 1 ) & ( COMMAND_BUCKETS - 1 ) );
+            buckets[slot] = &command_table[i];
+        }
+        built = 1;
+    }
+    
+    for( slot = HashPath( name ) & ( COMMAND_BUCKETS - 1 ); buckets[slot] != NULL; slot = ( slot + 1 ) & ( COMMAND_BUCKETS - 1 ) )
+    {
+        if( strcmp( buckets[slot]->name, name ) == 0 )
+        {
+            return buckets[slot];
+        }
+    }
+    return NULL;
+}
+
 
-#define MAX_NUM_ARGUMENTS 5     // Mav shell only supports five arguments
+//Daemon mode: a file system image held open for every client that opens it. Images stay open,
+//their caches warm, until the daemon exits.
+struct ServedImage
+{
+    char *path; //Canonical host path
+    struct Volume *volume;
+    struct ServedImage *next;
+};
 
-#define MAX_DIRECTORY_ENTRIES 16 //Maximum directory entries supported is 16
+struct ServedImage *served_images = NULL; //Every image the daemon holds open
+pthread_mutex_t served_lock = PTHREAD_MUTEX_INITIALIZER; //Guards served_images
+int remote_fd = -1; //Client mode: connection to the daemon, -1 when commands run here
 
-//FAT32 file system image specification
-int16_t BPB_BytsPerSec = 0;
-int8_t BPB_SecPerClus = 0;
-int16_t BPB_RsvdSecCnt = 0;
-int8_t BPB_NumFATs = 0;
-int16_t BPB_RootEntCnt = 0;
-int32_t BPB_FATSz32 = 0;
 
+//Find the served image at path, opening it on first use. Returns NULL if it cannot be opened.
 
-//Directory specification structure
-struct __attribute__((__packed__)) DirectoryEntry
+struct Volume * ServeImage( const char *path, int use_mmap )
 {
-    char DIR_Name[11];
-    uint8_t DIR_Attr;
-    uint8_t Unused1[8];
-    uint16_t DIR_FirstClusterHigh;
-    uint8_t Unused2[4];
-    uint16_t DIR_FirstClusterLow;
-    uint32_t DIR_FileSize;
-};
+    char canonical[PATH_MAX];
+    struct ServedImage *image = NULL;
+    struct Volume *result = NULL;
+    
+    if( realpath( path, canonical ) == NULL )
+    {
+        return NULL;
+    }
+    
+    pthread_mutex_lock( &served_lock );
+    for( image = served_images; image != NULL && strcmp( image->path, canonical ) != 0; image = image->next );
+    if( image == NULL && ( image = calloc( 1, sizeof(struct ServedImage) ) ) != NULL )
+    {
+        image->path = strdup( canonical );
+        image->volume = image->path != NULL ? VolumeOpen( canonical, use_mmap, block_cache_bytes ) : NULL;
+        if( image->volume == NULL )
+        {
+            free( image->path );
+            free( image );
+            image = NULL;
+        }
+        else
+        {
+            image->volume->readahead_window = readahead_window;
+            image->next = served_images;
+            served_images = image;
+        }
+    }
+    result = image != NULL ? image->volume : NULL;
+    pthread_mutex_unlock( &served_lock );
+    return result;
+}
 
-struct DirectoryEntry dir[MAX_DIRECTORY_ENTRIES]; //Structure for the current directory
 
-FILE *fp = NULL; //File pointer
-char file_closed = 'Y'; //File status
-int root_address = 0; //Address of root directory
-int directory_path[MAX_DIRECTORY_ENTRIES + 1]; //Array to store the current directory path starting from the root directory
-int directory_path_pointer = 0; //Pointer to check which directory the user is currently at in the file system image
+//Host path of a path given by a session: a daemon client's relative paths are taken from its working
+//directory, the shell's stay relative. Returns 0 on success, -1 if the result does not fit.
 
+int SessionHostPath( const struct Session *session, const char *path, char host[PATH_MAX] )
+{
+    int length = path[0] == '/' || session->cwd[0] == '\0' ? snprintf( host, PATH_MAX, "%s", path ) :
+                                                             snprintf( host, PATH_MAX, "%s/%s", session->cwd, path );
+    
+    return length < PATH_MAX ? 0 : -1;
+}
 
-//FUNCTIONS
-int LBAToOffset( int32_t sector );
-int16_t NextLB( uint32_t sector );
-int compare(char input[]);
 
+//Run one client command. Its output is ended with a NUL byte, which is how the client knows it is complete.
+//Returns -1 once the client cannot be written to.
 
-int main()
+static int ServeCommand( struct Session *session, struct CommandLine *command )
 {
-  char * cmd_str = (char*) malloc( MAX_COMMAND_SIZE );
-
-  while( 1 )
-  {
-    printf ("mfs> ");
-
-    //Read the command from the commandline.  The
-    //maximum command that will be read is MAX_COMMAND_SIZE
-    //This while command will wait here until the user
-    //inputs something since fgets returns NULL when there
-    //is no input
-    while( !fgets (cmd_str, MAX_COMMAND_SIZE, stdin) );
-
-    //Parse input
-    char *token[MAX_NUM_ARGUMENTS];
-
-    int token_count = 0;
-                                                           
-    // Pointer to point to the token
-    // parsed by strsep
-    char *arg_ptr;
-                                                           
-    char *working_str  = strdup( cmd_str );
-
-    //We are going to move the working_str pointer so
-    //keep track of its original value so we can deallocate
-    //the correct amount at the end
-    char *working_root = working_str;
-
-    //Tokenize the input stringswith whitespace used as the delimiter
-    while ( ( (arg_ptr = strsep(&working_str, WHITESPACE) ) != NULL ) &&
-              ( token_count<MAX_NUM_ARGUMENTS ) )
-    {
-      token[token_count] = strndup( arg_ptr, MAX_COMMAND_SIZE );
-      if( strlen( token[token_count] ) == 0 )
-      {
-        token[token_count] = NULL;
-      }
-        token_count++;
-    }
-
-    if( fp == NULL && strcmp(token[0],"open") == 0 ) //If file system image hasn't been opened
+    const struct Command *handler = NULL;
+    
+    if( command->token[0] != NULL && command->token[0][0] != '#' )
     {
-        if( ( fp = fopen(token[1],"r")) == NULL )
+        handler = LookupCommand( command->token[0] );
+        if( handler != NULL && !handler->served )
         {
-            printf("Error: File system image not found.\n");
+            handler = NULL;
         }
-        else
+        
+        if( session->current_dir == NULL && ( handler == NULL || handler->needs_image ) )
         {
-            file_closed = 'N'; //This file has not been closed
-            
-            //Load values for file system specification variables when we first open the file
-            
-            fseek(fp,11,SEEK_SET); //Location: Offset byte 11
-            fread(&BPB_BytsPerSec,2,1,fp); //Get the number of bytes in one sector
-            
-            fseek(fp,13,SEEK_SET); //Location: Offset byte 13
-            fread(&BPB_SecPerClus,1,1,fp); //Get the number of sectors in one allocation unit
-            
-            fseek(fp,14,SEEK_SET); //Location: Offset byte  14
-            fread(&BPB_RsvdSecCnt,2,1,fp); //Get the  number of reserved sectors  in the Reserved region of the volume
-            
-            fseek(fp,16,SEEK_SET); //Location: Offset byte 16
-            fread(&BPB_NumFATs,1,1,fp); //Get the count of FAT data structures in the volume
-            
-            fseek(fp,17,SEEK_SET); //Location: Offset byte 17
-            fread(&BPB_RootEntCnt,2,1,fp); //Get the count of 32 byte directory entries in the root directory (FAT 12 and 16 volumes),
-                                                //value should be 0 for FAT 32 volumes
-            
-            fseek(fp,36,SEEK_SET); //Location: Offset byte 36
-            fread(&BPB_FATSz32,4,1,fp); //Get the 32 bit count of sectors occupied by ONE FAT (Only defined for FAT 32, 0 for rest)
-            
-            
-            //Calculate the address of the root directory in the file and load as current directory
-            
-            root_address = (BPB_NumFATs * BPB_FATSz32 * BPB_BytsPerSec) +
-                                    (BPB_RsvdSecCnt * BPB_BytsPerSec); // Get the root addres
-            
-            directory_path[directory_path_pointer] = root_address;
-            directory_path_pointer++;
-            
-            fseek(fp,root_address,SEEK_SET);
-            fread(&dir[0],MAX_DIRECTORY_ENTRIES,sizeof(struct DirectoryEntry),fp);
+            fprintf( session->out, "Error: File system image must be open first\n" );
         }
-    }
-    else if( fp != NULL && strcmp(token[0],"open") == 0 ) //If file system image has already been opened, display an error message
-    {
-        printf("Error: File system image already open\n");
-    }
-    else if( strcmp(token[0],"close") == 0 ) //Close the  file
-    {
-        if( fclose(fp) != 0 )
+        else if( handler == NULL )
         {
-            printf("Error: File system image not found\n");
+            fprintf( session->out, "Error: Command not supported\n" );
         }
         else
         {
-            printf("Use quit to exit the program. \n");
-            fp = NULL;
-            file_closed = 'Y';
+            handler->handler( session, command->token );
         }
     }
-    else if( strcmp(token[0],"quit") == 0 )
+    
+    fputc( '\0', session->out );
+    return fflush( session->out ) == EOF ? -1 : 0;
+}
+
+
+//Client thread: the first line is the client's working directory, every further line a command.
+//quit or a closed connection ends the session.
+
+static void * ServeClient( void *arg )
+{
+    struct Session *session = arg;
+    struct CommandLine *command = malloc( sizeof(struct CommandLine) );
+    
+    if( command != NULL && fgets( session->cwd, sizeof(session->cwd), session->in ) != NULL )
     {
-        if( fp == NULL )
-        {
-            exit(0);
-        }
-        else
+        session->cwd[strcspn( session->cwd, "\n" )] = '\0';
+        while( fgets( command->line, MAX_COMMAND_SIZE, session->in ) != NULL )
         {
-            fclose(fp);
-            fp = NULL;
-            file_closed = 'Y';
-            exit(0);
+            ParseCommand( command );
+            if( ( command->token[0] != NULL && strcmp( command->token[0], "quit" ) == 0 ) || ServeCommand( session, command ) == -1 )
+            {
+                break;
+            }
         }
     }
-    else if( file_closed == 'Y' && strlen(*token) > 0 ) //If file system image has been closed but user issues a command
+    
+    if( session->volume != NULL )
     {
-        printf("Error: File system image must be open first\n");
+        DirectoryRelease( session->volume, session->current_dir );
+    }
+    fclose( session->in );
+    fclose( session->out );
+    free( session );
+    free( command );
+    return NULL;
+}
+
+
+//Connect to the daemon's Unix socket at path. Returns the connected socket, or -1 with errno set.
+
+static int SocketConnect( const char *path )
+{
+    struct sockaddr_un address;
+    int fd = -1;
+    
+    memset( &address, 0, sizeof(address) );
+    address.sun_family = AF_UNIX;
+    if( strlen( path ) >= sizeof(address.sun_path) )
+    {
+        errno = ENAMETOOLONG;
+        return -1;
     }
-    else if( strcmp(token[0],"info") == 0 ) //Print information about the specifications of the file system image
+    strcpy( address.sun_path, path );
+    
+    if( ( fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) == -1 )
     {
-        printf(" BPB_BytsPerSec: %d\n BPB_BytsPerSec: %x\n\n BPB_SecPerClus: %d\n BPB_SecPerClus: %x\n\n BPB_RsvdSecCnt: %d\n BPB_RsvdSecCnt: %x\n\n BPB_NumFATs: %d\n BPB_NumFATs: %x\n\n BPB_FATSz32: %d\n BPB_FATSz32: %x\n\n",
-                 BPB_BytsPerSec,BPB_BytsPerSec,
-                 BPB_SecPerClus,BPB_SecPerClus,
-                 BPB_RsvdSecCnt,BPB_RsvdSecCnt,
-                 BPB_NumFATs,BPB_NumFATs,
-                 BPB_FATSz32,BPB_FATSz32);
+        return -1;
     }
-    else if( strcmp(token[0],"stat") == 0 ) //Display the attributes and
-                                            //the starting cluster number of the file or directory name
+    if( connect( fd, (struct sockaddr *)&address, sizeof(address) ) == -1 )
     {
-        char input[MAX_COMMAND_SIZE]; //String to store file name input from user
-        strcpy(input,token[1]);
-        
-        int position = compare(input); //Get the position of the file or sub-directory in the file system image
+        int error = errno;
         
-        if( position == MAX_DIRECTORY_ENTRIES ) //If file or directory cannot be found
-        {
-            printf("Error: File not found\n");
-        }
-        else
+        close( fd );
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+
+//Daemon mode: hold the images open and serve the clients connecting to the Unix socket at path, one
+//thread per client, each with its own current directory over the shared images and their caches.
+//Only commands that read the image are served. Returns only on failure.
+
+int Serve( const char *path, char **images, int image_count )
+{
+    struct sockaddr_un address;
+    struct stat status;
+    int listener = -1;
+    int i = 0;
+    
+    for( i = 0; i < image_count; i++ )
+    {
+        if( ServeImage( images[i], 1 ) == NULL )
         {
-            printf("Attribute: %x\nSize: %x\nStarting Cluster Number:%x\n",
-                dir[position].DIR_Attr,dir[position].DIR_FileSize,dir[position].DIR_FirstClusterLow);
+            fprintf( stderr, "%s: File system image not found.\n", images[i] );
         }
     }
-    else if( strcmp(token[0],"get") == 0 ) //Print all of the required information about the file system image
+    
+    //A socket left behind by a daemon that is gone is replaced; a live daemon or any other file is not
+    if( lstat( path, &status ) == 0 && S_ISSOCK( status.st_mode ) )
     {
-        char input[MAX_COMMAND_SIZE]; //String to store file name input from user
-        char input_copy[MAX_COMMAND_SIZE]; //Copy of input string
-        
-        strcpy(input,token[1]);
-        strcpy(input_copy,token[1]);
-        
-        int position = compare(input); //Get the position of the file in the file system image
+        int fd = SocketConnect( path );
         
-        if( position == MAX_DIRECTORY_ENTRIES )
-        {
-            printf("Error: File not found\n");
-        }
-        else
+        if( fd != -1 )
         {
-            //Specification for the file in the file system image which is about to be moved to the current local working directory
-            
-            FILE *new_file_fp; //File pointer for file to be placed in current working directory
-            int offset; //Starting address for file
-            int next_block_address; //Logical adress for next cluster block
-            int next_block_offset; //Offset of next block in the file system image
-            int total_clusters = ( dir[position].DIR_FileSize % BPB_BytsPerSec ) == 0 ?
-                                        ( dir[position].DIR_FileSize / BPB_BytsPerSec ) :
-                                            (dir[position].DIR_FileSize / BPB_BytsPerSec ) + 1; //Total number of clusters for the file
-            int rem_byts_last_cluster = BPB_BytsPerSec -
-                                    ( total_clusters * BPB_BytsPerSec - dir[position].DIR_FileSize ); //Total bytes                                                                        in the last cluster of the file
-            char file_data[BPB_BytsPerSec+1]; //Array to store file data
-            
-            if(dir[position].DIR_FileSize <= BPB_BytsPerSec) //If the total file fits only one cluster
-            {
-                offset = LBAToOffset(dir[position].DIR_FirstClusterLow);
-                fseek(fp,offset,SEEK_SET);
-                fread(file_data,dir[position].DIR_FileSize,1,fp);
-                file_data[dir[position].DIR_FileSize] = '\0';
-                new_file_fp = fopen(input_copy,"w+");
-                fprintf(new_file_fp,"%s", file_data);
-                fclose(new_file_fp);
-            }
-            else //If the file spans across two or  more clusters
-            {
-                offset = LBAToOffset(dir[position].DIR_FirstClusterLow);
-                fseek(fp,offset,SEEK_SET);
-                fread(file_data,BPB_BytsPerSec,1,fp);
-                file_data[BPB_BytsPerSec] = '\0';
-                new_file_fp = fopen(input_copy,"w+");
-                fprintf(new_file_fp,"%s", file_data);
-
-                next_block_address = NextLB(dir[position].DIR_FirstClusterLow);
-                next_block_offset = LBAToOffset(next_block_address);
-                
-                while( next_block_address != -1 ) //Go over all the clusters and copy data from the file in the file system                                         image to the new file  in the current working directory
-                {
-                    if( NextLB(next_block_address) == -1 )
-                    {
-                        char file_data_last[rem_byts_last_cluster+1]; //Array to store file data
-                        fseek(fp,next_block_offset,SEEK_SET);
-                        fread(file_data_last,rem_byts_last_cluster,1,fp);
-                        file_data[rem_byts_last_cluster] = '\0';
-                        fprintf(new_file_fp,"%s", file_data_last);
-                    }
-                    else
-                    {
-                        fseek(fp,next_block_offset,SEEK_SET);
-                        fread(file_data,BPB_BytsPerSec,1,fp);
-                        file_data[BPB_BytsPerSec] = '\0';
-                        fprintf(new_file_fp,"%s", file_data);
-                    }
-                    next_block_address = NextLB(next_block_address);
-                    next_block_offset = LBAToOffset(next_block_address);
-                }
-                fclose(new_file_fp);
-            }
+            close( fd );
+            fprintf( stderr, "%s: Already served by another daemon\n", path );
+            return -1;
         }
+        unlink( path );
     }
-    else if( strcmp(token[0],"cd") == 0 ) //Change directories
+    
+    memset( &address, 0, sizeof(address) );
+    address.sun_family = AF_UNIX;
+    if( strlen( path ) >= sizeof(address.sun_path) )
     {
-        if( token[1] == NULL || (token[1] != NULL && strcmp(token[1],".") == 0) )
-        {
-            directory_path_pointer = 1;
-            
-            fseek(fp,root_address,SEEK_SET);
-            fread(&dir[0],16,sizeof(struct DirectoryEntry),fp); //Set the previous directory as the current directory
-        }
-        else
-        {
-            // Parse input
-            char * input[MAX_COMMAND_SIZE];
-
-            int input_count = 0;
-                                                                   
-            //Pointer to point to the token
-            //parsed by strsep
-            char *arg_ptr;
-                                                                   
-            char *working_str  = strdup( token[1] );
-
-            //We are going to move the working_str pointer so
-            //keep track of its original value so we can deallocate
-            //the correct amount at the end
-            char *working_root = working_str;
-
-            //Tokenize the input strings with / used as the delimiter
-            while ( ( (arg_ptr = strsep(&working_str, "/" ) ) != NULL) &&
-                      (token_count<MAX_NUM_ARGUMENTS))
-            {
-              input[input_count] = strndup( arg_ptr, MAX_COMMAND_SIZE );
-              if( strlen( input[input_count] ) == 0 )
-              {
-                input[input_count] = NULL;
-              }
-                input_count++;
-            }
-            
-            int token_index  = 0;
-            for( token_index = 0; token_index < input_count; token_index ++ )
-            {
-                if( strcmp(input[token_index],".") == 0)
-                {
-                    directory_path_pointer = 1;
-                    
-                    fseek(fp,root_address,SEEK_SET);
-                    fread(&dir[0],16,sizeof(struct DirectoryEntry),fp); //Set the previous directory as the current directory
-                }
-                else if( strcmp(input[token_index],"..") == 0 )
-                {
-                    if( directory_path_pointer - 1 == 0 )
-                    {
-                        printf("Already at root directory.\n");
-                    }
-                    else
-                    {
-                        directory_path_pointer--;
-                        
-                        int offset = directory_path[directory_path_pointer - 1] == root_address ? root_address : LBAToOffset(directory_path[directory_path_pointer - 1]); //If we are changing directory to root
-                                                                                                                                                                          //then we don't need to calculate offset
-                        
-                        fseek(fp,offset,SEEK_SET);
-                        fread(&dir[0],16,sizeof(struct DirectoryEntry),fp); 
-                    }
-                }
-                else
-                {
-                    int position = compare(input[token_index]); //Get the position of the sub-directory in the file system image
-                    
-                    if( position == MAX_DIRECTORY_ENTRIES )
-                    {
-                        printf("%s: No such file or directory.\n",input[token_index]);
-                        break;
-                    }
-                    else //If sub-directory exists change it to current directory and update directory path
-                    {
-                        directory_path[directory_path_pointer] = dir[position].DIR_FirstClusterLow;
-                        directory_path_pointer++;
-                        
-                        int offset = LBAToOffset(dir[position].DIR_FirstClusterLow);
-                        
-                        fseek(fp,offset,SEEK_SET);
-                        fread(&dir[0],16,sizeof(struct DirectoryEntry),fp); //Set the sub-directory as the current directory
-                    }
-                }
-            }
-            
-            free(working_root);
-        }
+        fprintf( stderr, "%s: %s\n", path, strerror( ENAMETOOLONG ) );
+        return -1;
+    }
+    strcpy( address.sun_path, path );
+    
+    if( ( listener = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) == -1 ||
+            bind( listener, (struct sockaddr *)&address, sizeof(address) ) == -1 || listen( listener, SERVE_BACKLOG ) == -1 )
+    {
+        fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+        return -1;
     }
-    else if( strcmp(token[0],"ls") == 0 ) //List the files and sub-directories in the current directory
+    
+    signal( SIGPIPE, SIG_IGN ); //A client that went away shows up as a failed write
+    LookupCommand( "open" ); //Build the command lookup table before the client threads share it
+    
+    while( 1 )
     {
-        if( token[1] != NULL && strcmp(token[1],"..") == 0 )
+        int fd = accept4( listener, NULL, NULL, SOCK_CLOEXEC );
+        int copy = -1;
+        struct Session *session = NULL;
+        pthread_t thread;
+        
+        if( fd == -1 )
         {
-            if( directory_path_pointer - 1 == 0 )
-            {
-                printf("Already at root directory. Use ls\n");
-            }
-            else //Create a temporary directory structure to hold preceding directory data
+            if( errno == EINTR || errno == ECONNABORTED )
             {
-                struct DirectoryEntry temp_dir[MAX_DIRECTORY_ENTRIES]; //Structure for the temporary directory
-                int temp_directory_path_pointer = directory_path_pointer - 1; //Temporary directory path pointer
-                int offset = directory_path[temp_directory_path_pointer - 1] == root_address ? root_address : LBAToOffset(directory_path[temp_directory_path_pointer - 1]); //If we are changing directory to root
-                                                                                                                                                                            //then we don't need to calculate offset
-                fseek(fp,offset,SEEK_SET);
-                fread(&temp_dir[0],16,sizeof(struct DirectoryEntry),fp); //Set the previous directory as the current directory
-                
-                int i = 0; //Loop variable
-                int j = 0; //Loop variable
-                
-                for ( i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
-                {
-                    char substring[12];
-                    for ( j = 0; j < 11; j++)
-                    {
-                        substring[j] = temp_dir[i].DIR_Name[j];
-                    }
-                    substring[11] = '\0'; //Create substring of file name for each file in directory entry array
-                    
-                    if ((temp_dir[i].DIR_Attr == 0x01 || temp_dir[i].DIR_Attr == 0x10
-                        || temp_dir[i].DIR_Attr == 0x20) && temp_dir[i].DIR_Name[0] != '\xE5')
-                    {
-                        printf("%s\n",substring);
-                    }
-                }
+                continue;
             }
+            fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+            return -1;
         }
-        else
+        
+        if( ( copy = dup( fd ) ) == -1 || ( session = calloc( 1, sizeof(struct Session) ) ) == NULL ||
+                ( session->in = fdopen( fd, "r" ) ) == NULL || ( session->out = fdopen( copy, "w" ) ) == NULL )
         {
-            int i = 0;
-            int j = 0;
-            
-            for ( i = 0; i < MAX_DIRECTORY_ENTRIES; i++ )
+            if( session != NULL && session->in != NULL )
             {
-                char substring[12];
-                for ( j = 0; j < 11; j++)
-                {
-                    substring[j] = dir[i].DIR_Name[j];
-                }
-                substring[11] = '\0'; //Create substring of file name for each file in directory entry array
-                
-                if ( ( dir[i].DIR_Attr == 0x01 || dir[i].DIR_Attr == 0x10
-                    || dir[i].DIR_Attr == 0x20 ) && dir[i].DIR_Name[0] != '\xE5' )
-                {
-                    printf("%s\n",substring);
-                }
+                fclose( session->in );
+                fd = -1;
             }
+            close( fd );
+            close( copy );
+            free( session );
+            continue;
         }
         
+        strcpy( session->current_path, "/" );
+        if( pthread_create( &thread, NULL, ServeClient, session ) != 0 )
+        {
+            fclose( session->in );
+            fclose( session->out );
+            free( session );
+            continue;
+        }
+        pthread_detach( thread );
     }
-    else if( strcmp(token[0],"read") == 0 ) //Print all the required information about the file system image
+}
+
+
+//Client mode: connect to the daemon at path and tell it the working directory host paths are
+//taken from. Returns 0 on success, -1 with a message printed.
+
+int RemoteConnect( const char *path )
+{
+    char cwd[PATH_MAX];
+    char line[PATH_MAX + 1];
+    
+    if( getcwd( cwd, sizeof(cwd) ) == NULL || ( remote_fd = SocketConnect( path ) ) == -1 )
+    {
+        fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+        return -1;
+    }
+    
+    int length = snprintf( line, sizeof(line), "%s\n", cwd );
+    if( send( remote_fd, line, length, MSG_NOSIGNAL ) != length )
     {
+        fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+        return -1;
+    }
+    return 0;
+}
 
-        char input[255]; //String to store file name input from user
-        int start_position = atoi(token[2]); //Position in file to start reading
-        int num_bytes = atoi(token[3]); //Number of bytes given position in file to read
-        int k = 0; //Loop variable
-        
-        strcpy(input,token[1]);
-        
-        int directory_position = compare(input);
 
-        if( directory_position == MAX_DIRECTORY_ENTRIES )
-        {
-            printf("Error: File not found.\n");
-        }
-        else if( start_position + num_bytes > dir[directory_position].DIR_FileSize )
-        {
-            printf("Error: Number of bytes to be read exceeds file size.\n");
-        }
-        else
+//Client mode: send one command to the daemon and copy its output, up to the terminating NUL, to stdout.
+//Losing the daemon ends the session with a failure status.
+
+static void RemoteCommand( struct CommandLine *command )
+{
+    char line[MAX_COMMAND_SIZE + 1];
+    char buffer[OUTPUT_BUFFER_SIZE];
+    int length = 0;
+    int i = 0;
+    
+    for( i = 0; i < command->token_count; i++ ) //The tokens were split in place, join them again
+    {
+        length += snprintf( line + length, sizeof(line) - length, "%s%s", i > 0 ? " " : "", command->token[i] );
+    }
+    line[length++] = '\n';
+    
+    if( send( remote_fd, line, length, MSG_NOSIGNAL ) == length )
+    {
+        while( 1 )
         {
-            char result[num_bytes+1]; //Preprare char array with length 1 greater than no. of bytes to be read
+            ssize_t n = read( remote_fd, buffer, sizeof(buffer) );
             
-            if( num_bytes <= BPB_BytsPerSec)
+            if( n < 0 && errno == EINTR )
             {
-                 int offset = LBAToOffset(dir[directory_position].DIR_FirstClusterLow);
-                
-                 fseek(fp,offset + start_position,SEEK_SET);
-                 fread(result,num_bytes,1,fp);
+                continue;
             }
-            else
+            if( n <= 0 )
             {
-                int offset = LBAToOffset(dir[directory_position].DIR_FirstClusterLow);
-                int next_block_address; //Logical block address for next cluster block
-                int next_block_offset; //Offset of next block in the file system image
-                int read_position_pointer = 0; //Store position for reading bytes into result array
-                
-                fseek(fp,offset,SEEK_SET);
-                fread(&result[read_position_pointer],BPB_BytsPerSec,1,fp);
-                read_position_pointer += BPB_BytsPerSec;
-                
-                next_block_address = NextLB(dir[directory_position].DIR_FirstClusterLow);
-                next_block_offset = LBAToOffset(next_block_address);
-                
-                while( num_bytes > read_position_pointer ) //Loop stops after total bytes to be read is less than total cluster size read. For eg: If num_bytes = 513 then loop stops when read_position_pointer = 1024 after 1 iteration
-                {
-                    if( num_bytes <= read_position_pointer + BPB_BytsPerSec ) //Read the remaining bytes
-                    {
-                        fseek(fp,next_block_offset,SEEK_SET);
-                        fread(&result[read_position_pointer], num_bytes - read_position_pointer ,1,fp);
-                        result[num_bytes] = '\0';
-                        read_position_pointer += BPB_BytsPerSec;
-                    }
-                    else
-                    {
-                        fseek(fp,next_block_offset,SEEK_SET);
-                        fread(&result[read_position_pointer],BPB_BytsPerSec,1,fp);
-                        read_position_pointer += BPB_BytsPerSec;
-                    }
-                    next_block_address = NextLB(next_block_address);
-                    next_block_offset = LBAToOffset(next_block_address);
-                }
+                break;
+            }
+            
+            const char *end = memchr( buffer, '\0', n );
+            fwrite( buffer, 1, end != NULL ? (size_t)( end - buffer ) : (size_t)n, stdout );
+            if( end != NULL )
+            {
+                return;
             }
-
-             while( k != num_bytes ) //Print the output as hex characters in the file
-             {
-                 printf("%x ",result[k]);
-                 k++;
-             }
-             printf("\n");
         }
     }
-    else
-    {
-        printf("Error: Command not supported\n");
-    }
-      
-    free( working_root );
-  }
     
-  return 0;
+    printf("Error: Lost the connection to the daemon\n");
+    Quit( 1 );
 }
 
 
-//Find the starting address of a block of data given the sector number corresponding to that data block
+//Dispatch one parsed command. Blank lines and lines starting with # do nothing.
 
-int LBAToOffset(int32_t sector )
+void RunCommand( struct CommandLine *command )
 {
-    return ( ( sector - 2 ) * BPB_BytsPerSec ) + ( BPB_BytsPerSec *  BPB_RsvdSecCnt )
-                + ( BPB_NumFATs * BPB_FATSz32 * BPB_BytsPerSec );
+    if( command->token[0] == NULL || command->token[0][0] == '#' )
+    {
+        return;
+    }
+    
+    if( remote_fd != -1 && strcmp( command->token[0], "quit" ) != 0 ) //Client mode: the daemon runs it
+    {
+        RemoteCommand( command );
+        return;
+    }
+    
+    const struct Command *handler = LookupCommand( command->token[0] );
+    
+    //If file system image has been closed, or never got a root directory, but user issues a command
+    if( shell.current_dir == NULL && ( handler == NULL || handler->needs_image ) )
+    {
+        printf("Error: File system image must be open first\n");
+    }
+    else if( handler == NULL )
+    {
+        printf("Error: Command not supported\n");
+    }
+    else
+    {
+        uint64_t start = StatClock();
+        
+        handler->handler( &shell, command->token );
+        HistogramRecord( &command_latency[handler - command_table], start );
+    }
 }
 
 
-//Given a logical block address, lookup into the first FAT and return the logical address of the next block in file
-
-int16_t NextLB( uint32_t sector )
+static const char *stat_names[STAT_COUNTERS] =
 {
-    uint32_t FATAddress = ( BPB_BytsPerSec * BPB_RsvdSecCnt ) + (sector * 4 );
-    int16_t val;
-    fseek( fp, FATAddress, SEEK_SET );
-    fread( &val, 2, 1, fp);
-    return val;
-}
+    "image_reads", "image_read_bytes", "pread_calls", "fat_lookups", "output_writes", "output_bytes",
+    "directory_cache_hits", "directory_cache_misses", "path_cache_hits", "path_cache_misses",
+    "cluster_index_hits", "cluster_index_misses", "block_cache_hits", "block_cache_misses", "block_cache_evictions",
+    "image_writes", "image_write_bytes",
+};
+
 
-//Convert input file name or sub-directory name into format from file system image and return the position.
-//Function will return MAX_DIRECCTORY_ENTRIES value if the file or sub-directory cannot be found.
+//Zero every counter and histogram
 
-int compare(char input[])
+void StatsReset( void )
 {
-    //Convert input file name into format from file system image
+    size_t i = 0;
     
-    int i = 0;
-    int j = 0; 
-
-    char expanded_name[MAX_COMMAND_SIZE];
-    memset( expanded_name, ' ', 12 );
-
-    char *token = strtok( input, "." );
-
-    strncpy( expanded_name, token, strlen( token ) );
-
-    token = strtok( NULL, "." );
-
-    if( token )
+    for( i = 0; i < STAT_COUNTERS; i++ )
     {
-      strncpy( (char*)(expanded_name+8), token, strlen(token ) );
+        atomic_store( &stat_counters[i], 0 );
     }
-
-    expanded_name[11] = '\0';
-
-    for(i = 0; i < 11; i++)
+    HistogramReset( &stat_read_latency );
+    HistogramReset( &stat_output_latency );
+    for( i = 0; i < COMMAND_COUNT; i++ )
     {
-      expanded_name[i] = toupper( expanded_name[i] );
+        HistogramReset( &command_latency[i] );
     }
+}
+
+
+//Print the counters and the histograms of commands that ran, as a table or as one JSON object
+
+void StatsPrint( FILE *out, int json )
+{
+    size_t i = 0;
+    int first = 1;
     
-    //Check if file or sub-directory exists in the current directory
-    
-    for (i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
+    if( json )
     {
-        char substring[12];
-        for ( j = 0; j < 11; j++)
+        fprintf( out, "{\"counters\": {" );
+        for( i = 0; i < STAT_COUNTERS; i++ )
         {
-            substring[j] = dir[i].DIR_Name[j];
+            fprintf( out, "%s\"%s\": %llu", i == 0 ? "" : ", ", stat_names[i], (unsigned long long)atomic_load( &stat_counters[i] ) );
         }
-        substring[11] = '\0'; //Create substring of file name for each file in directory entry array
-        
-        if( strcmp(substring,expanded_name) == 0 )
+        fprintf( out, "}, \"latency\": {" );
+        HistogramPrint( out, 1, "image_read", &stat_read_latency, 1 );
+        HistogramPrint( out, 1, "output_write", &stat_output_latency, 0 );
+        fprintf( out, "}, \"commands\": {" );
+        for( i = 0; i < COMMAND_COUNT; i++ )
         {
-            break;
+            if( atomic_load( &command_latency[i].count ) > 0 )
+            {
+                HistogramPrint( out, 1, command_table[i].name, &command_latency[i], first );
+                first = 0;
+            }
         }
+        fprintf( out, "}}\n" );
+        return;
     }
     
-    return i;
+    for( i = 0; i < STAT_COUNTERS; i++ )
+    {
+        fprintf( out, " %-24s %llu\n", stat_names[i], (unsigned long long)atomic_load( &stat_counters[i] ) );
+    }
+    fprintf( out, "\n %-16s %10s %12s %10s %10s %10s\n", "latency", "count", "total_ms", "p50_us", "p99_us", "max_us" );
+    HistogramPrint( out, 0, "image_read", &stat_read_latency, 1 );
+    HistogramPrint( out, 0, "output_write", &stat_output_latency, 0 );
+    for( i = 0; i < COMMAND_COUNT; i++ )
+    {
+        if( atomic_load( &command_latency[i].count ) > 0 )
+        {
+            HistogramPrint( out, 0, command_table[i].name, &command_latency[i], 0 );
+        }
+    }
 }
+